@@ -41,59 +41,114 @@
 
 using namespace std;
 
+#define REFS(b) (*(int *)((b) - HDR_LEN))
+
+unsigned long bufferStore::allocCount = 0;
+
+unsigned long bufferStore::allocations() {
+    return allocCount;
+}
+
+unsigned char *bufferStore::allocate(long size) {
+    __sync_add_and_fetch(&allocCount, 1);
+    unsigned char *p = (unsigned char *)malloc(size + HDR_LEN);
+    assert(p);
+    p += HDR_LEN;
+    REFS(p) = 1;
+    return p;
+}
+
+void bufferStore::release() {
+    if (buff && (__sync_sub_and_fetch(&REFS(buff), 1) == 0))
+	::free(buff - HDR_LEN);
+    buff = 0;
+}
+
 bufferStore::bufferStore()
-    : len(0)
+    : len(HEADROOM)
     , lenAllocd(0)
-    , start(0)
+    , start(HEADROOM)
+    , headroom(HEADROOM)
     , buff(0)
 {
 }
 
 bufferStore::bufferStore(const bufferStore &a)
-    : start(0)
+    : len(a.len)
+    , lenAllocd(a.lenAllocd)
+    , start(a.start)
+    , headroom(a.headroom)
+    , buff(a.buff)
+{
+    if (buff)
+	__sync_add_and_fetch(&REFS(buff), 1);
+}
+
+bufferStore::bufferStore(const bufferStore &a, long off, long _len)
+    : len(a.len)
+    , lenAllocd(a.lenAllocd)
+    , start(a.start)
+    , headroom(a.headroom)
+    , buff(a.buff)
 {
-    lenAllocd = (a.getLen() > MIN_LEN) ? a.getLen() : MIN_LEN;
-    buff = (unsigned char *)malloc(lenAllocd);
-    assert(buff);
-    len = a.getLen();
-    memcpy(buff, a.getString(0), len);
+    if (buff)
+	__sync_add_and_fetch(&REFS(buff), 1);
+    start += off;
+    if (start > len)
+	start = len;
+    if ((_len >= 0) && (start + _len < len))
+	len = start + _len;
 }
 
 bufferStore::bufferStore(const unsigned char *_buff, long _len)
-    : start(0)
+    : start(HEADROOM)
+    , headroom(HEADROOM)
 {
-    lenAllocd = (_len > MIN_LEN) ? _len : MIN_LEN;
-    buff = (unsigned char *)malloc(lenAllocd);
-    assert(buff);
-    len = _len;
-    memcpy(buff, _buff, len);
+    lenAllocd = (_len + start > MIN_LEN) ? _len + start : MIN_LEN;
+    buff = allocate(lenAllocd);
+    len = start + _len;
+    memcpy(buff + start, _buff, _len);
 }
 
 bufferStore &bufferStore::operator =(const bufferStore &a) {
     if (this != &a) {
-        checkAllocd(a.getLen());
-        len = a.getLen();
-        memcpy(buff, a.getString(0), len);
-        start = 0;
+	if (a.buff)
+	    __sync_add_and_fetch(&REFS(a.buff), 1);
+	release();
+	buff = a.buff;
+	lenAllocd = a.lenAllocd;
+	len = a.len;
+	start = a.start;
+	headroom = a.headroom;
     }
     return *this;
 }
 
 void bufferStore::init() {
-    start = 0;
-    len = 0;
+    // Don't scribble over content, which is still used elsewhere.
+    if (buff && (REFS(buff) > 1)) {
+	release();
+	lenAllocd = 0;
+    }
+    start = headroom;
+    len = headroom;
 }
 
 void bufferStore::init(const unsigned char *_buff, long _len) {
-    checkAllocd(_len);
-    start = 0;
-    len = _len;
-    memcpy(buff, _buff, len);
+    init();
+    checkAllocd(len + _len);
+    memcpy(&buff[len], _buff, _len);
+    len += _len;
+}
+
+void bufferStore::setHeadroom(long n) {
+    headroom = (n < 0) ? 0 : n;
+    if (empty())
+	start = len = headroom;
 }
 
 bufferStore::~bufferStore() {
-    if (buff)
-	::free(buff);
+    release();
 }
 
 unsigned long bufferStore::getLen() const {
@@ -115,6 +170,10 @@ u_int32_t bufferStore::getDWord(long pos) const {
 	(buff[pos+start+3] << 24);
 }
 
+u_int64_t bufferStore::getQWord(long pos) const {
+    return getDWord(pos) + ((u_int64_t)getDWord(pos + 4) << 32);
+}
+
 const char * bufferStore::getString(long pos) const {
     return (const char *)buff + pos + start;
 }
@@ -144,13 +203,30 @@ void bufferStore::discardFirstBytes(int n) {
 }
 
 void bufferStore::checkAllocd(long newLen) {
-    if (newLen >= lenAllocd) {
+    long newAllocd = lenAllocd;
+
+    if (newLen >= newAllocd) {
 	do {
-	    lenAllocd = (lenAllocd < MIN_LEN) ? MIN_LEN : (lenAllocd * 2);
-	} while (newLen >= lenAllocd);
-	assert(lenAllocd);
-	buff = (unsigned char *)realloc(buff, lenAllocd);
+	    newAllocd = (newAllocd < MIN_LEN) ? MIN_LEN : (newAllocd * 2);
+	} while (newLen >= newAllocd);
+    }
+    if (buff && (REFS(buff) > 1)) {
+	// Shared: make a private copy, keeping the offsets.
+	unsigned char *nbuff = allocate(newAllocd);
+	memcpy(nbuff + start, buff + start, len - start);
+	release();
+	buff = nbuff;
+	lenAllocd = newAllocd;
+    } else if (!buff || (newAllocd != lenAllocd)) {
+	__sync_add_and_fetch(&allocCount, 1);
+	if (buff)
+	    buff = (unsigned char *)realloc(buff - HDR_LEN, newAllocd + HDR_LEN);
+	else
+	    buff = (unsigned char *)malloc(newAllocd + HDR_LEN);
 	assert(buff);
+	buff += HDR_LEN;
+	REFS(buff) = 1;
+	lenAllocd = newAllocd;
     }
 }
 
@@ -179,15 +255,23 @@ void bufferStore::addBytes(const unsigned char *s, int l) {
 
 void bufferStore::addBuff(const bufferStore &s, long maxLen) {
     long l = s.getLen();
-    checkAllocd(len + l);
     if ((maxLen >= 0) && (maxLen < l))
 	l = maxLen;
     if (l > 0) {
-	memcpy(&buff[len], s.getString(0), l);
+	// Keep a reference, s may share our storage.
+	bufferStore tmp(s);
+	checkAllocd(len + l);
+	memcpy(&buff[len], tmp.getString(0), l);
 	len += l;
     }
 }
 
+unsigned char *bufferStore::extend(long l) {
+    checkAllocd(len + l);
+    len += l;
+    return &buff[len - l];
+}
+
 void bufferStore::addWord(int a) {
     checkAllocd(len + 2);
     buff[len++] = a & 0xff;
@@ -202,23 +286,46 @@ void bufferStore::addDWord(long a) {
     buff[len++] = (a>>24) & 0xff;
 }
 
+void bufferStore::addQWord(u_int64_t a) {
+    addDWord(a & 0xffffffff);
+    addDWord(a >> 32);
+}
+
 void bufferStore::truncate(long newLen) {
-    if (newLen < len)
-	len = newLen;
+    if ((newLen >= 0) && (newLen < (len - start)))
+	len = start + newLen;
+}
+
+void bufferStore::checkHeadroom(long n) {
+    // Make sure, we own the storage.
+    checkAllocd(len);
+    if (start < n) {
+	// Out of headroom: Move the content and reserve new headroom.
+	long shift = n - start + headroom;
+	checkAllocd(len + shift);
+	memmove(&buff[start + shift], &buff[start], len - start);
+	start += shift;
+	len += shift;
+    }
+}
+
+void bufferStore::reserve(long n) {
+    if (start + n > lenAllocd)
+	checkAllocd(start + n);
+    else if (buff && (REFS(buff) > 1))
+	checkAllocd(len);
 }
 
 void bufferStore::prependByte(unsigned char cc) {
-    checkAllocd(len + 1);
-    memmove(&buff[1], buff, len++);
-    buff[0] = cc;
+    checkHeadroom(1);
+    buff[--start] = cc;
 }
 
 void bufferStore::prependWord(int a) {
-    checkAllocd(len + 2);
-    memmove(&buff[2], buff, len);
-    len += 2;
-    buff[0] = a & 0xff;
-    buff[1] = (a>>8) & 0xff;
+    checkHeadroom(2);
+    start -= 2;
+    buff[start] = a & 0xff;
+    buff[start + 1] = (a>>8) & 0xff;
 }
 
 /*
@@ -64,8 +64,23 @@ public:
     */
     bufferStore(const bufferStore &);
 
+    /**
+    * Constructs a new bufferStore, which shares
+    * a part of the content of another one.
+    *
+    * @param b The bufferStore, whose content is shared.
+    * @param off Offset of the first shared byte in @p b .
+    * @param len Number of bytes to share. If @p len is less
+    *            than 0 or exceeds the remaining content of
+    *            @p b , everything from @p off is shared.
+    */
+    bufferStore(const bufferStore &b, long off, long len = -1);
+
     /**
     * Copies a bufferStore.
+    *
+    * The content is shared with @p b until one
+    * of the two instances is modified.
     */
     bufferStore &operator =(const bufferStore &);
 
@@ -104,6 +119,15 @@ public:
     */
     u_int32_t getDWord(long pos = 0) const;
 
+    /**
+    * Retrieves the qword at index <em>pos</em>.
+    *
+    * @param pos The index of the qword to retrieve.
+    *
+    * @returns The value of the qword at index <em>pos</em>
+    */
+    u_int64_t getQWord(long pos = 0) const;
+
     /**
     * Retrieves the characters at index <em>pos</em>.
     *
@@ -178,6 +202,13 @@ public:
     */
     void addDWord(long dw);
 
+    /**
+    * Appends a qword to the content of this instance.
+    *
+    * @param qw The qword to append.
+    */
+    void addQWord(u_int64_t qw);
+
     /**
     * Appends a string to the content of this instance.
     *
@@ -217,6 +248,16 @@ public:
     */
     void addBuff(const bufferStore &b, long maxLen = -1);
 
+    /**
+    * Appends uninitialized space to the content of this instance.
+    *
+    * @param len Number of bytes to append.
+    *
+    * @returns A pointer to the appended bytes, which
+    *          must be filled in by the caller.
+    */
+    unsigned char *extend(long len);
+
     /**
     * Truncates the buffer.
     * If the buffer is smaller, does nothing.
@@ -225,8 +266,20 @@ public:
     */
     void truncate(long newLen);
 
+    /**
+    * Sets the number of bytes, which are reserved in front of
+    * the content for later calls of @ref prependByte or
+    * @ref prependWord . Takes effect immediately, if the buffer
+    * is empty, otherwise at the next call of @ref init .
+    *
+    * @param n The new headroom in bytes.
+    */
+    void setHeadroom(long n);
+
     /**
     * Prepends a byte to the content of this instance.
+    * As long as there is headroom left, this does
+    * not move the content.
     *
     * @param c The byte to append.
     */
@@ -234,20 +287,47 @@ public:
 
     /**
     * Prepends a word to the content of this instance.
+    * As long as there is headroom left, this does
+    * not move the content.
     *
     * @param w The word to append.
     */
     void prependWord(int);
 
+    /**
+    * Reserves storage for at least @p n bytes of content,
+    * so that appending up to that size does not reallocate.
+    * Makes the storage private, if it is shared.
+    *
+    * @param n The number of bytes to reserve.
+    */
+    void reserve(long n);
+
+    /**
+    * Retrieves the number of buffer allocations and reallocations
+    * of all instances so far. Used for statistics only.
+    *
+    * @returns The number of allocations.
+    */
+    static unsigned long allocations();
+
 private:
     void checkAllocd(long newLen);
+    void checkHeadroom(long n);
+    void release();
+
+    static unsigned char *allocate(long size);
+    static unsigned long allocCount;
 
     long len;
     long lenAllocd;
     long start;
+    long headroom;
     unsigned char * buff;
 
-    enum c { MIN_LEN = 300 };
+    // HDR_LEN bytes in front of buff hold the reference count.
+    // HEADROOM is the default space reserved for prepending headers.
+    enum c { MIN_LEN = 300, HDR_LEN = sizeof(long), HEADROOM = 8 };
 };
 
 inline bool bufferStore::empty() const {
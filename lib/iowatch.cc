@@ -28,30 +28,46 @@
 #include "iowatch.h"
 
 #include <unistd.h>
-#include <stdio.h>
-#include <sys/time.h>
-#include <sys/types.h>
-#include <memory.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 IOWatch::IOWatch() {
     num = 0;
-    io = new int [FD_SETSIZE];
-    memset(io, -1, FD_SETSIZE);
+    max = 0;
+    io = 0;
+#ifdef HAVE_SYS_EPOLL_H
+    epfd = epoll_create(16);
+#else
+    epfd = -1;
+#endif
 }
 
 IOWatch::~IOWatch() {
-    delete [] io;
+    if (epfd != -1)
+	close(epfd);
+    free(io);
 }
 
 void IOWatch::addIO(const int fd) {
-    int pos;
-    for (pos = 0; pos < num && fd < io[pos]; pos++);
-    if (io[pos] == fd)
-	return;
-    for (int i = num; i > pos; i--)
-	io[i] = io[i-1];
-    io[pos] = fd;
-    num++;
+    for (int i = 0; i < num; i++)
+	if (io[i] == fd)
+	    return;
+    if (num == max) {
+	max = max ? (max * 2) : 16;
+	io = (int *)realloc(io, max * sizeof(int));
+    }
+    io[num++] = fd;
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+#endif
 }
 
 void IOWatch::remIO(const int fd) {
@@ -60,27 +76,45 @@ void IOWatch::remIO(const int fd) {
     if (pos != num) {
 	num--;
 	for (int i = pos; i <num; i++) io[i] = io[i+1];
+#ifdef HAVE_SYS_EPOLL_H
+	// Fails harmlessly, if fd has already been closed.
+	struct epoll_event ev;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev);
+#endif
     }
 }
 
 bool IOWatch::watch(const long secs, const long usecs) {
-    if (num > 0) {
-	int maxfd = 0;
-	fd_set iop;
-	FD_ZERO(&iop);
-	for (int i = 0; i < num; i++) {
-	    FD_SET(io[i], &iop);
-	    if (io[i] > maxfd)
-		maxfd = io[i];
-	}
-	struct timeval t;
-	t.tv_usec = usecs;
-	t.tv_sec = secs;
-	return (select(maxfd+1, &iop, NULL, NULL, &t) > 0);
+    int fd;
+    return (wait(&fd, 1, secs * 1000 + usecs / 1000) > 0);
+}
+
+int IOWatch::wait(int *fds, int maxfds, long msecs) {
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev[32];
+    if (maxfds > 32)
+	maxfds = 32;
+    int res = epoll_wait(epfd, ev, maxfds, msecs);
+    for (int i = 0; i < res; i++)
+	fds[i] = ev[i].data.fd;
+    return res;
+#else
+    struct pollfd *pfd = new struct pollfd[num + 1];
+    for (int i = 0; i < num; i++) {
+	pfd[i].fd = io[i];
+	pfd[i].events = POLLIN;
+	pfd[i].revents = 0;
     }
-    sleep(secs);
-    usleep(usecs);
-    return false;
+    int res = poll(pfd, num, msecs);
+    if (res > 0) {
+	res = 0;
+	for (int i = 0; (i < num) && (res < maxfds); i++)
+	    if (pfd[i].revents)
+		fds[res++] = pfd[i].fd;
+    }
+    delete [] pfd;
+    return res;
+#endif
 }
 
 /*
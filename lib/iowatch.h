@@ -25,13 +25,14 @@
 #define _IOWATCH_H_
 
 /**
- * A simple wrapper for select()
+ * A simple wrapper for epoll()
  *
- * IOWatch is a simple wrapper for the select
- * system call. In particular, it takes care
- * of passing the maximum file descriptor
- * argument (arg 1) of select() correctly.
- * IOWatch handles select on read descriptors only.
+ * IOWatch maintains a set of file descriptors
+ * and waits for any of them to become readable.
+ * On systems with epoll, the set is kept in the
+ * kernel, so waiting does not get slower with the
+ * number of descriptors. Otherwise, poll() is used.
+ * IOWatch handles read descriptors only.
  */
 class IOWatch {
 public:
@@ -62,7 +63,7 @@ public:
     void remIO(const int fd);
 
     /**
-    * Performs a select() call.
+    * Waits for any of the descriptors to become readable.
     *
     * @param secs Number of seconds to wait.
     * @param usecs Number of microseconds to wait.
@@ -72,8 +73,23 @@ public:
     */
     bool watch(const long secs, const long usecs);
 
+    /**
+    * Waits for any of the descriptors to become readable
+    * and retrieves the readable descriptors.
+    *
+    * @param fds An array, receiving the readable descriptors.
+    * @param maxfds The size of @p fds .
+    * @param msecs Number of milliseconds to wait, -1 waits forever.
+    *
+    * @return The number of readable descriptors, 0 on timeout
+    *	or -1 on error (including interruption by a signal).
+    */
+    int wait(int *fds, int maxfds, long msecs);
+
 private:
+    int epfd;
     int num;
+    int max;
     int *io;
 };
 
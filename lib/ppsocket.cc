@@ -41,6 +41,8 @@
 #include <ctype.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -89,6 +91,12 @@ ppsocket::~ppsocket()
     }
 }
 
+int ppsocket::
+getSocket() const
+{
+    return m_Socket;
+}
+
 void ppsocket::
 setWatch(IOWatch *watch) {
     if (watch) {
@@ -295,8 +303,6 @@ getBufferStore(bufferStore & a, bool wait)
     */
 
     u_int32_t l;
-    long count = 0;
-    unsigned char *buff;
     unsigned char *bp;
     if (!wait && !dataToGet(0, 0))
 	return 0;
@@ -307,19 +313,17 @@ getBufferStore(bufferStore & a, bool wait)
     l = ntohl(l);
     if (l > 16384)
 	    return -1;
-    bp = buff = new unsigned char[l];
+    // Receive directly into the bufferStore
+    bp = a.extend(l);
     while (l > 0) {
 	int j = recv(bp, l, MSG_NOSIGNAL);
 	if (j == SOCKET_ERROR || j == 0) {
-	    delete[]buff;
+	    a.init();
 	    return -1;
 	}
-	count += j;
 	l -= j;
 	bp += j;
     };
-    a.init(buff, count);
-    delete[]buff;
     return (a.getLen() == 0) ? 0 : 1;
 }
 
@@ -328,20 +332,40 @@ sendBufferStore(const bufferStore & a)
 {
     long l = a.getLen();
     u_int32_t hl = htonl(l);
-    long sent = 0;
     int retries = 0;
     int i;
 
-    bufferStore b;
-    b.addBytes(reinterpret_cast<const unsigned char *>(&hl), sizeof(hl));
-    b.addBuff(a);
+    // Send length and content in one go, without copying the content.
+    struct iovec iov[2];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    iov[0].iov_base = &hl;
+    iov[0].iov_len = sizeof(hl);
+    iov[1].iov_base = const_cast<char *>(a.getString(0));
+    iov[1].iov_len = l;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
     l += 4;
     while (l > 0) {
-	i = send((const char *)b.getString(sent), l, MSG_NOSIGNAL);
-	if (i == SOCKET_ERROR || i == 0)
+	i = sendmsg(m_Socket, &msg, MSG_NOSIGNAL);
+	if (i == SOCKET_ERROR || i == 0) {
+	    if (i < 0)
+		m_LastError = errno;
 	    return (false);
-	sent += i;
+	}
 	l -= i;
+	// Skip, what has been sent already
+	while ((i > 0) && (msg.msg_iovlen > 0)) {
+	    if ((size_t)i < msg.msg_iov->iov_len) {
+		msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + i;
+		msg.msg_iov->iov_len -= i;
+		i = 0;
+	    } else {
+		i -= msg.msg_iov->iov_len;
+		msg.msg_iov++;
+		msg.msg_iovlen--;
+	    }
+	}
 	if (++retries > 5) {
 	    m_LastError = 0;
 	    return (false);
@@ -204,6 +204,13 @@ public:
     * @param watch The IOWatch to register.
     */
     void setWatch(IOWatch *watch);
+
+    /**
+    * Retrieves the file descriptor of this socket.
+    *
+    * @returns The descriptor or -1, if the socket is not open.
+    */
+    int getSocket() const;
 	
 private:
     /**
@@ -31,8 +31,14 @@
 #include "bufferstore.h"
 #include "Enum.h"
 
+#include <fstream>
+#include <string.h>
+
 using namespace std;
 
+/* Granularity, in which copyToPsionDelta compares files */
+#define DELTA_BLOCK 512
+
 ENUM_DEFINITION_BEGIN(rfsv::errs, rfsv::E_PSI_GEN_NONE)
     stringRep.add(rfsv::E_PSI_GEN_NONE,        N_("no error"));
     stringRep.add(rfsv::E_PSI_GEN_FAIL,        N_("general"));
@@ -174,6 +180,112 @@ attr2String(const u_int32_t attr)
     return tmp;
 }
 
+static int
+appendEntry(void *ptr, PlpDirent &e)
+{
+    ((PlpDir *)ptr)->push_back(e);
+    return 1;
+}
+
+Enum<rfsv::errs> rfsv::
+dir(const char * const name, PlpDir &files)
+{
+    files.clear();
+    return dir(name, appendEntry, &files);
+}
+
+Enum<rfsv::errs> rfsv::
+dir(const char * const name, dirCallback_t func, void *ptr, u_int32_t *subdirs)
+{
+    rfsvDirhandle h;
+    Enum<rfsv::errs> res = opendir(PSI_A_HIDDEN | PSI_A_SYSTEM | PSI_A_DIR, name, h);
+
+    if (subdirs)
+	*subdirs = 0;
+    if (res != E_PSI_GEN_NONE)
+	return res;
+    // readdir() only asks for more entries, when it has passed on all
+    // entries of the previous reply.
+    while (res == E_PSI_GEN_NONE) {
+	PlpDirent e;
+	res = readdir(h, e);
+	if (res != E_PSI_GEN_NONE)
+	    break;
+	if (subdirs && (e.getAttr() & PSI_A_DIR))
+	    (*subdirs)++;
+	if (func && !func(ptr, e))
+	    res = E_PSI_FILE_CANCEL;
+    }
+    closedir(h);
+    if (res == E_PSI_FILE_EOF)
+	res = E_PSI_GEN_NONE;
+    return res;
+}
+
+Enum<rfsv::errs> rfsv::
+copyToPsionDelta(const char * const from, const char * const base, const char * const to, u_int32_t &sent, void *ptr, cpCallback_t cb)
+{
+    u_int32_t handle;
+    Enum<rfsv::errs> res;
+
+    sent = 0;
+    ifstream ip(from);
+    if (!ip)
+	return E_PSI_FILE_NXIST;
+    ifstream bp(base);
+    if (!bp)
+	return E_PSI_FILE_NXIST;
+    if ((res = fopen(opMode(PSI_O_RDWR), to, handle)) != E_PSI_GEN_NONE)
+	return res;
+
+    // Consecutive changed blocks are sent with a single seek and write
+    u_int32_t blen = RFSV_SENDLEN * window;
+    unsigned char *run = new unsigned char[blen];
+    char old[DELTA_BLOCK];
+    u_int32_t runStart = 0, runLen = 0;
+    u_int32_t total = 0, baseLen = 0;
+    while (res == E_PSI_GEN_NONE) {
+	ip.read((char *)run + runLen, DELTA_BLOCK);
+	u_int32_t n = ip.gcount();
+	bp.read(old, DELTA_BLOCK);
+	u_int32_t m = bp.gcount();
+	bool changed = (n > 0) && ((n != m) || memcmp(run + runLen, old, n));
+
+	baseLen += m;
+	if (changed) {
+	    if (runLen == 0)
+		runStart = total;
+	    runLen += n;
+	}
+	if (runLen && (!changed || (n < DELTA_BLOCK) || (runLen + DELTA_BLOCK > blen))) {
+	    u_int32_t pos, len;
+
+	    if ((res = fseek(handle, runStart, PSI_SEEK_SET, pos)) == E_PSI_GEN_NONE) {
+		if (pos != runStart)
+		    res = E_PSI_GEN_FAIL;
+		else if ((res = fwrite(handle, run, runLen, len)) == E_PSI_GEN_NONE)
+		    sent += len;
+	    }
+	    runLen = 0;
+	}
+	total += n;
+	if ((res == E_PSI_GEN_NONE) && cb && !cb(ptr, total))
+	    res = E_PSI_FILE_CANCEL;
+	if (n < DELTA_BLOCK)
+	    break;
+    }
+    // The old contents may have been longer
+    while (bp && (res == E_PSI_GEN_NONE)) {
+	bp.read(old, DELTA_BLOCK);
+	baseLen += bp.gcount();
+    }
+    if ((res == E_PSI_GEN_NONE) && (total < baseLen))
+	res = fsetsize(handle, total);
+    fclose(handle);
+    delete[]run;
+    return res;
+}
+
 int rfsv::
 getSpeed()
 {
@@ -190,6 +302,126 @@ getSpeed()
     return a.getDWord(1);
 }
 
+bool rfsv::
+getLinkStats(std::vector<u_int64_t> &stats)
+{
+    bufferStore a;
+    a.addStringT("NCP$LSTA");
+    if (!skt->sendBufferStore(a))
+	return false;
+    if (skt->getBufferStore(a) != 1)
+	return false;
+    if ((a.getLen() < 3) || (a.getByte(0) != E_PSI_GEN_NONE))
+	return false;
+    unsigned long n = a.getWord(1);
+    if (a.getLen() < 3 + n * 8)
+	return false;
+    stats.clear();
+    for (unsigned long i = 0; i < n; i++)
+	stats.push_back(a.getQWord(3 + i * 8));
+    return true;
+}
+
+void rfsv::
+setWindow(int n)
+{
+    if (n < 1)
+	n = 1;
+    if (n > RFSV_MAXWINDOW)
+	n = RFSV_MAXWINDOW;
+    window = n;
+}
+
+int rfsv::
+getWindow()
+{
+    return window;
+}
+
+// Without support by the protocol, requests are completed right away.
+
+void rfsv::
+fgeteattrAsync(const char * const name, PlpDirent &e, rfsvAsync &req)
+{
+    req.start();
+    req.complete(fgeteattr(name, e));
+}
+
+void rfsv::
+fopenAsync(const u_int32_t attr, const char * const name, u_int32_t &handle, rfsvAsync &req)
+{
+    req.start();
+    req.complete(fopen(attr, name, handle));
+}
+
+void rfsv::
+freadAsync(const u_int32_t handle, unsigned char * const buf, const u_int32_t len, u_int32_t &count, rfsvAsync &req)
+{
+    req.start();
+    req.complete(fread(handle, buf, (len > RFSV_SENDLEN) ? RFSV_SENDLEN : len, count));
+}
+
+void rfsv::
+fcloseAsync(const u_int32_t handle, rfsvAsync &req)
+{
+    req.start();
+    req.complete(fclose(handle));
+}
+
+Enum<rfsv::errs> rfsv::
+wait(rfsvAsync &req)
+{
+    return req.isDone() ? req.getResult() : Enum<rfsv::errs>(E_PSI_INTERNAL);
+}
+
+Enum<rfsv::errs> rfsv::
+waitAll()
+{
+    return (status == E_PSI_FILE_DISC) ? status : Enum<rfsv::errs>(E_PSI_GEN_NONE);
+}
+
+rfsvAsync::rfsvAsync(asyncCallback_t _cb, void *_ptr)
+{
+    cb = _cb;
+    ptr = _ptr;
+    done = false;
+    result = rfsv::E_PSI_GEN_NONE;
+}
+
+bool rfsvAsync::
+isDone() const
+{
+    return done;
+}
+
+Enum<rfsv::errs> rfsvAsync::
+getResult() const
+{
+    return result;
+}
+
+void *rfsvAsync::
+getPtr() const
+{
+    return ptr;
+}
+
+void rfsvAsync::
+start()
+{
+    done = false;
+    result = rfsv::E_PSI_GEN_NONE;
+}
+
+void rfsvAsync::
+complete(Enum<rfsv::errs> res)
+{
+    result = res;
+    done = true;
+    if (cb)
+	cb(ptr, *this);
+}
+
 /*
  * Local variables:
  * c-basic-offset: 4
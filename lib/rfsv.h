@@ -26,6 +26,7 @@
 
 #include <deque>
 #include <string>
+#include <vector>
 
 #include <Enum.h>
 #include <plpdirent.h>
@@ -38,12 +39,40 @@ class PlpDrive;
 
 const int RFSV_SENDLEN = 2000;
 
+/**
+ * The number of read or write requests, which are kept in flight
+ * by default during bulk transfers.
+ */
+const int RFSV_DEFWINDOW = 4;
+
+/**
+ * The largest number of requests, which may be kept in flight.
+ * Bulk transfers allocate a buffer of RFSV_SENDLEN bytes per request.
+ */
+const int RFSV_MAXWINDOW = 16;
+
 /**
  * Defines the callback procedure for
  * progress indication of copy operations.
  */
 typedef int (*cpCallback_t)(void *, u_int32_t);
 
+/**
+ * Defines the callback procedure for
+ * directory listings. It gets called for every
+ * entry, as soon as it has been received.
+ */
+typedef int (*dirCallback_t)(void *, PlpDirent &);
+
+class rfsvAsync;
+
+/**
+ * Defines the callback procedure for
+ * asynchronous requests. It gets called, as soon
+ * as the request has been completed.
+ */
+typedef void (*asyncCallback_t)(void *, rfsvAsync &);
+
 class rfsv16;
 class rfsv32;
 
@@ -294,7 +323,24 @@ public:
     *
     * @returns A Psion error code (One of enum @ref rfsv::errs ).
     */
-    virtual Enum<errs> dir(const char * const name, PlpDir &ret) = 0;
+    Enum<errs> dir(const char * const name, PlpDir &ret);
+
+    /**
+    * Reads a directory on the Psion, without keeping it in memory.
+    * Entries are passed on, while the rest of the directory
+    * is still being read.
+    *
+    * @param name The name of the directory
+    * @param func Pointer to a function which gets called for every entry.
+    * 	May be set to NULL, e.g. if only subdirectories are to be counted.
+    * 	If the callback function returns 0, the operation is aborted
+    * 	and E_PSI_FILE_CANCEL is returned.
+    * @param ptr  Passed to func as its first argument.
+    * @param subdirs If not NULL, the number of subdirectories is returned here.
+    *
+    * @returns A Psion error code (One of enum @ref rfsv::errs ).
+    */
+    Enum<errs> dir(const char * const name, dirCallback_t func, void *ptr, u_int32_t *subdirs = NULL);
 
     /**
     * Retrieves the modification time of a file on the Psion.
@@ -449,6 +495,27 @@ public:
     */
     virtual Enum<errs> copyOnPsion(const char * const from, const char * const to, void *, cpCallback_t func) = 0;
 
+    /**
+    * Updates an existing file on the Psion from a local file.
+    * Only the blocks which differ from a local copy of the file's
+    * current contents are sent, so a small change to a large file
+    * costs little more than the change itself.
+    *
+    * @param from Name of the file on the local machine to be copied.
+    * @param base Name of a local file, whose contents must be identical
+    * 	to the current contents of the file on the Psion, e.g. a copy
+    * 	kept from the previous transfer.
+    * @param to Name of the destination file on the Psion.
+    * @param sent The number of bytes actually sent is returned here.
+    * @param func Pointer to a function which gets called on every block.
+    * 	This function can be used to show some progress etc. May be set
+    * 	to NULL, where no callback is performed. If the callback function
+    * 	returns 0, the operation is aborted and E_PSI_FILE_CANCEL is returned.
+    *
+    * @returns A Psion error code (One of enum @ref #errs ).
+    */
+    Enum<errs> copyToPsionDelta(const char * const from, const char * const base, const char * const to, u_int32_t &sent, void *, cpCallback_t func);
+
     /**
     * Resizes an open file on the Psion.
     * If the new size is greater than the file's
@@ -608,6 +675,45 @@ public:
      */
     int getSpeed();
 
+    /**
+     * Retrieve the statistics, ncpd keeps for the serial link.
+     *
+     * The fields are returned in this order: smoothed round trip
+     * time, round trip time variation and retransmission timeout
+     * in milliseconds, number of data frames sent, number of
+     * retransmitted frames, NCP payload bytes sent and received,
+     * number of buffer allocations, bytes currently queued and
+     * the maximum of those, number of throttles, largest accepted
+     * frame, number of frame size probes and how many of them
+     * failed, number of data frames received and number of acks
+     * sent. Newer versions of ncpd may append further fields.
+     *
+     * @param stats The vector to receive the fields.
+     *
+     * @returns true on success, false on error.
+     */
+    bool getLinkStats(std::vector<u_int64_t> &stats);
+
+    /**
+     * Sets the number of read or write requests, which may be
+     * outstanding at the same time in @ref fread and @ref fwrite .
+     * Keeping more than one request in flight hides the round trip
+     * through ncpd and the serial link on bulk transfers.
+     *
+     * @param n The new window size. Values less than 1 are treated as 1,
+     *          values larger than @ref RFSV_MAXWINDOW are treated as
+     *          @ref RFSV_MAXWINDOW .
+     */
+    void setWindow(int n);
+
+    /**
+     * Retrieves the number of requests, which may be outstanding
+     * at the same time.
+     *
+     * @returns The current window size.
+     */
+    int getWindow();
+
     /**
      * Retrieves the protocol version.
      *
@@ -615,6 +721,84 @@ public:
      */
     virtual int getProtocolVersion() = 0;
 
+    /**
+    * Asynchronous variant of @ref fgeteattr .
+    * The request is sent and the method returns without waiting for
+    * the reply, so many requests can be outstanding at the same time,
+    * e.g. for retrieving the attributes of all files in a list.
+    * Replies are received by @ref wait , @ref waitAll or any
+    * synchronous method called later on the same object.
+    *
+    * @param name The name of the file.
+    * @param e @ref PlpDirent object, filled with the information
+    * 	on completion. It must not be destroyed before.
+    * @param req The @ref rfsvAsync object, which receives the result
+    * 	and calls its callback on completion. It must not be destroyed
+    * 	before.
+    *
+    * The default implementation completes the request immediately,
+    * using the synchronous method.
+    */
+    virtual void fgeteattrAsync(const char * const name, PlpDirent &e, rfsvAsync &req);
+
+    /**
+    * Asynchronous variant of @ref fopen .
+    * See @ref fgeteattrAsync for details.
+    *
+    * @param attr The open mode. Use @ref opMode to convert a generic mode
+    * 	into a machine specific one.
+    * @param name The name of the file to open.
+    * @param handle The file handle is returned here on completion.
+    * @param req The @ref rfsvAsync object for this request.
+    */
+    virtual void fopenAsync(const u_int32_t attr, const char * const name, u_int32_t &handle, rfsvAsync &req);
+
+    /**
+    * Asynchronous variant of @ref fread .
+    * See @ref fgeteattrAsync for details. Unlike @ref fread , a single
+    * request reads at most @ref RFSV_SENDLEN bytes. Requests for the
+    * same handle are completed in the order they were made.
+    *
+    * @param handle A valid file handle, e.g. from @ref fopenAsync .
+    * @param buf The buffer, receiving the data on completion.
+    * @param len The number of bytes to read.
+    * @param count The number of bytes actually read is returned here.
+    * @param req The @ref rfsvAsync object for this request.
+    */
+    virtual void freadAsync(const u_int32_t handle, unsigned char * const buf, const u_int32_t len, u_int32_t &count, rfsvAsync &req);
+
+    /**
+    * Asynchronous variant of @ref fclose .
+    * See @ref fgeteattrAsync for details.
+    *
+    * @param handle A valid file handle.
+    * @param req The @ref rfsvAsync object for this request.
+    */
+    virtual void fcloseAsync(const u_int32_t handle, rfsvAsync &req);
+
+    /**
+    * Waits for the completion of an asynchronous request.
+    * Other requests completing in the meantime get their
+    * callbacks called as well.
+    *
+    * Callbacks may make further asynchronous requests, but must
+    * neither wait nor call synchronous methods.
+    *
+    * @param req The request to wait for.
+    *
+    * @returns The result of the request.
+    */
+    virtual Enum<errs> wait(rfsvAsync &req);
+
+    /**
+    * Waits for the completion of all outstanding asynchronous requests.
+    *
+    * @returns E_PSI_FILE_DISC, if the connection was lost, E_PSI_GEN_NONE
+    * 	otherwise. The results of the individual requests are available
+    * 	from their @ref rfsvAsync objects.
+    */
+    virtual Enum<errs> waitAll();
+
 protected:
     /**
     * Retrieves the PLP protocol name. Mainly internal use.
@@ -626,6 +810,56 @@ protected:
     ppsocket *skt;
     Enum<errs> status;
     int32_t serNum;
+    int window;
+};
+
+/**
+ * The state of an asynchronous request to an @ref rfsv .
+ * It is the future of the request: As soon as the reply has
+ * been received, @ref isDone returns true, the result is
+ * available from @ref getResult and the optional callback
+ * is called.
+ */
+class rfsvAsync {
+    friend class rfsv;
+    friend class rfsv32;
+
+public:
+    /**
+    * Constructs a new request state.
+    *
+    * @param cb A function, which gets called on completion, or NULL.
+    * @param ptr An arbitrary pointer, passed to the callback.
+    */
+    rfsvAsync(asyncCallback_t cb = NULL, void *ptr = NULL);
+
+    /**
+    * Checks, whether the request has been completed.
+    *
+    * @returns true, if the reply has been received.
+    */
+    bool isDone() const;
+
+    /**
+    * Retrieves the result of a completed request.
+    *
+    * @returns A Psion error code (One of enum @ref rfsv::errs ).
+    */
+    Enum<rfsv::errs> getResult() const;
+
+    /**
+    * Retrieves the pointer, given to the constructor.
+    */
+    void *getPtr() const;
+
+private:
+    void start();
+    void complete(Enum<rfsv::errs> res);
+
+    asyncCallback_t cb;
+    void *ptr;
+    bool done;
+    Enum<rfsv::errs> result;
 };
 
 #endif
@@ -44,6 +44,7 @@ using namespace std;
 rfsv16::rfsv16(ppsocket *_skt)
 {
     serNum = 0;
+    window = 1;
     status = rfsv::E_PSI_FILE_DISC;
     skt = _skt;
     reset();
@@ -164,24 +165,6 @@ readdir(rfsvDirhandle &dH, PlpDirent &e) {
     return res;
 }
 
-Enum<rfsv::errs> rfsv16::
-dir(const char *name, PlpDir &files)
-{
-    rfsvDirhandle h;
-    files.clear();
-    Enum<rfsv::errs> res = opendir(PSI_A_HIDDEN|PSI_A_SYSTEM|PSI_A_DIR, name, h);
-    while (res == E_PSI_GEN_NONE) {
-	PlpDirent e;
-	res = readdir(h, e);
-	if (res == E_PSI_GEN_NONE)
-	    files.push_back(e);
-    }
-    closedir(h);
-    if (res == E_PSI_FILE_EOF)
-	res = E_PSI_GEN_NONE;
-    return res;
-}
-
 u_int32_t rfsv16::
 opMode(u_int32_t mode)
 {
@@ -671,8 +654,10 @@ copyOnPsion(const char *from, const char *to, void *ptr, cpCallback_t cb)
     res = fcreatefile(P_FSTREAM | P_FUPDATE, to, handle_to);
     if (res != E_PSI_GEN_NONE) {
 	res = freplacefile(P_FSTREAM | P_FUPDATE, to, handle_to);
-	if (res != E_PSI_GEN_NONE)
+	if (res != E_PSI_GEN_NONE) {
+	    fclose(handle_from);
 	    return res;
+	}
     }
     do {
 	unsigned char buf[RFSV_SENDLEN];
@@ -48,7 +48,6 @@ public:
     Enum<rfsv::errs> fcreatefile(const u_int32_t, const char * const, u_int32_t &);
     Enum<rfsv::errs> freplacefile(const u_int32_t, const char * const, u_int32_t &);
     Enum<rfsv::errs> fclose(const u_int32_t);
-    Enum<rfsv::errs> dir(const char * const, PlpDir &);
     Enum<rfsv::errs> fgetmtime(const char * const, PsiTime &);
     Enum<rfsv::errs> fsetmtime(const char * const, const PsiTime);
     Enum<rfsv::errs> fgetattr(const char * const, u_int32_t &);
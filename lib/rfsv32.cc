@@ -33,8 +33,10 @@
 
 #include <iostream>
 #include <fstream>
+#include <deque>
 
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 using namespace std;
@@ -43,26 +45,28 @@ rfsv32::rfsv32(ppsocket * _skt)
 {
     skt = _skt;
     serNum = 0;
+    window = RFSV_DEFWINDOW;
     status = rfsv::E_PSI_FILE_DISC;
     reset();
 }
 
 Enum<rfsv::errs> rfsv32::
 fopen(u_int32_t attr, const char *name, u_int32_t &handle)
+{
+    rfsvAsync r;
+    fopenAsync(attr, name, handle, r);
+    return wait(r);
+}
+
+void rfsv32::
+fopenAsync(const u_int32_t attr, const char * const name, u_int32_t &handle, rfsvAsync &req)
 {
     bufferStore a;
     string n = convertSlash(name);
     a.addDWord(attr);
     a.addWord(n.size());
     a.addString(n.c_str());
-    if (!sendCommand(OPEN_FILE, a))
-	return E_PSI_FILE_DISC;
-    Enum<rfsv::errs> res = getResponse(a);
-    if (res == E_PSI_GEN_NONE && a.getLen() == 4) {
-	handle = a.getDWord(0);
-	return E_PSI_GEN_NONE;
-    }
-    return res;
+    submit(OPEN_FILE, a, req, &handle);
 }
 
 Enum<rfsv::errs> rfsv32::
@@ -129,12 +133,18 @@ fopendir(const u_int32_t attr, const char * const name, u_int32_t &handle)
 
 Enum<rfsv::errs> rfsv32::
 fclose(u_int32_t handle)
+{
+    rfsvAsync r;
+    fcloseAsync(handle, r);
+    return wait(r);
+}
+
+void rfsv32::
+fcloseAsync(const u_int32_t handle, rfsvAsync &req)
 {
     bufferStore a;
     a.addDWord(handle);
-    if (!sendCommand(CLOSE_HANDLE, a))
-	return E_PSI_FILE_DISC;
-    return getResponse(a);
+    submit(CLOSE_HANDLE, a, req, NULL);
 }
 
 Enum<rfsv::errs> rfsv32::
@@ -186,24 +196,6 @@ readdir(rfsvDirhandle &dH, PlpDirent &e) {
     return res;
 }
 
-Enum<rfsv::errs> rfsv32::
-dir(const char *name, PlpDir &files)
-{
-    rfsvDirhandle h;
-    files.clear();
-    Enum<rfsv::errs> res = opendir(PSI_A_HIDDEN | PSI_A_SYSTEM | PSI_A_DIR, name, h);
-    while (res == E_PSI_GEN_NONE) {
-	PlpDirent e;
-	res = readdir(h, e);
-	if (res == E_PSI_GEN_NONE)
-	    files.push_back(e);
-    }
-    closedir(h);
-    if (res == E_PSI_FILE_EOF)
-	res = E_PSI_GEN_NONE;
-    return res;
-}
-
 u_int32_t rfsv32::
 opMode(const u_int32_t mode)
 {
@@ -265,6 +257,14 @@ fgetattr(const char * const name, u_int32_t &attr)
 
 Enum<rfsv::errs> rfsv32::
 fgeteattr(const char * const name, PlpDirent &e)
+{
+    rfsvAsync r;
+    fgeteattrAsync(name, e, r);
+    return wait(r);
+}
+
+void rfsv32::
+fgeteattrAsync(const char * const name, PlpDirent &e, rfsvAsync &req)
 {
     bufferStore a;
     string n = convertSlash(name);
@@ -276,12 +276,12 @@ fgeteattr(const char * const name, PlpDirent &e)
     else
 	p = n.c_str();
     e.name = p;
+    submit(REMOTE_ENTRY, a, req, &e);
+}
 
-    if (!sendCommand(REMOTE_ENTRY, a))
-	return E_PSI_FILE_DISC;
-    Enum<rfsv::errs> res = getResponse(a);
-    if (res != E_PSI_GEN_NONE)
-	return res;
+void rfsv32::
+getEntry(bufferStore &a, PlpDirent &e)
+{
     // long shortLen = a.getDWord(0);
     // long longLen = a.getDWord(32);
 
@@ -290,8 +290,6 @@ fgeteattr(const char * const name, PlpDirent &e)
     e.UID     = PlpUID(a.getDWord(20), a.getDWord(24), a.getDWord(28));
     e.time    = PsiTime(a.getDWord(16), a.getDWord(12));
     e.attrstr = string(attr2String(e.attr));
-
-    return res;
 }
 
 Enum<rfsv::errs> rfsv32::
@@ -387,6 +385,13 @@ devinfo(const char drive, PlpDrive &dinfo)
 
 bool rfsv32::
 sendCommand(enum commands cc, bufferStore & data)
+{
+    int32_t ser;
+    return sendCommand(cc, data, ser);
+}
+
+bool rfsv32::
+sendCommand(enum commands cc, bufferStore & data, int32_t &ser)
 {
     if (status == E_PSI_FILE_DISC) {
 	reconnect();
@@ -397,6 +402,7 @@ sendCommand(enum commands cc, bufferStore & data)
     bufferStore a;
     a.addWord(cc);
     a.addWord(serNum);
+    ser = serNum;
     if (serNum < 0xffff)
 	serNum++;
     else
@@ -404,6 +410,8 @@ sendCommand(enum commands cc, bufferStore & data)
     a.addBuff(data);
     result = skt->sendBufferStore(a);
     if (!result) {
+	// Replies to outstanding requests are lost with the connection
+	abortPending();
 	reconnect();
 	result = skt->sendBufferStore(a);
 	if (!result)
@@ -412,68 +420,268 @@ sendCommand(enum commands cc, bufferStore & data)
     return result;
 }
 
-Enum<rfsv::errs> rfsv32::
-getResponse(bufferStore & data)
+/*
+ * Receives the next reply and strips its header. On failure, the
+ * connection is considered lost and all asynchronous requests are
+ * completed with E_PSI_FILE_DISC.
+ */
+bool rfsv32::
+readReply(bufferStore & data, u_int16_t &ser, Enum<rfsv::errs> &res)
 {
     if (skt->getBufferStore(data) == 1 &&
 	data.getWord(0) == 0x11) {
+	ser = data.getWord(2);
 	int32_t ret = data.getDWord(4);
 	data.discardFirstBytes(8);
-	return err2psierr(ret);
-    } else
-	status = E_PSI_FILE_DISC;
+	res = err2psierr(ret);
+	return true;
+    }
+    status = E_PSI_FILE_DISC;
+    abortPending();
+    return false;
+}
+
+Enum<rfsv::errs> rfsv32::
+getResponse(bufferStore & data)
+{
+    return getResponse(data, -1);
+}
+
+/*
+ * Like getResponse(bufferStore &), but additionally verifies, that
+ * the reply echoes the serial number @p ser of the request it is
+ * expected to answer. Used when several requests are in flight.
+ * Replies to asynchronous requests, which arrive in the meantime,
+ * are handed to their requests.
+ */
+Enum<rfsv::errs> rfsv32::
+getResponse(bufferStore & data, const int32_t ser)
+{
+    u_int16_t s;
+    Enum<rfsv::errs> res;
+
+    while (readReply(data, s, res)) {
+	if (completeRequest(s, res, data))
+	    continue;
+	if ((ser >= 0) && (s != (u_int16_t)ser))
+	    return E_PSI_INTERNAL;
+	return res;
+    }
     return status;
 }
 
+void rfsv32::
+submit(enum commands cc, bufferStore &data, rfsvAsync &req, void *ret, u_int32_t len, u_int32_t *count)
+{
+    int32_t ser;
+
+    req.start();
+    if (!sendCommand(cc, data, ser)) {
+	req.complete(E_PSI_FILE_DISC);
+	return;
+    }
+    pendingRequest &p = pending[(u_int16_t)ser];
+    p.req = &req;
+    p.cmd = cc;
+    p.ret = ret;
+    p.len = len;
+    p.count = count;
+}
+
+/*
+ * Hands a reply to the asynchronous request with the serial number
+ * @p ser. Returns false, if there is no such request.
+ */
+bool rfsv32::
+completeRequest(u_int16_t ser, Enum<rfsv::errs> res, bufferStore &data)
+{
+    map<u_int16_t, pendingRequest>::iterator i = pending.find(ser);
+    if (i == pending.end())
+	return false;
+    pendingRequest p = i->second;
+    pending.erase(i);
+
+    if (res == E_PSI_GEN_NONE) {
+	switch (p.cmd) {
+	    case REMOTE_ENTRY:
+		getEntry(data, *(PlpDirent *)p.ret);
+		break;
+	    case OPEN_FILE:
+		if (data.getLen() == 4)
+		    *(u_int32_t *)p.ret = data.getDWord(0);
+		break;
+	    case READ_FILE: {
+		u_int32_t l = data.getLen();
+		if (l > p.len)
+		    l = p.len;
+		memcpy(p.ret, data.getString(), l);
+		*p.count = l;
+		break;
+	    }
+	    default:
+		break;
+	}
+    }
+    p.req->complete(res);
+    return true;
+}
+
+void rfsv32::
+abortPending()
+{
+    while (!pending.empty()) {
+	rfsvAsync *r = pending.begin()->second.req;
+	pending.erase(pending.begin());
+	r->complete(E_PSI_FILE_DISC);
+    }
+}
+
 Enum<rfsv::errs> rfsv32::
-fread(const u_int32_t handle, unsigned char * const buf, const u_int32_t len, u_int32_t &count)
+wait(rfsvAsync &req)
+{
+    bufferStore a;
+    u_int16_t s;
+    Enum<rfsv::errs> res;
+
+    // Replies, nobody is waiting for, are dropped
+    while (!req.isDone() && !pending.empty() && readReply(a, s, res))
+	completeRequest(s, res, a);
+    return req.isDone() ? req.getResult() : Enum<rfsv::errs>(E_PSI_INTERNAL);
+}
+
+Enum<rfsv::errs> rfsv32::
+waitAll()
 {
+    bufferStore a;
+    u_int16_t s;
     Enum<rfsv::errs> res;
+
+    while (!pending.empty() && readReply(a, s, res))
+	completeRequest(s, res, a);
+    return (status == E_PSI_FILE_DISC) ? status : Enum<rfsv::errs>(E_PSI_GEN_NONE);
+}
+
+void rfsv32::
+freadAsync(const u_int32_t handle, unsigned char * const buf, const u_int32_t len, u_int32_t &count, rfsvAsync &req)
+{
     bufferStore a;
+    u_int32_t l = (len > RFSV_SENDLEN) ? RFSV_SENDLEN : len;
+
     count = 0;
-    long l;
+    a.addDWord(handle);
+    a.addDWord(l);
+    submit(READ_FILE, a, req, buf, l, &count);
+}
+
+Enum<rfsv::errs> rfsv32::
+fread(const u_int32_t handle, unsigned char * const buf, const u_int32_t len, u_int32_t &count)
+{
+    Enum<rfsv::errs> res = E_PSI_GEN_NONE;
+    bufferStore a;
+    deque<int32_t> serials;
+    deque<u_int32_t> lengths;
+    u_int32_t requested = 0;
     unsigned char *p = buf;
+    bool eof = false;
 
+    count = 0;
     do {
-	a.addDWord(handle);
-	a.addDWord(((len - count) > RFSV_SENDLEN)?RFSV_SENDLEN:(len - count));
-	if (!sendCommand(READ_FILE, a))
-	    return E_PSI_FILE_DISC;
-	if ((res = getResponse(a)) != E_PSI_GEN_NONE)
-	    return res;
-	if ((l = a.getLen()) > 0) {
+	// Keep up to window READ_FILE requests outstanding.
+	while (!eof && (res == E_PSI_GEN_NONE) &&
+	       (serials.size() < (unsigned int)window) &&
+	       ((count + requested) < len)) {
+	    u_int32_t l = len - count - requested;
+	    int32_t ser;
+
+	    if (l > RFSV_SENDLEN)
+		l = RFSV_SENDLEN;
+	    a.init();
+	    a.addDWord(handle);
+	    a.addDWord(l);
+	    if (!sendCommand(READ_FILE, a, ser))
+		return E_PSI_FILE_DISC;
+	    serials.push_back(ser);
+	    lengths.push_back(l);
+	    requested += l;
+	}
+	if (serials.empty())
+	    break;
+
+	u_int32_t asked = lengths.front();
+	Enum<rfsv::errs> r = getResponse(a, serials.front());
+	serials.pop_front();
+	lengths.pop_front();
+	requested -= asked;
+	if (r == E_PSI_FILE_DISC)
+	    return r;
+	if (r != E_PSI_GEN_NONE) {
+	    // Remember the first error, but drain the remaining replies.
+	    if (res == E_PSI_GEN_NONE)
+		res = r;
+	    continue;
+	}
+	if (res != E_PSI_GEN_NONE)
+	    continue;
+	u_int32_t l = a.getLen();
+	if (l > asked)
+	    l = asked;
+	if (l > 0) {
 	    memcpy(p, a.getString(), l);
 	    count += l;
 	    p += l;
-	}
-	a.init();
-    } while ((count < len) && (l > 0));
+	} else
+	    eof = true;
+    } while (!serials.empty() ||
+	     (!eof && (res == E_PSI_GEN_NONE) && (count < len)));
     return res;
 }
 
 Enum<rfsv::errs> rfsv32::
 fwrite(const u_int32_t handle, const unsigned char * const buf, const u_int32_t len, u_int32_t &count)
 {
-    Enum<rfsv::errs> res;
-    const unsigned char *p = buf;
-    long l;
+    Enum<rfsv::errs> res = E_PSI_GEN_NONE;
+    deque<int32_t> serials;
+    deque<u_int32_t> lengths;
+    u_int32_t sent = 0;
 
     count = 0;
     do {
-	l = ((len - count) > RFSV_SENDLEN)?RFSV_SENDLEN:(len - count);
-	if (l > 0) {
+	// Keep up to window WRITE_FILE requests outstanding.
+	while ((res == E_PSI_GEN_NONE) &&
+	       (serials.size() < (unsigned int)window) && (sent < len)) {
+	    u_int32_t l = len - sent;
 	    bufferStore a;
-	    bufferStore tmp(p, l);
+	    int32_t ser;
+
+	    if (l > RFSV_SENDLEN)
+		l = RFSV_SENDLEN;
 	    a.addDWord(handle);
-	    a.addBuff(tmp);
-	    if (!sendCommand(WRITE_FILE, a))
+	    a.addBytes(buf + sent, l);
+	    if (!sendCommand(WRITE_FILE, a, ser))
 		return E_PSI_FILE_DISC;
-	    if ((res = getResponse(a)) != E_PSI_GEN_NONE)
-		return res;
-	    count += l;
-	    p += l;
+	    serials.push_back(ser);
+	    lengths.push_back(l);
+	    sent += l;
 	}
-    } while ((count < len) && (l > 0));
+	if (serials.empty())
+	    break;
+
+	bufferStore a;
+	u_int32_t l = lengths.front();
+	Enum<rfsv::errs> r = getResponse(a, serials.front());
+	serials.pop_front();
+	lengths.pop_front();
+	if (r == E_PSI_FILE_DISC)
+	    return r;
+	if (r != E_PSI_GEN_NONE) {
+	    // Remember the first error, but drain the remaining replies.
+	    if (res == E_PSI_GEN_NONE)
+		res = r;
+	    continue;
+	}
+	if (res == E_PSI_GEN_NONE)
+	    count += l;
+    } while (!serials.empty());
     return res;
 }
 
@@ -492,9 +700,10 @@ copyFromPsion(const char *from, const char *to, void *ptr, cpCallback_t cb)
 	fclose(handle);
 	return E_PSI_GEN_FAIL;
     }
-    unsigned char *buff = new unsigned char[RFSV_SENDLEN];
+    u_int32_t blen = RFSV_SENDLEN * window;
+    unsigned char *buff = new unsigned char[blen];
     do {
-	if ((res = fread(handle, buff, RFSV_SENDLEN, len)) == E_PSI_GEN_NONE) {
+	if ((res = fread(handle, buff, blen, len)) == E_PSI_GEN_NONE) {
 	    op.write((char *)buff, len);
 	    total += len;
 	    if (cb && !cb(ptr, total))
@@ -517,9 +726,10 @@ copyFromPsion(const char *from, int fd, cpCallback_t cb)
 
     if ((res = fopen(EPOC_OMODE_SHARE_READERS | EPOC_OMODE_BINARY, from, handle)) != E_PSI_GEN_NONE)
 	return res;
-    unsigned char *buff = new unsigned char[RFSV_SENDLEN];
+    u_int32_t blen = RFSV_SENDLEN * window;
+    unsigned char *buff = new unsigned char[blen];
     do {
-	if ((res = fread(handle, buff, RFSV_SENDLEN, len)) == E_PSI_GEN_NONE) {
+	if ((res = fread(handle, buff, blen, len)) == E_PSI_GEN_NONE) {
 	    write(fd, buff, len);
 	    total += len;
 	    if (cb && !cb(NULL, total))
@@ -546,11 +756,12 @@ copyToPsion(const char *from, const char *to, void *ptr, cpCallback_t cb)
 	if (res != E_PSI_GEN_NONE)
 	    return res;
     }
-    unsigned char *buff = new unsigned char[RFSV_SENDLEN];
+    u_int32_t blen = RFSV_SENDLEN * window;
+    unsigned char *buff = new unsigned char[blen];
     u_int32_t total = 0;
     while (ip && !ip.eof() && (res == E_PSI_GEN_NONE)) {
 	u_int32_t len;
-	ip.read((char *)buff, RFSV_SENDLEN);
+	ip.read((char *)buff, blen);
 	if ((res = fwrite(handle, buff, ip.gcount(), len)) == E_PSI_GEN_NONE) {
 	    total += len;
 	    if (cb && !cb(ptr, total))
@@ -28,6 +28,8 @@
 #include <rfsv.h>
 #include <plpdirent.h>
 
+#include <map>
+
 class rfsvfactory;
 
 /**
@@ -45,7 +47,6 @@ class rfsv32 : public rfsv {
     friend class rfsvfactory;
 
 public:
-    Enum<rfsv::errs> dir(const char * const, PlpDir &);
     Enum<rfsv::errs> dircount(const char * const, u_int32_t &);
     Enum<rfsv::errs> copyFromPsion(const char * const, const char * const, void *, cpCallback_t);
     Enum<rfsv::errs> copyFromPsion(const char *from, int fd, cpCallback_t cb);
@@ -79,6 +80,13 @@ public:
     u_int32_t opMode(const u_int32_t);
     int getProtocolVersion() { return 5; }
 
+    void fgeteattrAsync(const char * const, PlpDirent &, rfsvAsync &);
+    void fopenAsync(const u_int32_t, const char * const, u_int32_t &, rfsvAsync &);
+    void freadAsync(const u_int32_t, unsigned char * const, const u_int32_t, u_int32_t &, rfsvAsync &);
+    void fcloseAsync(const u_int32_t, rfsvAsync &);
+    Enum<rfsv::errs> wait(rfsvAsync &);
+    Enum<rfsv::errs> waitAll();
+
 private:
 
     enum file_attrib {
@@ -202,7 +210,29 @@ private:
 
     // Communication
     bool sendCommand(enum commands, bufferStore &);
+    bool sendCommand(enum commands, bufferStore &, int32_t &);
     Enum<rfsv::errs> getResponse(bufferStore &);
+    Enum<rfsv::errs> getResponse(bufferStore &, const int32_t);
+    bool readReply(bufferStore &, u_int16_t &, Enum<rfsv::errs> &);
+
+    /**
+    * An asynchronous request, waiting for its reply.
+    */
+    typedef struct {
+	rfsvAsync *req;
+	enum commands cmd;
+	void *ret;
+	u_int32_t len;
+	u_int32_t *count;
+    } pendingRequest;
+
+    // Asynchronous requests, by serial number
+    std::map<u_int16_t, pendingRequest> pending;
+
+    void submit(enum commands, bufferStore &, rfsvAsync &, void *, u_int32_t = 0, u_int32_t * = NULL);
+    bool completeRequest(u_int16_t, Enum<rfsv::errs>, bufferStore &);
+    void abortPending();
+    void getEntry(bufferStore &, PlpDirent &);
 };
 
 #endif
@@ -31,6 +31,7 @@
 
 #include "channel.h"
 #include "ncp.h"
+#include "main.h"
 
 channel::channel(ncp * _ncpController)
 {
@@ -63,6 +64,7 @@ void channel::
 terminateWhenAsked()
 {
     _terminate = true;
+    wakeupMainLoop();
 }
 
 void channel::
@@ -113,6 +115,18 @@ ncpGetSpeed()
     return ncpController->getSpeed();
 }
 
+void channel::
+ncpGetLinkStats(linkStats &stats)
+{
+    ncpController->getLinkStats(stats);
+}
+
+bool channel::
+ncpThrottled()
+{
+    return ncpController->isThrottled(ncpChannel);
+}
+
 short int channel::
 ncpProtocolVersion()
 {
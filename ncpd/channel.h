@@ -33,6 +33,7 @@ class ncp;
 class bufferStore;
 class PcServer;
 class ppsocket;
+struct linkStats;
 
 class channel {
 public:
@@ -67,6 +68,8 @@ public:
     void ncpRegisterPcServer(ppsocket *skt, const char *name);
     void ncpUnregisterPcServer(PcServer *server);
     int ncpGetSpeed();
+    void ncpGetLinkStats(linkStats &stats);
+    bool ncpThrottled();
 
 protected:
     short int verbose;
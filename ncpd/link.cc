@@ -34,6 +34,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/time.h>
 
 #include "link.h"
@@ -41,15 +43,46 @@
 #include "ncp.h"
 #include "main.h"
 
+/**
+ * Returns the current time of the monotonic clock in microseconds.
+ */
+static u_int64_t
+monotonic()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 extern "C" {
+    /**
+     * Sleeps until the earliest retransmission deadline
+     * of all unacknowledged packets, or until a new packet
+     * is sent, then triggers retransmissions.
+     */
     static void *expire_check(void *arg)
     {
 	Link *l = (Link *)arg;
-	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-	while (1) {
-	    usleep(l->retransTimeout() * 500);
-	    l->retransmit();
+	pthread_mutex_lock(&l->queueMutex);
+	while (!l->stopCheck) {
+	    u_int64_t deadline = l->nextDeadline();
+	    if (deadline == 0) {
+		pthread_cond_wait(&l->timerCond, &l->queueMutex);
+		continue;
+	    }
+	    struct timespec ts;
+	    ts.tv_sec = deadline / 1000000;
+	    ts.tv_nsec = (deadline % 1000000) * 1000;
+	    if (pthread_cond_timedwait(&l->timerCond, &l->queueMutex, &ts)
+		== ETIMEDOUT) {
+		pthread_mutex_unlock(&l->queueMutex);
+		l->retransmit();
+		pthread_mutex_lock(&l->queueMutex);
+	    }
 	}
+	pthread_mutex_unlock(&l->queueMutex);
+	return NULL;
     }
 };
 
@@ -63,6 +96,12 @@ ENUM_DEFINITION_END(Link::link_type)
 
 Link::Link(const char *fname, int baud, ncp *_ncp, unsigned short _verbose)
     : p(0)
+    , sendWindow(LINK_WINDOW_SLOTS)
+    , winBase(0)
+    , winCount(0)
+    , winBytes(0)
+    , fastSeq(-1)
+    , waitCount(0)
 {
     theNCP = _ncp;
     verbose = _verbose;
@@ -72,15 +111,46 @@ Link::Link(const char *fname, int baud, ncp *_ncp, unsigned short _verbose)
     seqMask = 7;
     maxOutstanding = 1;
     linkType = LINK_TYPE_UNKNOWN;
-    for (int i = 0; i < 256; i++)
+    for (int i = 0; i < 256; i++) {
 	xoff[i] = false;
+	deficit[i] = 0;
+	weight[i] = LINK_DEFAULT_WEIGHT;
+	queued[i] = 0;
+	throttled[i] = false;
+    }
+    queuedTotal = maxQueued = 0;
+    throttles = 0;
+    maxFrame = LINK_MIN_FRAME;
+    minRejected = LINK_MAX_FRAME + 1;
+    lostSeq = -1;
+    cleanFrames = LINK_CLEAN_RUN;
+    probeSeq = -1;
+    probePolled = false;
+    probes = probesFailed = 0;
+    unsent = 0;
+    ackPending = 0;
+    ackBlocked = false;
+    ackDue = 0;
+    rxFrames = acks = 0;
     // generate magic number for sendReqCon()
     srandom(time(NULL));
     conMagic = random();
+    stopCheck = false;
+    started = false;
+    txFrames = retransmits = 0;
+
+    pthread_mutex_init(&queueMutex, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timerCond, &attr);
+    pthread_condattr_destroy(&attr);
 
     p = new packet(fname, baud, this, _verbose);
 
-    pthread_mutex_init(&queueMutex, NULL);
+    // No round trip samples yet
+    srtt = rttvar = 0;
+    rto = retransTimeout() * 1000;
     pthread_create(&checkthread, NULL, expire_check, this);
 
     // submit a link request
@@ -90,11 +160,21 @@ Link::Link(const char *fname, int baud, ncp *_ncp, unsigned short _verbose)
 Link::~Link()
 {
     flush();
-    pthread_cancel(checkthread);
-    pthread_mutex_destroy(&queueMutex);
+    pthread_mutex_lock(&queueMutex);
+    stopCheck = true;
+    pthread_cond_signal(&timerCond);
+    pthread_mutex_unlock(&queueMutex);
+    pthread_join(checkthread, NULL);
     delete p;
+    pthread_cond_destroy(&timerCond);
+    pthread_mutex_destroy(&queueMutex);
 }
 
+/**
+ * The initial retransmission timeout in milliseconds, used until
+ * round trip times have been measured. Also the upper bound for
+ * the backed off timeout.
+ */
 unsigned long Link::
 retransTimeout()
 {
@@ -105,6 +185,8 @@ void Link::
 reset() {
     txSequence = 1;
     rxSequence = -1;
+    ackPending = 0;
+    ackBlocked = false;
     failed = false;
     seqMask = 7;
     maxOutstanding = 1;
@@ -113,6 +195,15 @@ reset() {
     for (int i = 0; i < 256; i++)
 	xoff[i] = false;
     p->reset();
+    pthread_mutex_lock(&queueMutex);
+    // It may be a different Psion this time.
+    maxFrame = LINK_MIN_FRAME;
+    minRejected = LINK_MAX_FRAME + 1;
+    lostSeq = -1;
+    cleanFrames = LINK_CLEAN_RUN;
+    srtt = rttvar = 0;
+    rto = retransTimeout() * 1000;
+    pthread_mutex_unlock(&queueMutex);
     // submit a link request
     sendReqReq();
 }
@@ -131,50 +222,218 @@ setVerbose(unsigned short _verbose)
 }
 
 void Link::
-send(const bufferStore & buff)
+send(bufferStore & buff)
+{
+    linkFrame f(buff);
+    send(f);
+}
+
+void Link::
+send(linkFrame &f)
 {
-    if (buff.getLen() > 300) {
+    // Data frames are split to what the Psion accepts,
+    // NCP control frames must fit as they are.
+    bool ctl = !f.empty() && (f.getByte(0) == 0);
+    if (f.getLen() > (ctl ? 300 : LINK_MAX_FRAME)) {
 	failed = true;
     } else
-	transmit(buff);
+	transmit(f);
 }
 
 void Link::
 purgeAllQueues()
 {
     pthread_mutex_lock(&queueMutex);
-    ackWaitQueue.clear();
-    holdQueue.clear();
+    for (int i = 0; i < winCount; i++)
+	sendWindow[(winBase + i) & (LINK_WINDOW_SLOTS - 1)].data.init();
+    winCount = 0;
+    winBytes = 0;
+    fastSeq = -1;
+    probeSeq = -1;
+    probePolled = false;
+    ctlQueue.clear();
+    for (int i = 0; i < 256; i++) {
+	holdQueue[i].clear();
+	waitQueue[i].clear();
+	deficit[i] = 0;
+	account(i, -queued[i]);
+    }
+    activeChannels.clear();
+    waitCount = 0;
     pthread_mutex_unlock(&queueMutex);
 }
 
 void Link::
 purgeQueue(int channel)
 {
+    // Frames already in the send window carry sequence numbers and
+    // therefore must be delivered. Only drop those not yet sent.
     pthread_mutex_lock(&queueMutex);
-    vector<ackWaitQueueElement>::iterator i;
-    for (i = ackWaitQueue.begin(); i != ackWaitQueue.end(); i++)
-	if (i->data.getByte(0) == channel) {
-	    ackWaitQueue.erase(i);
-	    i--;
-	}
-    vector<bufferStore>::iterator j;
-    for (j = holdQueue.begin(); j != holdQueue.end(); j++)
-	if (j->getByte(0) == channel) {
-	    holdQueue.erase(j);
-	    j--;
-	}
+    holdQueue[channel].clear();
+    waitCount -= waitQueue[channel].size();
+    waitQueue[channel].clear();
+    account(channel, -queued[channel]);
+    deque<int>::iterator i = activeChannels.begin();
+    while (i != activeChannels.end()) {
+	if (*i == channel)
+	    i = activeChannels.erase(i);
+	else
+	    i++;
+    }
+    deficit[channel] = 0;
+    weight[channel] = LINK_DEFAULT_WEIGHT;
     pthread_mutex_unlock(&queueMutex);
 }
 
+void Link::
+start()
+{
+    started = true;
+}
+
+void Link::
+setChannelWeight(int channel, int w)
+{
+    if (w < 1)
+	w = 1;
+    if (w > 16)
+	w = 16;
+    pthread_mutex_lock(&queueMutex);
+    weight[channel & 255] = w;
+    pthread_mutex_unlock(&queueMutex);
+}
+
+/**
+ * Appends a frame to the wait queue of its channel.
+ * Must be called with queueMutex held.
+ */
+void Link::
+queueWaiting(int channel, linkFrame &buf)
+{
+    if (waitQueue[channel].empty() && (channel != 0))
+	activeChannels.push_back(channel);
+    waitQueue[channel].push_back(buf);
+    waitCount++;
+    account(channel, buf.getLen());
+}
+
+/**
+ * Puts a frame back at the head of the wait queue of its channel.
+ * Must be called with queueMutex held.
+ */
+void Link::
+requeueWaiting(int channel, linkFrame &buf)
+{
+    if (waitQueue[channel].empty() && (channel != 0))
+	activeChannels.push_front(channel);
+    waitQueue[channel].push_front(buf);
+    waitCount++;
+    account(channel, buf.getLen());
+}
+
+/**
+ * Picks the next waiting frame to be sent. Control frames go first,
+ * then the channels are served by deficit round robin: Each time a
+ * channel's turn comes up, its deficit is increased by its quantum
+ * and it may send frames, until the deficit is used up.
+ * Must be called with queueMutex held.
+ *
+ * @returns true, if a frame has been removed from the wait queues.
+ */
+bool Link::
+nextWaiting(linkFrame &buf)
+{
+    if (!waitQueue[0].empty()) {
+	buf = waitQueue[0].front();
+	waitQueue[0].pop_front();
+	waitCount--;
+	account(0, -(long)buf.getLen());
+	return true;
+    }
+    long quantum = (maxFrame > LINK_DRR_QUANTUM) ? maxFrame : LINK_DRR_QUANTUM;
+    while (!activeChannels.empty()) {
+	int ch = activeChannels.front();
+	deque<linkFrame> &q = waitQueue[ch];
+	long len = q.front().getLen();
+	if (deficit[ch] >= len) {
+	    deficit[ch] -= len;
+	    buf = q.front();
+	    q.pop_front();
+	    waitCount--;
+	    account(ch, -len);
+	    if (q.empty()) {
+		// An idle channel does not save up its deficit
+		deficit[ch] = 0;
+		activeChannels.pop_front();
+	    }
+	    return true;
+	}
+	// Used up its share, so it is the next channel's turn.
+	deficit[ch] += (long)weight[ch] * quantum;
+	activeChannels.pop_front();
+	activeChannels.push_back(ch);
+    }
+    return false;
+}
+
+/**
+ * Checks, if a sequence number belongs to a frame in the send window.
+ * Must be called with queueMutex held.
+ */
+bool Link::
+inWindow(int seq)
+{
+    return (((seq - winBase) & seqMask) < winCount);
+}
+
+/**
+ * Removes all frames up to and including seq from the send window.
+ * Must be called with queueMutex held.
+ */
+void Link::
+ackUpTo(int seq)
+{
+    int n = ((seq - winBase) & seqMask) + 1;
+    if ((probeSeq >= 0) && (((probeSeq - winBase) & seqMask) < n)) {
+	maxFrame = probeLen;
+	probeSeq = -1;
+	if (verbose & LNK_DEBUG_LOG)
+	    lout << "Link: frames of " << maxFrame << " bytes accepted" << endl;
+    }
+    for (int i = 0; i < n; i++) {
+	ackWaitQueueElement &e =
+	    sendWindow[(winBase + i) & (LINK_WINDOW_SLOTS - 1)];
+	if (e.resent)
+	    cleanFrames = 0;
+	else if (cleanFrames < LINK_CLEAN_RUN)
+	    cleanFrames++;
+	winBytes -= e.data.getLen();
+	e.data.init();
+    }
+    winBase = (winBase + n) & seqMask;
+    winCount -= n;
+    fastSeq = -1;
+}
+
 void Link::
 sendAck(int seq)
 {
+    // Covers all frames received so far.
+    ackPending = 0;
+    ackBlocked = false;
     if (hasFailed())
 	return;
-    bufferStore tmp;
+    acks++;
+    linkFrame tmp;
     if (verbose & LNK_DEBUG_LOG)
 	lout << "Link: >> ack seq=" << seq << endl;
+    makeAck(seq, tmp);
+    p->send(tmp);
+}
+
+void Link::
+makeAck(int seq, linkFrame &tmp)
+{
     if (seq > 7) {
 	int hseq = seq >> 3;
 	int lseq = (seq & 7) | 8;
@@ -182,7 +441,57 @@ sendAck(int seq)
 	tmp.prependWord(seq);
     } else
 	tmp.prependByte(seq);
-    p->send(tmp);
+}
+
+/**
+ * Acknowledges a data frame, which has been received in sequence.
+ * SIBO links carry only one frame at a time, so it is acknowledged
+ * immediately. On EPOC links, the ack may wait for more frames,
+ * see LINK_ACK_FRAMES.
+ */
+void Link::
+queueAck()
+{
+    if ((linkType != LINK_TYPE_EPOC) || (LINK_ACK_FRAMES <= 1)) {
+	sendAck(rxSequence);
+	return;
+    }
+    if (ackPending++ == 0)
+	ackDue = monotonic() + LINK_ACK_DELAY * 1000;
+    if (ackPending >= LINK_ACK_FRAMES)
+	sendAck(rxSequence);
+}
+
+int Link::
+ackTimeout()
+{
+    if (!started || (ackPending == 0) || ackBlocked)
+	return -1;
+    u_int64_t now = monotonic();
+    return (ackDue > now) ? (ackDue - now + 999) / 1000 : 0;
+}
+
+void Link::
+expireAck()
+{
+    if (!started || (ackPending == 0) || (ackDue > monotonic()))
+	return;
+    if (hasFailed()) {
+	ackPending = 0;
+	return;
+    }
+    // The pump must not wait for room in the output ring, which
+    // only it empties. Without room, it tries again after writing.
+    linkFrame tmp;
+    makeAck(rxSequence, tmp);
+    ackBlocked = !p->trySend(tmp);
+    if (ackBlocked)
+	return;
+    if (verbose & LNK_DEBUG_LOG)
+	lout << "Link: >> ack seq=" << rxSequence << ", delayed for "
+	     << ackPending << " frames" << endl;
+    ackPending = 0;
+    acks++;
 }
 
 void Link::
@@ -197,11 +506,14 @@ sendReqCon()
     tmp.addDWord(conMagic);
     ackWaitQueueElement e;
     e.seq = 0; // expected ACK is 0, _NOT_ 4!
-    gettimeofday(&e.stamp, NULL);
+    e.stamp = monotonic();
+    e.resent = false;
+    e.wire = 0;
     e.data = tmp;
     e.txcount = 4;
     pthread_mutex_lock(&queueMutex);
-    ackWaitQueue.push_back(e);
+    ctlQueue.push_back(e);
+    pthread_cond_signal(&timerCond);
     pthread_mutex_unlock(&queueMutex);
     p->send(tmp);
 }
@@ -217,11 +529,14 @@ sendReqReq()
     tmp.addByte(0x21);
     ackWaitQueueElement e;
     e.seq = 0; // expected response is Ack with seq=0 or ReqCon
-    gettimeofday(&e.stamp, NULL);
+    e.stamp = monotonic();
+    e.resent = false;
+    e.wire = 0;
     e.data = tmp;
     e.txcount = 4;
     pthread_mutex_lock(&queueMutex);
-    ackWaitQueue.push_back(e);
+    ctlQueue.push_back(e);
+    pthread_cond_signal(&timerCond);
     pthread_mutex_unlock(&queueMutex);
     p->send(tmp);
 }
@@ -235,14 +550,14 @@ sendReq()
     if (verbose & LNK_DEBUG_LOG)
 	lout << "Link: >> con seq=1" << endl;
     tmp.addByte(0x20);
-    // No Ack expected for this, so no new entry in ackWaitQueue
+    // No Ack expected for this, so no new entry in ctlQueue
     p->send(tmp);
 }
 
 void Link::
-receive(bufferStore buff)
+receive(bufferStore &buff)
 {
-    if (!p)
+    if (!p || !started)
 	return;
 
     vector<ackWaitQueueElement>::iterator i;
@@ -274,8 +589,9 @@ receive(bufferStore buff)
 	    if (((rxSequence + 1) & seqMask) == seq) {
 		rxSequence++;
 		rxSequence &= seqMask;
+		rxFrames++;
 
-	    	sendAck(rxSequence);
+		queueAck();
 		// Must check for XOFF/XON ncp frames HERE!
 		if ((buff.getLen() == 3) && (buff.getByte(0) == 0)) {
 		    switch (buff.getByte(2)) {
@@ -302,6 +618,11 @@ receive(bufferStore buff)
 		    theNCP->receive(buff);
 
 	    } else {
+		// A delayed ack would look like progress to the Psion.
+		// Send it first, so that the repeated one tells it about
+		// the missing frame, as before.
+		if (ackPending > 0)
+		    sendAck(rxSequence);
 	    	sendAck(rxSequence);
 		if (verbose & LNK_DEBUG_LOG)
 		    lout << "Link: DUP\n";
@@ -310,24 +631,41 @@ receive(bufferStore buff)
 
 	case 0x00:
 	    // Incoming ack
-	    // Find corresponding packet in ackWaitQueue
+	    // Link control frames have precedence, then look
+	    // in the send window.
 	    ackFound = false;
-	    struct timeval refstamp;
 	    pthread_mutex_lock(&queueMutex);
-	    for (i = ackWaitQueue.begin(); i != ackWaitQueue.end(); i++)
+	    for (i = ctlQueue.begin(); i != ctlQueue.end(); i++)
 		if (i->seq == seq) {
 		    ackFound = true;
-		    refstamp = i->stamp;
-		    ackWaitQueue.erase(i);
-		    if (verbose & LNK_DEBUG_LOG) {
-			lout << "Link: << ack seq=" << seq ;
-			if (verbose & LNK_DEBUG_DUMP)
-			    lout << " " << buff;
-			lout << endl;
-		    }
+		    ctlQueue.erase(i);
 		    break;
 		}
+	    if ((!ackFound) && inWindow(seq)) {
+		// Acks are cumulative: Older frames are implicitely ack'ed
+		ackWaitQueueElement &e =
+		    sendWindow[seq & (LINK_WINDOW_SLOTS - 1)];
+		// Karn's rule: Only unambiguous acks give an RTT sample.
+		// The time on the line is accounted for separately.
+		if (!e.resent) {
+		    u_int64_t rtt = monotonic() - e.stamp;
+		    rttSample((rtt > e.wire) ? rtt - e.wire : 0);
+		} else if (srtt != 0) {
+		    // No sample, but the line works again, so
+		    // the back off is over.
+		    updateRto();
+		}
+		ackFound = true;
+		ackUpTo(seq);
+		ctlQueue.clear();
+	    }
 	    pthread_mutex_unlock(&queueMutex);
+	    if (ackFound && (verbose & LNK_DEBUG_LOG)) {
+		lout << "Link: << ack seq=" << seq ;
+		if (verbose & LNK_DEBUG_DUMP)
+		    lout << " " << buff;
+		lout << endl;
+	    }
 	    if (ackFound) {
 		if ((linkType == LINK_TYPE_UNKNOWN) && (seq == 0)) {
 		    // If the remote device runs SIBO protocol, this ACK
@@ -344,46 +682,62 @@ receive(bufferStore buff)
 		    if (verbose & LNK_DEBUG_LOG)
 			lout << "Link: 1-linkType set to " << linkType << endl;
 		}
-		// Older packets implicitely ack'ed
-		multiAck(refstamp);
 		// Transmit waiting packets
 		transmitWaitQueue();
 	    } else {
-		// If packet with seq+1 is in ackWaitQueue, resend it immediately
-		// (Receiving an ack for a packet not on our wait queue is a
-		// hint by the Psion about which was the last packet it
-		// received successfully.)
+		// If packet with seq+1 is in the send window, resend it
+		// immediately (Receiving an ack for a packet not in our
+		// window is a hint by the Psion about which was the last
+		// packet it received successfully.) The Psion has dropped
+		// the frames behind it, so they are resent as well. Every
+		// one of them has brought the same hint, so it is only
+		// acted upon once. Giving up on the link is left to
+		// retransmit().
 		pthread_mutex_lock(&queueMutex);
-		struct timeval now;
-		gettimeofday(&now, NULL);
+		u_int64_t now = monotonic();
 		bool nextFound = false;
-		for (i = ackWaitQueue.begin(); i != ackWaitQueue.end(); i++)
-		    if (i->seq == seq+1) {
-			nextFound = true;
-			if (i->txcount-- == 0) {
-			    // timeout, remove packet
-			    if (verbose & LNK_DEBUG_LOG)
-				lout << "Link: >> TRANSMIT timeout seq=" <<
-				    i->seq << endl;
-			    ackWaitQueue.erase(i);
-			    i--;
-			} else {
+		bool requeued = false;
+		vector<linkFrame> resend;
+		int next = (seq + 1) & seqMask;
+		if (next == probeSeq) {
+		    // The probe is alone on the line. Don't repeat it,
+		    // it may be too large. Only the answer to a poll
+		    // tells, that the Psion has not got it.
+		    nextFound = true;
+		    if (probePolled) {
+			probeFailed();
+			requeued = true;
+		    }
+		} else if (inWindow(next)) {
+		    nextFound = true;
+		    if (next != fastSeq) {
+			fastSeq = next;
+			for (int n = (next - winBase) & seqMask; n < winCount; n++) {
+			    ackWaitQueueElement &e =
+				sendWindow[(winBase + n) & (LINK_WINDOW_SLOTS - 1)];
 			    // retransmit it
-			    i->stamp = now;
+			    e.stamp = now;
+			    e.resent = true;
+			    retransmits++;
 			    if (verbose & LNK_DEBUG_LOG)
-				lout << "Link: >> RETRANSMIT seq=" << i->seq
+				lout << "Link: >> RETRANSMIT seq=" << e.seq
 				     << endl;
-			    p->send(i->data);
+			    resend.push_back(e.data);
 			}
-			break;
 		    }
+		}
 		pthread_mutex_unlock(&queueMutex);
+		for (vector<linkFrame>::iterator f = resend.begin();
+		     f != resend.end(); f++)
+		    p->send(*f);
 		if ((verbose & LNK_DEBUG_LOG) && (!nextFound)) {
 		    lout << "Link: << UNMATCHED ack seq=" << seq;
 		    if (verbose & LNK_DEBUG_DUMP)
 			lout << " " << buff;
 		    lout << endl;
 		}
+		if (requeued)
+		    transmitWaitQueue();
 	    }
 	    break;
 
@@ -393,9 +747,9 @@ receive(bufferStore buff)
 	    if (seq > 3) {
 		// May be a link confirm packet (EPOC)
 		pthread_mutex_lock(&queueMutex);
-		for (i = ackWaitQueue.begin(); i != ackWaitQueue.end(); i++)
+		for (i = ctlQueue.begin(); i != ctlQueue.end(); i++)
 		    if ((i->seq == 0) && (i->data.getByte(0) == 0x21)) {
-			ackWaitQueue.erase(i);
+			ctlQueue.erase(i);
 			linkType = LINK_TYPE_EPOC;
 			if (verbose & LNK_DEBUG_LOG)
 			    lout << "Link: 2-linkType set to " << linkType << endl;
@@ -404,7 +758,7 @@ receive(bufferStore buff)
 			// EPOC can handle extended sequence numbers
 			seqMask = 0x7ff;
 			// EPOC can handle up to 8 unacknowledged packets
-			maxOutstanding = 8;
+			maxOutstanding = LINK_EPOC_WINDOW;
 			p->setEpoc(true);
 			if (verbose & LNK_DEBUG_LOG) {
 			    lout << "Link: << con seq=" << seq ;
@@ -435,7 +789,7 @@ receive(bufferStore buff)
 		    // EPOC can handle extended sequence numbers
 		    seqMask = 0x7ff;
 		    // EPOC can handle up to 8 unacknowledged packets
-		    maxOutstanding = 8;
+		    maxOutstanding = LINK_EPOC_WINDOW;
 		    p->setEpoc(true);
 		    failed = false;
 		    sendReqCon();
@@ -471,17 +825,14 @@ receive(bufferStore buff)
 void Link::
 transmitHoldQueue(int channel)
 {
-    vector<bufferStore> tmpQueue;
-    vector<bufferStore>::iterator i;
+    deque<linkFrame> tmpQueue;
+    deque<linkFrame>::iterator i;
 
-    // First, move desired packets to a temporary queue
+    // First, move the channel's packets to a temporary queue
     pthread_mutex_lock(&queueMutex);
-    for (i = holdQueue.begin(); i != holdQueue.end(); i++)
-	if (i->getByte(0) == channel) {
-	    tmpQueue.push_back(*i);
-	    holdQueue.erase(i);
-	    i--;
-	}
+    tmpQueue.swap(holdQueue[channel]);
+    for (i = tmpQueue.begin(); i != tmpQueue.end(); i++)
+	account(channel, -(long)i->getLen());
     pthread_mutex_unlock(&queueMutex);
 
     // ... then transmit the moved packets
@@ -492,113 +843,188 @@ transmitHoldQueue(int channel)
 void Link::
 transmitWaitQueue()
 {
-    vector<bufferStore> tmpQueue;
-    vector<bufferStore>::iterator i;
-
-    // First, move desired packets to a temporary queue
-    for (i = waitQueue.begin(); i != waitQueue.end(); i++)
-	tmpQueue.push_back(*i);
-    waitQueue.clear();
-    // transmit the moved packets. If the backlock gets
-    // full, they are put into waitQueue again.
-    for (i = tmpQueue.begin(); i != tmpQueue.end(); i++)
-	transmit(*i);
+    // Transmit waiting packets, as long as the window has room.
+    while (!hasFailed()) {
+	linkFrame b;
+	pthread_mutex_lock(&queueMutex);
+	if (windowFull() || !nextWaiting(b)) {
+	    pthread_mutex_unlock(&queueMutex);
+	    break;
+	}
+	int remoteChan = b.empty() ? 0 : b.getByte(0);
+	if (xoff[remoteChan]) {
+	    holdQueue[remoteChan].push_back(b);
+	    account(remoteChan, b.getLen());
+	    pthread_mutex_unlock(&queueMutex);
+	    continue;
+	}
+	sendFrame(b);
+	pthread_mutex_unlock(&queueMutex);
+	p->send(b);
+	pthread_mutex_lock(&queueMutex);
+	unsent--;
+	pthread_mutex_unlock(&queueMutex);
+    }
 }
 
 void Link::
-transmit(bufferStore buf)
+transmit(linkFrame &buf)
 {
     if (hasFailed())
 	return;
 
-    int remoteChan = buf.getByte(0);
+    int remoteChan = buf.empty() ? 0 : buf.getByte(0);
+    pthread_mutex_lock(&queueMutex);
     if (xoff[remoteChan]) {
-	pthread_mutex_lock(&queueMutex);
-	holdQueue.push_back(buf);
+	holdQueue[remoteChan].push_back(buf);
+	account(remoteChan, buf.getLen());
 	pthread_mutex_unlock(&queueMutex);
-    } else {
-
-	// If backlock is full, put on waitQueue
-	int ql;
-	pthread_mutex_lock(&queueMutex);
-	ql = ackWaitQueue.size();
+	return;
+    }
+    // If the send window is full, or other packets are already waiting
+    // for it, put on waitQueue and let the scheduler decide.
+    if (windowFull() || (waitCount > 0)) {
+	queueWaiting(remoteChan, buf);
 	pthread_mutex_unlock(&queueMutex);
-	if (ql >= maxOutstanding) {
-	    waitQueue.push_back(buf);
-	    return;
-	}
+	return;
+    }
+    sendFrame(buf);
+    pthread_mutex_unlock(&queueMutex);
+    p->send(buf);
+    pthread_mutex_lock(&queueMutex);
+    unsent--;
+    // sendFrame() may have split the frame.
+    bool more = (waitCount > 0) && !windowFull();
+    pthread_mutex_unlock(&queueMutex);
+    if (more)
+	transmitWaitQueue();
+}
 
-	ackWaitQueueElement e;
-	e.seq = txSequence++;
-	txSequence &= seqMask;
-	gettimeofday(&e.stamp, NULL);
-	// An empty buffer is considered a new link request
-	if (buf.empty()) {
-	    // Request for new link
-	    e.txcount = 4;
-	    if (verbose & LNK_DEBUG_LOG)
-		lout << "Link: >> req seq=" << e.seq << endl;
-	    buf.prependByte(0x20 + e.seq);
-	} else {
-	    e.txcount = 8;
-	    if (verbose & LNK_DEBUG_LOG) {
-		lout << "Link: >> dat seq=" << e.seq;
-		if (verbose & LNK_DEBUG_DUMP)
-		    lout << " " << buf;
-		lout << endl;
-	    }
-	    if (e.seq > 7) {
-		int hseq = e.seq >> 3;
-		int lseq = 0x30 + ((e.seq & 7) | 8);
-		int seq = (hseq << 8) + lseq;
-		buf.prependWord(seq);
-	    } else
-		buf.prependByte(0x30 + e.seq);
+/**
+ * Assigns the next sequence number to a frame, puts it into
+ * the send window and prepends the link header. Frames, which
+ * are too large for the Psion, are split first.
+ * Must be called with queueMutex held. The caller puts the frame
+ * on the line and decrements unsent afterwards.
+ */
+void Link::
+sendFrame(linkFrame &buf)
+{
+    bool data = !buf.empty() && (buf.getByte(0) != 0);
+    unsigned long limit = probeSize();
+    // A probe must be alone in the window.
+    if ((limit == 0) || (winCount > 0) || (unsent > 0))
+	limit = maxFrame;
+    if (data && (buf.getLen() > limit)) {
+	linkFrame rest = buf.split(limit);
+	requeueWaiting(rest.getByte(0), rest);
+    }
+    int seq = txSequence++;
+    txSequence &= seqMask;
+    unsent++;
+    if (winCount == 0)
+	winBase = seq;
+    winCount++;
+    ackWaitQueueElement &e = sendWindow[seq & (LINK_WINDOW_SLOTS - 1)];
+    e.seq = seq;
+    e.stamp = monotonic();
+    e.resent = false;
+    txFrames++;
+    if (data && (buf.getLen() > maxFrame)) {
+	probeSeq = seq;
+	probeLen = buf.getLen();
+	probePolled = false;
+	probes++;
+	if (verbose & LNK_DEBUG_LOG)
+	    lout << "Link: probing with " << probeLen << " bytes" << endl;
+    }
+    // An empty buffer is considered a new link request
+    if (buf.empty()) {
+	// Request for new link
+	e.txcount = 4;
+	if (verbose & LNK_DEBUG_LOG)
+	    lout << "Link: >> req seq=" << e.seq << endl;
+	buf.prependByte(0x20 + e.seq);
+    } else {
+	e.txcount = 8;
+	if (verbose & LNK_DEBUG_LOG) {
+	    lout << "Link: >> dat seq=" << e.seq;
+	    if (verbose & LNK_DEBUG_DUMP)
+		lout << " " << buf;
+	    lout << endl;
 	}
-	e.data = buf;
-	pthread_mutex_lock(&queueMutex);
-	ackWaitQueue.push_back(e);
-	pthread_mutex_unlock(&queueMutex);
-	p->send(buf);
+	if (e.seq > 7) {
+	    int hseq = e.seq >> 3;
+	    int lseq = 0x30 + ((e.seq & 7) | 8);
+	    int seq = (hseq << 8) + lseq;
+	    buf.prependWord(seq);
+	} else
+	    buf.prependByte(0x30 + e.seq);
     }
+    winBytes += buf.getLen();
+    e.wire = wireTime(winBytes);
+    e.data = buf;
+    pthread_cond_signal(&timerCond);
 }
 
-static void
-timesub(struct timeval *tv, unsigned long millisecs)
+/**
+ * Returns the earliest time, at which an unacknowledged packet is due
+ * for retransmission, or 0 if there are none.
+ * Must be called with queueMutex held.
+ */
+u_int64_t Link::
+nextDeadline()
 {
-    uint64_t micros = tv->tv_sec;
-    uint64_t sub = millisecs;
+    u_int64_t deadline = 0;
+    vector<ackWaitQueueElement>::iterator i;
 
-    micros <<= 32;
-    micros += tv->tv_usec;
-    micros -= (sub * 1000);
-    tv->tv_usec = micros & 0xffffffff;
-    tv->tv_sec  = (micros >>= 32) & 0xffffffff;
+    for (i = ctlQueue.begin(); i != ctlQueue.end(); i++)
+	if ((deadline == 0) || (i->stamp + rto < deadline))
+	    deadline = i->stamp + rto;
+    for (int n = 0; n < winCount; n++) {
+	ackWaitQueueElement &e =
+	    sendWindow[(winBase + n) & (LINK_WINDOW_SLOTS - 1)];
+	if ((deadline == 0) || (e.stamp + e.wire + rto < deadline))
+	    deadline = e.stamp + e.wire + rto;
+    }
+    return deadline;
 }
 
-static bool
-olderthan(struct timeval t1, struct timeval t2)
+/**
+ * Updates the smoothed round trip time and its variation
+ * from a new sample and recalculates the retransmission timeout.
+ * Must be called with queueMutex held.
+ */
+void Link::
+rttSample(u_int64_t rtt)
 {
-    uint64_t m1 = t1.tv_sec;
-    uint64_t m2 = t2.tv_sec;
-    m1 <<= 32;
-    m2 <<= 32;
-    m1 += t1.tv_usec;
-    m2 += t2.tv_usec;
-    return (m1 < m2);
+    // srtt stays 0 only, until the first sample has been taken.
+    if (rtt == 0)
+	rtt = 1;
+    if (srtt == 0) {
+	srtt = rtt;
+	rttvar = rtt / 2;
+    } else {
+	unsigned long delta = (srtt > rtt) ? srtt - rtt : rtt - srtt;
+	rttvar = (3 * rttvar + delta) / 4;
+	srtt = (7 * srtt + rtt) / 8;
+    }
+    updateRto();
 }
 
+/**
+ * Calculates the retransmission timeout from the smoothed round
+ * trip time and its variation, dropping any back off.
+ * Must be called with queueMutex held.
+ */
 void Link::
-multiAck(struct timeval refstamp)
+updateRto()
 {
-    vector<ackWaitQueueElement>::iterator i;
-    pthread_mutex_lock(&queueMutex);
-    for (i = ackWaitQueue.begin(); i != ackWaitQueue.end(); i++)
-	if (olderthan(i->stamp, refstamp)) {
-	    ackWaitQueue.erase(i);
-	    i--;
-	}
-    pthread_mutex_unlock(&queueMutex);
+    rto = srtt + 4 * rttvar;
+    if (rto < LINK_MIN_RTO * 1000)
+	rto = LINK_MIN_RTO * 1000;
+    if (rto > retransTimeout() * 1000)
+	rto = retransTimeout() * 1000;
 }
 
 void Link::
@@ -612,28 +1038,81 @@ retransmit()
 
     pthread_mutex_lock(&queueMutex);
     vector<ackWaitQueueElement>::iterator i;
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    struct timeval expired = now;
-    timesub(&expired, retransTimeout());
-    for (i = ackWaitQueue.begin(); i != ackWaitQueue.end(); i++)
-	if (olderthan(i->stamp, expired)) {
+    // Sent after unlocking, as the pump may need queueMutex,
+    // before it has room for them.
+    vector<linkFrame> resend;
+    u_int64_t now = monotonic();
+    bool expired = false;
+    bool lost = false;
+    i = ctlQueue.begin();
+    while (i != ctlQueue.end()) {
+	if (i->stamp + rto <= now) {
+	    expired = true;
 	    if (i->txcount-- == 0) {
 		// timeout, remove packet
 		if (verbose & LNK_DEBUG_LOG)
 		    lout << "Link: >> TRANSMIT timeout seq=" << i->seq << endl;
-		ackWaitQueue.erase(i);
+		i = ctlQueue.erase(i);
 		failed = true;
-		i--;
+		continue;
 	    } else {
 		// retransmit it
 		i->stamp = now;
+		i->resent = true;
 		if (verbose & LNK_DEBUG_LOG)
 		    lout << "Link: >> RETRANSMIT seq=" << i->seq << endl;
-		p->send(i->data);
+		resend.push_back(i->data);
+	    }
+	}
+	i++;
+    }
+    for (int n = 0; n < winCount; n++) {
+	ackWaitQueueElement &e =
+	    sendWindow[(winBase + n) & (LINK_WINDOW_SLOTS - 1)];
+	if (e.stamp + e.wire + rto <= now) {
+	    expired = true;
+	    if (e.txcount-- == 0) {
+		// timeout, the link is broken
+		if (verbose & LNK_DEBUG_LOG)
+		    lout << "Link: >> TRANSMIT timeout seq=" << e.seq << endl;
+		failed = true;
+		break;
+	    } else if (e.seq == probeSeq) {
+		// A probe may be too large to get through ever.
+		// Ask, whether it has arrived, instead.
+		e.stamp = now;
+		e.resent = true;
+		if (unsent == 0) {
+		    linkFrame poll;
+		    makePoll(poll);
+		    resend.push_back(poll);
+		}
+	    } else {
+		// retransmit it
+		e.stamp = now;
+		e.resent = true;
+		retransmits++;
+		// Only the oldest frame has surely been lost, the
+		// Psion has dropped the ones behind it.
+		if (!lost)
+		    frameLost(e);
+		lost = true;
+		if (verbose & LNK_DEBUG_LOG)
+		    lout << "Link: >> RETRANSMIT seq=" << e.seq << endl;
+		resend.push_back(e.data);
 	    }
 	}
+    }
+    // Back off exponentially, until new samples arrive.
+    if (expired) {
+	rto *= 2;
+	if (rto > retransTimeout() * 1000)
+	    rto = retransTimeout() * 1000;
+    }
     pthread_mutex_unlock(&queueMutex);
+    for (vector<linkFrame>::iterator f = resend.begin();
+	 f != resend.end(); f++)
+	p->send(*f);
 }
 
 void Link::
@@ -645,7 +1124,7 @@ flush() {
 bool Link::
 stuffToSend()
 {
-    return ((!failed) && (!ackWaitQueue.empty()));
+    return ((!failed) && ((winCount > 0) || (!ctlQueue.empty())));
 }
 
 bool Link::
@@ -672,6 +1151,192 @@ getSpeed()
     return p->getSpeed();
 }
 
+void Link::
+getStats(linkStats &stats)
+{
+    pthread_mutex_lock(&queueMutex);
+    stats.srtt = srtt / 1000;
+    stats.rttvar = rttvar / 1000;
+    stats.rto = rto / 1000;
+    stats.txFrames = txFrames;
+    stats.retransmits = retransmits;
+    stats.queuedBytes = queuedTotal;
+    stats.maxQueuedBytes = maxQueued;
+    stats.throttles = throttles;
+    stats.maxFrame = maxFrame;
+    stats.probes = probes;
+    stats.probesFailed = probesFailed;
+    stats.rxFrames = rxFrames;
+    stats.acks = acks;
+    pthread_mutex_unlock(&queueMutex);
+}
+
+/**
+ * Keeps track of the bytes waiting in the queues of a channel and
+ * throttles it, when they exceed LINK_HIGH_WATER. Once they have
+ * drained to LINK_LOW_WATER, the main loop is woken up to resume
+ * reading from the channel's client.
+ * Must be called with queueMutex held.
+ */
+void Link::
+account(int channel, long bytes)
+{
+    queued[channel] += bytes;
+    queuedTotal += bytes;
+    if (queuedTotal > maxQueued)
+	maxQueued = queuedTotal;
+    if (!throttled[channel] && (queued[channel] > LINK_HIGH_WATER)) {
+	throttled[channel] = true;
+	throttles++;
+	if (verbose & LNK_DEBUG_LOG)
+	    lout << "Link: throttle channel " << channel << ", "
+		 << queued[channel] << " bytes queued" << endl;
+    } else if (throttled[channel] && (queued[channel] <= LINK_LOW_WATER)) {
+	throttled[channel] = false;
+	if (verbose & LNK_DEBUG_LOG)
+	    lout << "Link: resume channel " << channel << endl;
+	wakeupMainLoop();
+    }
+}
+
+/**
+ * Returns the time in microseconds, which @p bytes take on the line.
+ */
+u_int64_t Link::
+wireTime(long bytes)
+{
+    int baud = getSpeed();
+    // 10 bits per byte, escapes are rare enough to be ignored.
+    return (baud > 0) ? (u_int64_t)bytes * 10000000 / baud : 0;
+}
+
+/**
+ * Returns the size of the next probe, or 0, if no probe is due.
+ * Only EPOC links are probed.
+ * Must be called with queueMutex held.
+ */
+unsigned long Link::
+probeSize()
+{
+    if ((linkType != LINK_TYPE_EPOC) || (probeSeq >= 0) ||
+	(cleanFrames < LINK_CLEAN_RUN) ||
+	(minRejected - maxFrame <= LINK_PROBE_STEP))
+	return 0;
+    if (minRejected > LINK_MAX_FRAME)
+	return LINK_MAX_FRAME;
+    return (maxFrame + minRejected) / 2;
+}
+
+/**
+ * Checks, if another frame may be sent. While a probe is on its way,
+ * it is the only frame in the window, so that nothing but the poll
+ * can make the Psion repeat its last ack.
+ * Must be called with queueMutex held.
+ */
+bool Link::
+windowFull()
+{
+    return (winCount >= maxOutstanding) || (probeSeq >= 0);
+}
+
+unsigned long Link::
+getMaxFrame()
+{
+    pthread_mutex_lock(&queueMutex);
+    unsigned long ret = probeSize();
+    if (ret == 0)
+	ret = maxFrame;
+    pthread_mutex_unlock(&queueMutex);
+    return ret;
+}
+
+/**
+ * Builds a frame, which asks the Psion, whether it has received the
+ * probe. A data frame, which repeats the sequence number before the
+ * probe's, is answered with an ack for the last frame, the Psion has
+ * received in sequence.
+ * Must be called with queueMutex held. The caller sends @p tmp after
+ * releasing it.
+ */
+void Link::
+makePoll(linkFrame &tmp)
+{
+    int seq = (probeSeq - 1) & seqMask;
+
+    if (verbose & LNK_DEBUG_LOG)
+	lout << "Link: >> poll seq=" << seq << endl;
+    if (seq > 7) {
+	int hseq = seq >> 3;
+	int lseq = 0x30 + ((seq & 7) | 8);
+	tmp.prependWord((hseq << 8) + lseq);
+    } else
+	tmp.prependByte(0x30 + seq);
+    probePolled = true;
+}
+
+/**
+ * Makes the frames smaller, after a large one has timed out. Large
+ * frames are more likely to be hit by line errors, and more expensive
+ * to repeat. Repeated timeouts of the same frame count once. Probing
+ * pauses, as a noisy line would make every probe look rejected, and
+ * resumes after LINK_CLEAN_RUN frames have got through at the first
+ * attempt.
+ * Must be called with queueMutex held.
+ */
+void Link::
+frameLost(const ackWaitQueueElement &e)
+{
+    unsigned long len = e.data.getLen() - ((e.seq > 7) ? 2 : 1);
+    if (e.seq == lostSeq)
+	return;
+    lostSeq = e.seq;
+    cleanFrames = 0;
+    if ((len > LINK_MIN_FRAME) && (maxFrame >= len)) {
+	maxFrame = (len / 2 > LINK_MIN_FRAME) ? len / 2 : LINK_MIN_FRAME;
+	if (verbose & LNK_DEBUG_LOG)
+	    lout << "Link: frames of " << len << " bytes lost, using "
+		 << maxFrame << endl;
+    }
+}
+
+/**
+ * Handles a probe, which the Psion has not received. It is taken out
+ * of the send window and queued again, to be split on the way, and
+ * its sequence number is used once more.
+ * Must be called with queueMutex held.
+ */
+void Link::
+probeFailed()
+{
+    minRejected = probeLen;
+    probesFailed++;
+    if (verbose & LNK_DEBUG_LOG)
+	lout << "Link: frames of " << probeLen << " bytes rejected" << endl;
+    for (int i = winCount - 1; i >= 0; i--) {
+	ackWaitQueueElement &e =
+	    sendWindow[(winBase + i) & (LINK_WINDOW_SLOTS - 1)];
+	linkFrame f = e.data;
+	f.discardHeader((e.seq > 7) ? 2 : 1);
+	e.data.init();
+	requeueWaiting(f.empty() ? 0 : f.getByte(0), f);
+    }
+    txSequence = winBase;
+    winCount = 0;
+    winBytes = 0;
+    fastSeq = -1;
+    probeSeq = -1;
+    probePolled = false;
+}
+
+bool Link::
+isThrottled(int remoteChan)
+{
+    pthread_mutex_lock(&queueMutex);
+    bool ret = throttled[remoteChan & 0xff];
+    pthread_mutex_unlock(&queueMutex);
+    return ret;
+}
+
 /*
  * Local variables:
  * c-basic-offset: 4
@@ -32,12 +32,104 @@
 
 #include "bufferstore.h"
 #include "bufferarray.h"
+#include "linkframe.h"
+#include "plp_inttypes.h"
 #include "Enum.h"
 #include <vector>
+#include <deque>
 
 #define LNK_DEBUG_LOG  4
 #define LNK_DEBUG_DUMP 8
 
+/**
+ * Maximum number of unacknowledged frames on an EPOC link.
+ * The Psion itself uses 8. Larger values may be tried,
+ * up to LINK_WINDOW_SLOTS.
+ */
+#ifndef LINK_EPOC_WINDOW
+#define LINK_EPOC_WINDOW 8
+#endif
+
+/**
+ * Size of the send window ring. Covers the whole
+ * EPOC sequence number space (0 - 0x7ff).
+ */
+#define LINK_WINDOW_SLOTS 2048
+
+/**
+ * Lower bound of the retransmission timeout in milliseconds.
+ */
+#define LINK_MIN_RTO 200
+
+/**
+ * Number of bytes, a channel of weight 1 may send per round of
+ * the transmit scheduler. Once the Psion has accepted larger frames,
+ * the largest of those is used instead, so that every channel can
+ * send at least one frame per round.
+ */
+#define LINK_DRR_QUANTUM 300
+
+/**
+ * Scheduler weight of channels, for which none has been set.
+ */
+#define LINK_DEFAULT_WEIGHT 2
+
+/**
+ * Bytes, which may wait in the queues of a channel (for room in the
+ * send window or for an XON), before ncpd stops reading from the
+ * channel's client. Reading resumes, when the queues have drained
+ * to LINK_LOW_WATER.
+ */
+#ifndef LINK_HIGH_WATER
+#define LINK_HIGH_WATER 8192
+#endif
+#ifndef LINK_LOW_WATER
+#define LINK_LOW_WATER 2048
+#endif
+
+/**
+ * Largest NCP frame (header and data), ncpd sends, until it knows
+ * better. This is what ncpd has always used.
+ */
+#define LINK_MIN_FRAME 253
+
+/**
+ * Largest NCP frame, ncpd tries on an EPOC link. A frame larger than
+ * any accepted before is sent as a probe, alone in the send window.
+ * If it is not acknowledged in time, the Psion's receive state is
+ * polled with a duplicate frame. If it has dropped the probe, the
+ * probe is split and sent again, and the next probe is smaller.
+ */
+#ifndef LINK_MAX_FRAME
+#define LINK_MAX_FRAME 2048
+#endif
+
+/**
+ * Probing stops, when the largest accepted and the smallest rejected
+ * frame size are closer than this.
+ */
+#define LINK_PROBE_STEP 64
+
+/**
+ * Number of frames, which must be acknowledged without having been
+ * resent, before probing resumes after frames have been made smaller.
+ */
+#define LINK_CLEAN_RUN (16 * LINK_EPOC_WINDOW)
+
+/**
+ * On EPOC links, data frames from the Psion are not acknowledged one
+ * by one. A single ack for the last one in sequence is sent, when
+ * LINK_ACK_FRAMES of them have arrived, or LINK_ACK_DELAY milliseconds
+ * after the first of them. LINK_ACK_FRAMES must be less than the
+ * Psion's window of 8 frames. 1 acknowledges every frame at once.
+ */
+#ifndef LINK_ACK_FRAMES
+#define LINK_ACK_FRAMES 4
+#endif
+#ifndef LINK_ACK_DELAY
+#define LINK_ACK_DELAY 50
+#endif
+
 class ncp;
 class packet;
 
@@ -55,15 +147,89 @@ typedef struct {
      */
     int txcount;
     /**
-     * Time of last transmit.
+     * Time of last transmit (monotonic clock, in microseconds).
+     */
+    u_int64_t stamp;
+    /**
+     * Set, if the packet has been retransmitted. Acks for such packets
+     * are ambiguous and are not used for round trip time estimation.
+     */
+    bool resent;
+    /**
+     * Time in microseconds, which this packet and the unacknowledged
+     * ones before it take on the line. The retransmission timeout
+     * starts after that.
      */
-    struct timeval stamp;
+    u_int64_t wire;
     /**
      * Packet content.
      */
-    bufferStore data;
+    linkFrame data;
 } ackWaitQueueElement;
 
+/**
+ * Statistics of a link, as returned by @ref Link::getStats .
+ */
+struct linkStats {
+    /**
+     * Smoothed round trip time in milliseconds, not counting the
+     * time, the frames take on the line.
+     */
+    unsigned long srtt;
+    /**
+     * Round trip time variation in milliseconds.
+     */
+    unsigned long rttvar;
+    /**
+     * Current retransmission timeout in milliseconds.
+     */
+    unsigned long rto;
+    /**
+     * Number of data frames sent (not counting retransmissions).
+     */
+    unsigned long txFrames;
+    /**
+     * Number of retransmitted frames.
+     */
+    unsigned long retransmits;
+    /**
+     * NCP payload bytes sent and received on all channels.
+     */
+    unsigned long long txBytes;
+    unsigned long long rxBytes;
+    /**
+     * Number of buffer allocations in ncpd so far.
+     */
+    unsigned long allocations;
+    /**
+     * Bytes currently waiting in the queues of all channels.
+     */
+    unsigned long queuedBytes;
+    /**
+     * Maximum of queuedBytes so far.
+     */
+    unsigned long maxQueuedBytes;
+    /**
+     * Number of times, a channel has exceeded LINK_HIGH_WATER.
+     */
+    unsigned long throttles;
+    /**
+     * Largest NCP frame, the Psion has accepted so far.
+     */
+    unsigned long maxFrame;
+    /**
+     * Number of frames, which have been sent with a size not
+     * known to be accepted, and how many of them were rejected.
+     */
+    unsigned long probes;
+    unsigned long probesFailed;
+    /**
+     * Number of data frames received in sequence, and of acks sent.
+     */
+    unsigned long rxFrames;
+    unsigned long acks;
+};
+
 extern "C" {
     static void *expire_check(void *);
 }
@@ -95,9 +261,18 @@ public:
     /**
      * Send a PLP packet to the Peer.
      *
-     * @param buff The contents of the PLP packet.
+     * @param buff The contents of the PLP packet. The link header is
+     *  prepended in place, so the caller must not reuse @p buff .
+     */
+    void send(bufferStore &buff);
+
+    /**
+     * Send a PLP packet to the Peer.
+     *
+     * @param f The contents of the PLP packet. Its payload may
+     *  share the storage of a larger message.
      */
-    void send(const bufferStore &buff);
+    void send(linkFrame &f);
 
     /**
      * Query outstanding packets.
@@ -133,6 +308,27 @@ public:
      */
     void purgeQueue(int channel);
 
+    /**
+     * Set the scheduling weight of a remote channel.
+     * While the send window is full, waiting packets of all channels
+     * are sent in a weighted round robin fashion, so a bulk transfer
+     * cannot starve the other channels. A channel with weight 2 gets
+     * twice the bandwidth of a channel with weight 1. The weight is
+     * reset to LINK_DEFAULT_WEIGHT, when the channel is purged.
+     *
+     * @param channel The remote channel.
+     * @param weight The weight (1 - 16).
+     */
+    void setChannelWeight(int channel, int weight);
+
+    /**
+     * Starts passing received frames to the NCP. Until then, they
+     * are dropped unacknowledged, and the Psion has to repeat them.
+     * This keeps a quick Psion from talking to an NCP, which has not
+     * got hold of its link yet.
+     */
+    void start();
+
     /**
      * Set verbosity of Link and underlying packet instance.
      *
@@ -162,25 +358,89 @@ public:
      */
     int getSpeed();
 
+    /**
+     * Get round trip time and retransmission statistics.
+     *
+     * @param stats The structure to fill in.
+     */
+    void getStats(linkStats &stats);
+
+    /**
+     * Checks, if a channel has too much data queued. No more data
+     * should be sent on it, until this returns false again. The
+     * main loop is woken up, when that happens.
+     *
+     * @param remoteChan The Psion's channel number.
+     */
+    bool isThrottled(int remoteChan);
+
+    /**
+     * Returns the length of the NCP frames (header and data), the
+     * messages should be cut into. Larger frames are split by the link.
+     */
+    unsigned long getMaxFrame();
+
+    /**
+     * Returns the time in milliseconds, until a delayed ack is due,
+     * or -1, if there is none. Used by the packet pump for its poll.
+     */
+    int ackTimeout();
+
+    /**
+     * Sends the delayed ack, if it is due and fits into the output
+     * ring without waiting. Used by the packet pump after its poll
+     * and after writing to the device.
+     */
+    void expireAck();
+
 private:
     friend class packet;
     friend void * expire_check(void *);
 
-    void receive(bufferStore buf);
-    void transmit(bufferStore buf);
+    void receive(bufferStore &buf);
+    void transmit(linkFrame &buf);
+    void sendFrame(linkFrame &buf);
+    void queueWaiting(int channel, linkFrame &buf);
+    bool nextWaiting(linkFrame &buf);
     void sendAck(int seq);
+    void makeAck(int seq, linkFrame &tmp);
+    void queueAck();
     void sendReqReq();
     void sendReqCon();
     void sendReq();
-    void multiAck(struct timeval);
+    bool inWindow(int seq);
+    void ackUpTo(int seq);
     void retransmit();
+    u_int64_t nextDeadline();
+    void rttSample(u_int64_t rtt);
+    void updateRto();
     void transmitHoldQueue(int channel);
     void transmitWaitQueue();
     void purgeAllQueues();
+    void account(int channel, long bytes);
+    u_int64_t wireTime(long bytes);
+    void requeueWaiting(int channel, linkFrame &buf);
+    unsigned long probeSize();
+    bool windowFull();
+    void makePoll(linkFrame &tmp);
+    void probeFailed();
+    void frameLost(const ackWaitQueueElement &e);
     unsigned long retransTimeout();
 
     pthread_t checkthread;
     pthread_mutex_t queueMutex;
+    pthread_cond_t timerCond;
+    bool stopCheck;
+
+    /**
+     * Round trip time estimation (Jacobson/Karels), all in microseconds.
+     * srtt is 0 until the first sample has been taken.
+     */
+    unsigned long srtt;
+    unsigned long rttvar;
+    unsigned long rto;
+    unsigned long txFrames;
+    unsigned long retransmits;
 
     ncp *theNCP;
     packet *p;
@@ -191,12 +451,93 @@ private:
     unsigned long conMagic;
     unsigned short verbose;
     bool failed;
+    bool started;
     Enum<link_type> linkType;
 
-    std::vector<ackWaitQueueElement> ackWaitQueue;
-    std::vector<bufferStore> holdQueue;
-    std::vector<bufferStore> waitQueue;
+    /**
+     * Sent data frames, which are not yet acknowledged, indexed by
+     * sequence number. winCount consecutive entries, starting at
+     * sequence number winBase, are in use.
+     */
+    std::vector<ackWaitQueueElement> sendWindow;
+    int winBase;
+    int winCount;
+    long winBytes;
+
+    /**
+     * Sequence number of the frame, which has been repeated on a
+     * duplicate ack, or -1. Further duplicate acks for the same loss
+     * are ignored, until the window advances.
+     */
+    int fastSeq;
+
+    /**
+     * Sent link control frames (ReqReq, ReqCon) awaiting an ack.
+     */
+    std::vector<ackWaitQueueElement> ctlQueue;
+
+    /**
+     * Frames for channels, which have sent an XOFF.
+     */
+    std::deque<linkFrame> holdQueue[256];
+
+    /**
+     * Frames waiting for room in the send window, per remote channel.
+     * Channel 0 (NCP control) is always served first, the others
+     * by deficit round robin in the order of activeChannels.
+     */
+    std::deque<linkFrame> waitQueue[256];
+    std::deque<int> activeChannels;
+    long deficit[256];
+    int weight[256];
+    int waitCount;
     bool xoff[256];
+
+    /**
+     * Bytes in holdQueue and waitQueue, per remote channel and in total.
+     */
+    long queued[256];
+    bool throttled[256];
+    long queuedTotal;
+    long maxQueued;
+    unsigned long throttles;
+
+    /**
+     * Frame size probing: maxFrame is the largest NCP frame, the Psion
+     * has accepted, minRejected the smallest one, it has dropped.
+     * probeSeq is the sequence number of the frame in the send window,
+     * which is larger than maxFrame, or -1. probePolled is set, when
+     * the Psion has been asked, whether it has received that frame.
+     * unsent counts the frames, which have got a sequence number, but
+     * have not been handed to the packet layer yet. The Psion's answer
+     * only tells about the probe, when it has left before the poll.
+     * lostSeq is the frame, which has last timed out, cleanFrames
+     * counts the frames acknowledged without a retransmission since.
+     */
+    unsigned long maxFrame;
+    unsigned long minRejected;
+    unsigned long probeLen;
+    int probeSeq;
+    bool probePolled;
+    int lostSeq;
+    int cleanFrames;
+    unsigned long probes;
+    unsigned long probesFailed;
+    int unsent;
+
+    /**
+     * Delayed acks: ackPending counts the frames received in sequence,
+     * which have not been acknowledged yet. The ack is due at ackDue
+     * (monotonic clock, in microseconds) at the latest. ackBlocked is
+     * set, while a due ack waits for room in the output ring. Only
+     * used by the pump thread, which receives and acknowledges all
+     * frames.
+     */
+    int ackPending;
+    bool ackBlocked;
+    u_int64_t ackDue;
+    unsigned long rxFrames;
+    unsigned long acks;
 };
 
 #endif
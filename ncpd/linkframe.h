@@ -0,0 +1,162 @@
+/*-*-c++-*-
+ * $Id$
+ *
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+#ifndef _linkframe_h_
+#define _linkframe_h_
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <assert.h>
+#include <ostream>
+
+#include "bufferstore.h"
+
+/**
+ * An outgoing PLP frame. The link and NCP headers are kept in
+ * a small array apart from the payload, so that the payload can be
+ * a view of the message, it has been cut from, instead of a copy.
+ */
+class linkFrame {
+public:
+    linkFrame() : start(HDR_ROOM) { }
+
+    /**
+     * Constructs a frame without header.
+     *
+     * @param b The content of the frame. It is shared, not copied.
+     */
+    linkFrame(const bufferStore &b) : start(HDR_ROOM), data(b) { }
+
+    /**
+     * Prepends a byte to the header.
+     */
+    void prependByte(unsigned char c) {
+	assert(start > 0);
+	hdr[--start] = c;
+    }
+
+    /**
+     * Prepends a word (LSB first) to the header.
+     */
+    void prependWord(int w) {
+	prependByte((w >> 8) & 0xff);
+	prependByte(w & 0xff);
+    }
+
+    unsigned long getLen() const {
+	return headerLen() + data.getLen();
+    }
+
+    bool empty() const {
+	return getLen() == 0;
+    }
+
+    /**
+     * Retrieves the byte at index @p pos of the whole frame.
+     */
+    unsigned char getByte(long pos = 0) const {
+	return (pos < headerLen()) ?
+	    hdr[start + pos] : data.getByte(pos - headerLen());
+    }
+
+    const unsigned char *header() const {
+	return hdr + start;
+    }
+
+    int headerLen() const {
+	return HDR_ROOM - start;
+    }
+
+    const bufferStore &payload() const {
+	return data;
+    }
+
+    /**
+     * Removes the first @p n bytes of the header.
+     */
+    void discardHeader(int n) {
+	assert(n <= headerLen());
+	start += n;
+    }
+
+    /**
+     * Cuts an NCP data frame after @p len bytes. The frame keeps the
+     * first part and is marked as not being the last of its message.
+     * The rest of the data becomes a new frame with the NCP header of
+     * the original one. Both parts are views of the original payload.
+     *
+     * @param len The length of the first part, including the NCP header.
+     *
+     * @returns The frame with the rest of the data.
+     */
+    linkFrame split(unsigned long len) {
+	unsigned char dst = getByte(0);
+	unsigned char src = getByte(1);
+	unsigned char last = getByte(2);
+	long skip = NCP_HDR - headerLen();
+	long n = len - NCP_HDR;
+	long rest = data.getLen() - skip - n;
+
+	assert((headerLen() <= NCP_HDR) && (len > NCP_HDR) && (rest > 0));
+	linkFrame tail(bufferStore(data, skip + n, rest));
+	tail.prependByte(last);
+	tail.prependByte(src);
+	tail.prependByte(dst);
+	data = bufferStore(data, skip, n);
+	start = HDR_ROOM;
+	prependByte(NOT_LAST);
+	prependByte(src);
+	prependByte(dst);
+	return tail;
+    }
+
+    /**
+     * Removes header and payload.
+     */
+    void init() {
+	start = HDR_ROOM;
+	data.init();
+    }
+
+    friend std::ostream &operator<<(std::ostream &s, const linkFrame &f) {
+	bufferStore b(f.header(), f.headerLen());
+	b.addBuff(f.data);
+	return s << b;
+    }
+
+private:
+    // Room for the longest headers: NCP (3) and link (2)
+    enum { HDR_ROOM = 8 };
+    // Length of the NCP header and its "more fragments follow" flag
+    enum { NCP_HDR = 3, NOT_LAST = 2 };
+
+    unsigned char hdr[HDR_ROOM];
+    int start;
+    bufferStore data;
+};
+
+#endif
+
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * End:
+ */
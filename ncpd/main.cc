@@ -42,6 +42,10 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <time.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 #include <plpintl.h>
 
 #include "ncp.h"
@@ -49,6 +53,7 @@
 #include "linkchan.h"
 #include "link.h"
 #include "packet.h"
+#include "main.h"
 
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE
@@ -63,10 +68,22 @@ static bool autoexit = false;
 
 static ncp *theNCP = NULL;
 static IOWatch iow;
-static IOWatch accept_iow;
 static ppsocket skt;
 static int numScp = 0;
 static socketChan *scp[257]; // MAX_CHANNELS_PSION + 1
+static int wakeFd[2] = { -1, -1 };
+
+/**
+ * Interval for checking the serial line's modem status and
+ * the timeouts of pending connects, in milliseconds.
+ * Everything else is handled, when it happens.
+ */
+#define LINK_CHECK_INTERVAL 1000
+
+/**
+ * Delay before reconnecting a failed link, in seconds.
+ */
+#define LINK_RESTART_DELAY 5
 
 
 logbuf ilog(LOG_INFO, STDOUT_FILENO);
@@ -82,6 +99,7 @@ term_handler(int)
     linf << _("Got SIGTERM") << endl;
     signal(SIGTERM, term_handler);
     active = false;
+    wakeupMainLoop();
 };
 
 static RETSIGTYPE
@@ -90,15 +108,35 @@ int_handler(int)
     linf << _("Got SIGINT") << endl;
     signal(SIGINT, int_handler);
     active = false;
+    wakeupMainLoop();
 };
 
+void
+wakeupMainLoop()
+{
+    if (wakeFd[1] == -1)
+	return;
+#ifdef HAVE_SYS_EVENTFD_H
+    eventfd_t one = 1;
+    write(wakeFd[1], &one, sizeof(one));
+#else
+    char c = 0;
+    write(wakeFd[1], &c, 1);
+#endif
+}
+
+static void
+drainWakeup()
+{
+    char buf[64];
+    while (read(wakeFd[0], buf, sizeof(buf)) > 0)
+	;
+}
+
 void
 checkForNewSocketConnection()
 {
     string peer;
-    if (accept_iow.watch(5,0) <= 0) {
-	return;
-    }
     ppsocket *next = skt.accept(&peer, &iow);
     if (next != NULL) {
 	next->setWatch(&iow);
@@ -123,24 +161,96 @@ checkForNewSocketConnection()
     }
 }
 
-void *
-pollSocketConnections(void *)
+static void
+pollSocketConnection(int fd)
 {
-    while (active) {
-        iow.watch(0, 10000);
-        for (int i = 0; i < numScp; i++) {
+    for (int i = 0; i < numScp; i++)
+	if (scp[i]->getSocket() == fd) {
 	    scp[i]->socketPoll();
-	    if (scp[i]->terminate()) {
-	        // Requested channel termination
-	        delete scp[i];
-	        numScp--;
-	        for (int j = i; j < numScp; j++)
-		    scp[j] = scp[j + 1];
-		i--;
-	    }
-        }
+	    return;
+	}
+}
+
+static void
+removeSocketConnections()
+{
+    for (int i = 0; i < numScp; i++) {
+	if (scp[i]->terminate()) {
+	    // Requested channel termination
+	    delete scp[i];
+	    numScp--;
+	    for (int j = i; j < numScp; j++)
+		scp[j] = scp[j + 1];
+	    i--;
+	} else if (scp[i]->isConnecting() ||
+		   (scp[i]->isConnected() && scp[i]->ncpThrottled()))
+	    // Don't watch a client, which waits for the Psion
+	    // to accept its connect, or whose channel has too
+	    // much data queued. Its data is read later.
+	    iow.remIO(scp[i]->getSocket());
+	else
+	    iow.addIO(scp[i]->getSocket());
+    }
+}
+
+static void
+checkLink(time_t &restartTime)
+{
+    if (restartTime) {
+	if (time(0) < restartTime)
+	    return;
+	restartTime = 0;
+	if (verbose)
+	    lout << "ncp: restarting\n";
+	theNCP->reset();
+	return;
+    }
+    if (theNCP->hasFailed()) {
+	if (autoexit) {
+	    active = false;
+	    return;
+	}
+	restartTime = time(0) + LINK_RESTART_DELAY;
+    }
+}
+
+/**
+ * The main loop of ncpd. Waits for new clients, requests from
+ * clients and wakeups from the link and dispatches them.
+ */
+static void
+mainLoop()
+{
+    time_t restartTime = 0;
+    struct timespec last;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+
+    iow.addIO(wakeFd[0]);
+    while (active) {
+	int fds[32];
+	int n = iow.wait(fds, 32, LINK_CHECK_INTERVAL);
+	for (int i = 0; i < n; i++) {
+	    if (fds[i] == wakeFd[0])
+		drainWakeup();
+	    else if (fds[i] == skt.getSocket())
+		checkForNewSocketConnection();
+	    else
+		pollSocketConnection(fds[i]);
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((now.tv_sec - last.tv_sec) * 1000 +
+	    (now.tv_nsec - last.tv_nsec) / 1000000 >= LINK_CHECK_INTERVAL) {
+	    last = now;
+	    checkLink(restartTime);
+	    // Check the connect timeouts of pending clients.
+	    for (int i = 0; i < numScp; i++)
+		if (scp[i]->isConnecting())
+		    scp[i]->socketPoll();
+	}
+	removeSocketConnections();
     }
-    return NULL;
 }
 
 static void
@@ -229,26 +339,6 @@ parse_destination(const char *arg, const char **host, int *port)
 	*port = atoi(pp);
 }
 
-static void *
-link_thread(void *arg)
-{
-    while (active) {
-        // psion
-        iow.watch(1, 0);
-        if (theNCP->hasFailed()) {
-            if (autoexit) {
-		active = false;
-                break;
-	    }
-            iow.watch(5, 0);
-            if (verbose)
-                lout << "ncp: restarting\n";
-            theNCP->reset();
-        }
-    }
-    return NULL;
-}
-
 int
 main(int argc, char **argv)
 {
@@ -348,7 +438,7 @@ main(int argc, char **argv)
 	case 0:
 	    signal(SIGTERM, term_handler);
 	    signal(SIGINT, int_handler);
-	    skt.setWatch(&accept_iow);
+	    skt.setWatch(&iow);
 	    if (!skt.listen(host, sockNum))
 		cerr << "listen on " << host << ":" << sockNum << ": "
 		     << strerror(errno) << endl;
@@ -374,29 +464,25 @@ main(int argc, char **argv)
 		    }
 		}
 		memset(scp, 0, sizeof(scp));
-		theNCP = new ncp(serialDevice, baudRate, nverbose);
-		if (!theNCP) {
-		    lerr << "Could not create NCP object" << endl;
-		    exit(-1);
+#ifdef HAVE_SYS_EVENTFD_H
+		wakeFd[0] = wakeFd[1] = eventfd(0, EFD_NONBLOCK);
+#else
+		if (pipe(wakeFd) == 0) {
+		    fcntl(wakeFd[0], F_SETFL, O_NONBLOCK);
+		    fcntl(wakeFd[1], F_SETFL, O_NONBLOCK);
 		}
-		pthread_t thr_a, thr_b;
-		if (pthread_create(&thr_a, NULL, link_thread, NULL) != 0) {
-		    lerr << "Could not create Link thread" << endl;
+#endif
+		if (wakeFd[0] == -1) {
+		    lerr << "Could not create wakeup descriptor" << endl;
 		    exit(-1);
 		}
-		if (pthread_create(&thr_b, NULL,
-				   pollSocketConnections, NULL) != 0) {
-		    lerr << "Could not create Socket thread" << endl;
+		theNCP = new ncp(serialDevice, baudRate, nverbose);
+		if (!theNCP) {
+		    lerr << "Could not create NCP object" << endl;
 		    exit(-1);
 		}
-		while (active)
-		    checkForNewSocketConnection();
+		mainLoop();
 		linf << _("terminating") << endl;
-		void *ret;
-		pthread_join(thr_a, &ret);
-                linf << _("joined Link thread") << endl;
-		pthread_join(thr_b, &ret);
-                linf << _("joined Socket thread") << endl;
 		delete theNCP;
                 linf << _("shut down NCP") << endl;
 	    }
@@ -30,6 +30,13 @@ extern std::ostream lout;
 extern std::ostream lerr;
 extern std::ostream linf;
 
+/**
+ * Wakes up the main loop of ncpd, so that it looks for
+ * terminated channels and changes of the link state.
+ * May be called from any thread and from signal handlers.
+ */
+extern void wakeupMainLoop();
+
 #endif
 
 /*
@@ -29,6 +29,7 @@
 #include <string>
 
 #include <time.h>
+#include <string.h>
 
 #include <bufferstore.h>
 #include <bufferarray.h>
@@ -41,10 +42,35 @@
 
 #define MAX_CHANNELS_PSION 256
 #define MAX_CHANNELS_SIBO  8
-#define NCP_SENDLEN 250
 
 using namespace std;
 
+/**
+ * Transmit scheduling weights of Psion servers. Interactive
+ * services get a larger share of the link than bulk file transfers.
+ * Servers not listed here get LINK_DEFAULT_WEIGHT.
+ */
+static struct {
+    const char *name;
+    int weight;
+} serverWeights[] = {
+    { "CLIPSVR.RSY", 8 },
+    { "SYS$RPCS", 8 },
+    { "SYS$RFSV", 1 },
+    { NULL, 0 }
+};
+
+static int
+serverWeight(const char *name)
+{
+    if (name)
+	for (int i = 0; serverWeights[i].name; i++)
+	    if (!strncmp(name, serverWeights[i].name,
+			 strlen(serverWeights[i].name)))
+		return serverWeights[i].weight;
+    return LINK_DEFAULT_WEIGHT;
+}
+
 ncp::ncp(const char *fname, int baud, unsigned short _verbose)
 {
     channelPtr = new channel*[MAX_CHANNELS_PSION + 1];
@@ -53,9 +79,12 @@ ncp::ncp(const char *fname, int baud, unsigned short _verbose)
     assert(messageList);
     remoteChanList = new int[MAX_CHANNELS_PSION + 1];
     assert(remoteChanList);
+    expectedLen = new long[MAX_CHANNELS_PSION + 1];
+    assert(expectedLen);
 
     failed = false;
     verbose = _verbose;
+    txBytes = rxBytes = 0;
 
     // until detected on receipt of INFO we use these.
     maxChannels = MAX_CHANNELS_SIBO;
@@ -63,18 +92,21 @@ ncp::ncp(const char *fname, int baud, unsigned short _verbose)
     lChan = NULL;
 
     // init channels
-    for (int i = 0; i < MAX_CHANNELS_PSION; i++)
+    for (int i = 0; i < MAX_CHANNELS_PSION; i++) {
 	channelPtr[i] = NULL;
+	expectedLen[i] = 0;
+    }
 
     l = new Link(fname, baud, this, verbose);
     assert(l);
+    l->start();
 }
 
 ncp::~ncp()
 {
     bufferStore b;
     for (int i = 0; i < maxLinks(); i++) {
-	if (isValidChannel(i)) {
+	if (isValidChannel(i) && (remoteChanList[i] >= 0)) {
 	    bufferStore b2;
 	    b2.addByte(remoteChanList[i]);
 	    controlChannel(i, NCON_MSG_CHANNEL_DISCONNECT, b2);
@@ -85,6 +117,7 @@ ncp::~ncp()
     delete l;
     delete [] channelPtr;
     delete [] remoteChanList;
+    delete [] expectedLen;
     delete [] messageList;
 }
 
@@ -128,7 +161,7 @@ getProtocolVersion()
 }
 
 void ncp::
-receive(bufferStore s) {
+receive(bufferStore &s) {
     if (s.getLen() > 1) {
 	int channel = s.getByte(0);
 	s.discardFirstBytes(1);
@@ -145,10 +178,22 @@ receive(bufferStore s) {
 	    if (!isValidChannel(channel)) {
 		lerr << "ncp: Got message for unknown channel\n";
 	    } else {
-		messageList[channel].addBuff(s);
+		bufferStore &m = messageList[channel];
+		rxBytes += s.getLen();
+		if (m.empty() && (allData == LAST_MESS)) {
+		    // A single fragment just shares the received frame.
+		    m = s;
+		} else {
+		    // Reassemble in place. Messages on a channel tend to
+		    // be alike, so room for the last one is reserved.
+		    if (m.empty())
+			m.reserve(expectedLen[channel]);
+		    m.addBuff(s);
+		}
 		if (allData == LAST_MESS) {
-		    channelPtr[channel]->ncpDataCallback(messageList[channel]);
-		    messageList[channel].init();
+		    expectedLen[channel] = m.getLen();
+		    channelPtr[channel]->ncpDataCallback(m);
+		    m.init();
 		} else if (allData != NOT_LAST_MESS) {
 		    lerr << "ncp: bizarre third byte!\n";
 		}
@@ -295,7 +340,13 @@ decodeControlMessage(bufferStore & buff)
 		if (verbose & NCP_DEBUG_LOG)
 		    lout << "OK" << endl;
 		if (isValidChannel(forChan)) {
+		    const char *name;
+
 		    remoteChanList[forChan] = remoteChan;
+		    name = channelPtr[forChan]->getNcpConnectName();
+		    if (!name)
+			name = channelPtr[forChan]->getNcpRegisterName();
+		    l->setChannelWeight(remoteChan, serverWeight(name));
 		    channelPtr[forChan]->ncpConnectAck();
 		} else {
 		    if (verbose & NCP_DEBUG_LOG)
@@ -432,6 +483,8 @@ connect(channel * ch)
 	cNum = getFirstUnusedChan();
     if (cNum > 0) {
 	channelPtr[cNum] = ch;
+	// Not known, until the Psion accepts.
+	remoteChanList[cNum] = -1;
 	ch->setNcpChannel(cNum);
 	bufferStore b;
 	if (ch->getNcpConnectName())
@@ -450,27 +503,27 @@ connect(channel * ch)
 void ncp::
 send(int channel, bufferStore & a)
 {
-    bool last;
-    do {
-	last = true;
-
-	if (a.getLen() > NCP_SENDLEN)
-	    last = false;
-
-	bufferStore out;
-	out.addByte(remoteChanList[channel]);
-	out.addByte(channel);
-
-	if (last) {
-	    out.addByte(LAST_MESS);
-	} else {
-	    out.addByte(NOT_LAST_MESS);
-	}
+    long len = a.getLen();
+    long off = 0;
 
-	out.addBuff(a, NCP_SENDLEN);
-	a.discardFirstBytes(NCP_SENDLEN);
+    txBytes += len;
+    // The fragments are views of a, only their headers are new.
+    // Their size is what the link has found out, the Psion accepts.
+    long max = l->getMaxFrame() - 3;
+    do {
+	long n = len - off;
+	bool last = (n <= max);
+	if (!last)
+	    n = max;
+
+	linkFrame out(bufferStore(a, off, n));
+	out.prependByte(last ? LAST_MESS : NOT_LAST_MESS);
+	out.prependByte(channel);
+	out.prependByte(remoteChanList[channel]);
 	l->send(out);
-    } while (!last);
+	off += n;
+    } while (off < len);
+    a.init();
     lastSentChannel = channel;
 }
 
@@ -485,6 +538,11 @@ disconnect(int channel)
     if (verbose & NCP_DEBUG_LOG)
 	lout << "ncp: disconnect: channel=" << channel << endl;
     channelPtr[channel] = NULL;
+    // A refused connect has no remote channel, which must be closed.
+    // The number left from an earlier use of this local channel may
+    // belong to another connection by now.
+    if (remoteChanList[channel] < 0)
+	return;
     bufferStore b;
     b.addByte(remoteChanList[channel]);
     controlChannel(channel, NCON_MSG_CHANNEL_DISCONNECT, b);
@@ -527,6 +585,22 @@ getSpeed()
     return l->getSpeed();
 }
 
+bool ncp::
+isThrottled(int channel)
+{
+    return isValidChannel(channel) && (remoteChanList[channel] >= 0) &&
+	l->isThrottled(remoteChanList[channel]);
+}
+
+void ncp::
+getLinkStats(linkStats &stats)
+{
+    l->getStats(stats);
+    stats.txBytes = txBytes;
+    stats.rxBytes = rxBytes;
+    stats.allocations = bufferStore::allocations();
+}
+
 char *ncp::
 ctrlMsgName(unsigned char msgType)
 {
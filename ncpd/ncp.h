@@ -36,6 +36,7 @@
 
 class Link;
 class channel;
+struct linkStats;
 
 #define NCP_DEBUG_LOG  1
 #define NCP_DEBUG_DUMP 2
@@ -79,6 +80,8 @@ public:
     unsigned short getVerbose();
     short int getProtocolVersion();
     int getSpeed();
+    void getLinkStats(linkStats &stats);
+    bool isThrottled(int channel);
 
 private:
     friend class Link;
@@ -96,7 +99,7 @@ private:
 	NCON_MSG_NCP_END=8
     };
     enum protocolVersionType { PV_SERIES_5 = 6, PV_SERIES_3 = 3 };
-    void receive(bufferStore s);
+    void receive(bufferStore &s);
     int getFirstUnusedChan();
     bool isValidChannel(int);
     void decodeControlMessage(bufferStore &buff);
@@ -108,12 +111,19 @@ private:
     channel **channelPtr;
     bufferStore *messageList;
     int *remoteChanList;
+    /**
+     * Length of the last message received on each channel. Used to
+     * size the reassembly buffer of the next one.
+     */
+    long *expectedLen;
     bool failed;
     short int protocolVersion;
     linkChan *lChan;
     int maxChannels;
     std::vector<PcServer> pcServers;
     int lastSentChannel;
+    unsigned long long txBytes;
+    unsigned long long rxBytes;
 };
 
 #endif
@@ -38,7 +38,14 @@
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <termios.h>
-#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include <plp_inttypes.h>
 
 #include "mp_serial.h"
 #include "packet.h"
@@ -58,85 +65,71 @@
 static unsigned short pumpverbose = 0;
 
 extern "C" {
-/**
- * Signal handler does nothing. It just exists
- * for having the select() below return an
- * interrupted system call.
- */
-static void usr1handler(int sig)
-{
-    signal(SIGUSR1, usr1handler);
-}
-
 
 static void *pump_run(void *arg)
 {
     packet *p = (packet *)arg;
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-    while (1) {
-	if (p->fd != -1) {
-	    fd_set r_set;
-	    fd_set w_set;
-	    int res;
-	    int count;
-
-	    FD_ZERO(&r_set);
-	    w_set = r_set;
+    while (!p->stopPump) {
+	struct pollfd pfd[2];
+	int nfds = 1;
+	int res;
+	int count;
+
+	pfd[0].fd = p->wakeFd[0];
+	pfd[0].events = POLLIN;
+	pfd[0].revents = 0;
+	if ((p->fd != -1) && !p->lastFatal) {
+	    pfd[1].fd = p->fd;
+	    pfd[1].events = 0;
+	    pfd[1].revents = 0;
 	    if (hasSpace(p->in))
-		FD_SET(p->fd, &r_set);
+		pfd[1].events |= POLLIN;
 	    if (hasData(p->out))
-		FD_SET(p->fd, &w_set);
-	    res = select(p->fd+1, &r_set, &w_set, NULL, NULL);
-	    switch (res) {
-		case 0:
-		    break;
-		case -1:
-		    break;
-		default:
-		    if (FD_ISSET(p->fd, &w_set)) {
-			count = p->outWrite - p->outRead;
-			if (count < 0)
-			    count = (BUFLEN - p->outRead);
-			res = write(p->fd, &p->outBuffer[p->outRead], count);
-			if (res > 0) {
-			    if (pumpverbose & PKT_DEBUG_DUMP) {
-				int i;
-				printf("pump: wrote %d bytes: (", res);
-				for (i = 0; i<res; i++)
-				    printf("%02x ",
-					   p->outBuffer[p->outRead + i]);
-				printf(")\n");
-			    }
-			    int hadSpace = hasSpace(p->out);
-			    inca(p->outRead, res);
-			    if (!hadSpace)
-				    pthread_kill(p->thisThread, SIGUSR1);
-			}
-		    }
-		    if (FD_ISSET(p->fd, &r_set)) {
-			count = p->inRead - p->inWrite;
-			if (count <= 0)
-			    count = (BUFLEN - p->inWrite);
-			res = read(p->fd, &p->inBuffer[p->inWrite], count);
-			if (res > 0) {
-			    if (pumpverbose & PKT_DEBUG_DUMP) {
-				int i;
-				printf("pump: read %d bytes: (", res);
-				for (i = 0; i<res; i++)
-				    printf("%02x ", p->inBuffer[p->inWrite + i]);
-				printf(")\n");
-			    }
-			    inca(p->inWrite, res);
-			    p->findSync();
-			}
-		    } else {
-			if (hasData(p->in))
-			    p->findSync();
-		    }
-		    break;
+		pfd[1].events |= POLLOUT;
+	    nfds = 2;
+	}
+	// Wake up in time for a delayed ack.
+	res = poll(pfd, nfds, p->theLINK->ackTimeout());
+	p->theLINK->expireAck();
+	if (res <= 0)
+	    continue;
+	if (pfd[0].revents & POLLIN)
+	    p->drainWakeup();
+	if (nfds < 2)
+	    continue;
+	if ((pfd[1].revents & (POLLERR | POLLHUP | POLLNVAL)) &&
+	    !(pfd[1].revents & (POLLIN | POLLOUT))) {
+	    // Stop polling a dead device until the link resets it.
+	    p->setFatal();
+	    continue;
+	}
+	if (pfd[1].revents & POLLOUT) {
+	    p->writeOut();
+	    // Try again, if there was no room for it before.
+	    p->theLINK->expireAck();
+	}
+	if (pfd[1].revents & POLLIN) {
+	    count = p->inRead - p->inWrite;
+	    if (count <= 0)
+		count = (BUFLEN - p->inWrite);
+	    res = read(p->fd, &p->inBuffer[p->inWrite], count);
+	    if (res > 0) {
+		if (pumpverbose & PKT_DEBUG_DUMP) {
+		    int i;
+		    printf("pump: read %d bytes: (", res);
+		    for (i = 0; i<res; i++)
+			printf("%02x ", p->inBuffer[p->inWrite + i]);
+		    printf(")\n");
+		}
+		inca(p->inWrite, res);
+		p->findSync();
 	    }
+	} else {
+	    if (hasData(p->in))
+		p->findSync();
 	}
     }
+    return NULL;
 }
 
 };
@@ -164,13 +157,19 @@ packet(const char *fname, int _baud, Link *_link, unsigned short _verbose)
     justStarted = true;
 
     // Initialize CRC table
-    crc_table[0] = 0;
+    crc_table[0][0] = 0;
     for (int i = 0; i < 128; i++) {
-	unsigned int carry = crc_table[i] & 0x8000;
-	unsigned int tmp = (crc_table[i] << 1) & 0xffff;
-	crc_table[i * 2 + (carry ? 0 : 1)] = tmp ^ 0x1021;
-	crc_table[i * 2 + (carry ? 1 : 0)] = tmp;
+	unsigned int carry = crc_table[0][i] & 0x8000;
+	unsigned int tmp = (crc_table[0][i] << 1) & 0xffff;
+	crc_table[0][i * 2 + (carry ? 0 : 1)] = tmp ^ 0x1021;
+	crc_table[0][i * 2 + (carry ? 1 : 0)] = tmp;
     }
+    // ... and the tables for processing 4 bytes at once
+    for (int k = 1; k < 4; k++)
+	for (int i = 0; i < 256; i++) {
+	    unsigned short c = crc_table[k - 1][i];
+	    crc_table[k][i] = (c << 8) ^ crc_table[0][c >> 8];
+	}
 
     inRead = inWrite = outRead = outWrite = 0;
     inBuffer = new unsigned char[BUFLEN + 1];
@@ -182,9 +181,22 @@ packet(const char *fname, int _baud, Link *_link, unsigned short _verbose)
     lastFatal = false;
     serialStatus = -1;
     lastSYN = startPkt = -1;
-    crcIn = crcOut = 0;
+    crcIn = 0;
+
+    stopPump = false;
+    pthread_mutex_init(&sendMutex, NULL);
+    pthread_mutex_init(&outMutex, NULL);
+    pthread_cond_init(&outCond, NULL);
+#ifdef HAVE_SYS_EVENTFD_H
+    wakeFd[0] = wakeFd[1] = eventfd(0, EFD_NONBLOCK);
+    assert(wakeFd[0] != -1);
+#else
+    int res = pipe(wakeFd);
+    assert(res == 0);
+    fcntl(wakeFd[0], F_SETFL, O_NONBLOCK);
+    fcntl(wakeFd[1], F_SETFL, O_NONBLOCK);
+#endif
 
-    thisThread = pthread_self();
     realBaud = baud;
     if (baud < 0) {
 	baud_index = 1;
@@ -193,39 +205,62 @@ packet(const char *fname, int _baud, Link *_link, unsigned short _verbose)
     fd = init_serial(devname, realBaud, 0);
     if (fd == -1)
 	lastFatal = true;
-    else {
-	signal(SIGUSR1, usr1handler);
-	pthread_create(&datapump, NULL, pump_run, this);
-    }
+    pthread_create(&datapump, NULL, pump_run, this);
 }
 
 packet::
 ~packet()
 {
-    if (fd != -1) {
-	pthread_cancel(datapump);
-	pthread_join(datapump, NULL);
+    stopPumpThread();
+    if (fd != -1)
 	ser_exit(fd);
-    }
     fd = -1;
+#ifndef HAVE_SYS_EVENTFD_H
+    close(wakeFd[1]);
+#endif
+    close(wakeFd[0]);
+    pthread_cond_destroy(&outCond);
+    pthread_mutex_destroy(&outMutex);
+    pthread_mutex_destroy(&sendMutex);
     delete []inBuffer;
     delete []outBuffer;
     free(devname);
 }
 
+void packet::
+stopPumpThread()
+{
+    stopPump = true;
+    wakePump();
+    pthread_join(datapump, NULL);
+    // Release writers, which still wait for space.
+    pthread_mutex_lock(&outMutex);
+    pthread_cond_broadcast(&outCond);
+    pthread_mutex_unlock(&outMutex);
+}
+
 void packet::
 reset()
 {
-    if (fd != -1) {
-	pthread_cancel(datapump);
-	pthread_join(datapump, NULL);
+    if (pthread_equal(pthread_self(), datapump)) {
+	// Called by the pump itself (from findSync), which
+	// simply continues with the new device afterwards.
+	// Discard pending output. outWrite is left alone, as a
+	// sender may be copying a frame behind it right now.
+	pthread_mutex_lock(&outMutex);
+	outRead = outWrite;
+	pthread_cond_broadcast(&outCond);
+	pthread_mutex_unlock(&outMutex);
+	internalReset();
+	return;
     }
-    outRead = outWrite = 0;
+    stopPumpThread();
+    pthread_mutex_lock(&outMutex);
+    outRead = outWrite;
+    pthread_mutex_unlock(&outMutex);
     internalReset();
-    if (fd != -1) {
-	pthread_create(&datapump, NULL, pump_run, this);
-	realWrite();
-    }
+    stopPump = false;
+    pthread_create(&datapump, NULL, pump_run, this);
 }
 
 void packet::
@@ -243,7 +278,7 @@ internalReset()
     lastFatal = false;
     serialStatus = -1;
     lastSYN = startPkt = -1;
-    crcIn = crcOut = 0;
+    crcIn = 0;
     realBaud = baud;
     justStarted = true;
     if (baud < 0) {
@@ -284,80 +319,313 @@ getSpeed()
     return realBaud;
 }
 
-void packet::
-send(bufferStore &b)
+/**
+ * Calculates the CRC of a block of data, 4 bytes at a time.
+ */
+unsigned short packet::
+crcBlock(const unsigned char *p, long len, unsigned short crc)
 {
-    opByte(0x16);
-    opByte(0x10);
-    opByte(0x02);
+    while (len >= 4) {
+	crc = crc_table[3][(crc >> 8) ^ p[0]] ^
+	    crc_table[2][(crc & 0xff) ^ p[1]] ^
+	    crc_table[1][p[2]] ^
+	    crc_table[0][p[3]];
+	p += 4;
+	len -= 4;
+    }
+    while (len-- > 0)
+	addToCrc(*p++, &crc);
+    return crc;
+}
 
-    crcOut = 0;
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+// Nonzero, if any byte of w is zero
+#define HASZERO(w) (((w) - ONES) & ~(w) & HIGHS)
+
+/**
+ * Escapes a block of data for transmission. Runs of data which
+ * need no escaping are found 8 bytes at a time and copied as a whole.
+ * The output buffer must have room for 2 * len bytes.
+ *
+ * @returns The number of bytes written to out.
+ */
+long packet::
+encode(const unsigned char *p, long len, unsigned char *out)
+{
+    const unsigned char *end = p + len;
+    unsigned char *o = out;
+    u_int64_t etx = isEPOC ? (ONES * 0x03) : (ONES * 0x10);
+
+    while (p < end) {
+	const unsigned char *r = p;
+
+	while ((end - r) >= 8) {
+	    u_int64_t w;
+	    memcpy(&w, r, 8);
+	    u_int64_t d = w ^ (ONES * 0x10);
+	    u_int64_t e = w ^ etx;
+	    if (HASZERO(d) | HASZERO(e))
+		break;
+	    r += 8;
+	}
+	while ((r < end) && (*r != 0x10) && !(isEPOC && (*r == 0x03)))
+	    r++;
+	memcpy(o, p, r - p);
+	o += (r - p);
+	p = r;
+	if (p < end) {
+	    *o++ = 0x10;
+	    *o++ = (*p == 0x03) ? 0x04 : 0x10;
+	    p++;
+	}
+    }
+    return o - out;
+}
+
+/**
+ * Builds the complete PLP frame for @p f in @p stage.
+ *
+ * @returns the length of the frame.
+ */
+long packet::
+assemble(const linkFrame &f, bufferStore &stage)
+{
+    const bufferStore &b = f.payload();
+    const unsigned char *hdr = f.header();
+    long hlen = f.headerLen();
     long len = b.getLen();
+    const unsigned char *data = (const unsigned char *)b.getString(0);
 
     if (verbose & PKT_DEBUG_LOG) {
 	lout << "packet: >> ";
 	if (verbose & PKT_DEBUG_DUMP)
-	    lout << b;
+	    lout << f;
 	else
-	    lout << " len=" << dec << len;
+	    lout << " len=" << dec << hlen + len;
 	lout << endl;
     }
 
-    for (int i = 0; i < len; i++) {
-	unsigned char c = b.getByte(i);
-	switch (c) {
-	    case 0x03:
-		if (isEPOC) {
-		    opByte(0x10);
-		    opByte(0x04);
-		    addToCrc(0x03, &crcOut);
-		} else
-		    opCByte(c, &crcOut);
+    unsigned short crc = crcBlock(hdr, hlen, 0);
+    crc = crcBlock(data, len, crc);
+    unsigned char *fr = stage.extend(2 * (hlen + len) + 7);
+    unsigned char *o = fr;
+    *o++ = 0x16;
+    *o++ = 0x10;
+    *o++ = 0x02;
+    o += encode(hdr, hlen, o);
+    o += encode(data, len, o);
+    *o++ = 0x10;
+    *o++ = 0x03;
+    *o++ = crc >> 8;
+    *o++ = crc & 0xff;
+    return o - fr;
+}
+
+void packet::
+send(const linkFrame &f)
+{
+    // Several threads send, so the frame is assembled in a buffer
+    // of its own first ...
+    bufferStore stage;
+    long flen = assemble(f, stage);
+    const unsigned char *o = (const unsigned char *)stage.getString(0);
+
+    // ... then copied into the output ring, in one piece with
+    // respect to other senders.
+    // The pump sends too (acks, mostly). It must never wait for
+    // another sender, which in turn waits for the pump to make room.
+    bool pump = pthread_equal(pthread_self(), datapump);
+    if (pump) {
+	while (pthread_mutex_trylock(&sendMutex) != 0)
+	    if (!drainOut())
+		return;
+    } else
+	pthread_mutex_lock(&sendMutex);
+    while (flen > 0) {
+	pthread_mutex_lock(&outMutex);
+	int space = (outRead - outWrite - 1) & BUFMASK;
+	int w = outWrite;
+	pthread_mutex_unlock(&outMutex);
+	if (space == 0) {
+	    if (!(pump ? drainOut() : waitForSpace()))
 		break;
-	    case 0x10:
-		opByte(0x10);
-		// fall thru
-	    default:
-		opCByte(c, &crcOut);
+	    continue;
 	}
+	int count = BUFLEN - w;
+	if (count > space)
+	    count = space;
+	if (count > flen)
+	    count = flen;
+	memcpy(&outBuffer[w], o, count);
+	pthread_mutex_lock(&outMutex);
+	inca(outWrite, count);
+	pthread_mutex_unlock(&outMutex);
+	o += count;
+	flen -= count;
     }
-    opByte(0x10);
-    opByte(0x03);
-    opByte(crcOut >> 8);
-    opByte(crcOut & 0xff);
-    realWrite();
+    pthread_mutex_unlock(&sendMutex);
+    wakePump();
 }
 
 void packet::
-opByte(unsigned char a)
+wakePump()
 {
-    if (!hasSpace(out))
-	realWrite();
-    outBuffer[outWrite] = a;
-    inc1(outWrite);
+#ifdef HAVE_SYS_EVENTFD_H
+    eventfd_write(wakeFd[1], 1);
+#else
+    char c = 0;
+    write(wakeFd[1], &c, 1);
+#endif
 }
 
 void packet::
-opCByte(unsigned char a, unsigned short *crc)
+drainWakeup()
+{
+#ifdef HAVE_SYS_EVENTFD_H
+    eventfd_t v;
+    eventfd_read(wakeFd[0], &v);
+#else
+    char buf[64];
+    while (read(wakeFd[0], buf, sizeof(buf)) > 0)
+	;
+#endif
+}
+
+bool packet::
+trySend(const linkFrame &f)
 {
-    addToCrc(a, crc);
-    if (!hasSpace(out))
-	realWrite();
-    outBuffer[outWrite] = a;
-    inc1(outWrite);
+    bufferStore stage;
+    long flen = assemble(f, stage);
+    const unsigned char *o = (const unsigned char *)stage.getString(0);
+
+    if (pthread_mutex_trylock(&sendMutex) != 0)
+	return false;
+    pthread_mutex_lock(&outMutex);
+    int space = (outRead - outWrite - 1) & BUFMASK;
+    int w = outWrite;
+    pthread_mutex_unlock(&outMutex);
+    if (space < flen) {
+	pthread_mutex_unlock(&sendMutex);
+	return false;
+    }
+    int count = BUFLEN - w;
+    if (count > flen)
+	count = flen;
+    memcpy(&outBuffer[w], o, count);
+    memcpy(outBuffer, o + count, flen - count);
+    pthread_mutex_lock(&outMutex);
+    inca(outWrite, flen);
+    pthread_mutex_unlock(&outMutex);
+    pthread_mutex_unlock(&sendMutex);
+    wakePump();
+    return true;
 }
 
+/**
+ * Writes, what the device takes, from the output ring and wakes up
+ * senders, which wait for space. Only called by the pump.
+ */
 void packet::
-realWrite()
+writeOut()
 {
-    pthread_kill(datapump, SIGUSR1);
+    pthread_mutex_lock(&outMutex);
+    int r = outRead;
+    int count = outWrite - outRead;
+    if (count < 0)
+	count = (BUFLEN - outRead);
+    pthread_mutex_unlock(&outMutex);
+    if (count == 0)
+	return;
+    int res = write(fd, &outBuffer[r], count);
+    if (res > 0) {
+	if (pumpverbose & PKT_DEBUG_DUMP) {
+	    int i;
+	    printf("pump: wrote %d bytes: (", res);
+	    for (i = 0; i<res; i++)
+		printf("%02x ", outBuffer[r + i]);
+	    printf(")\n");
+	}
+	pthread_mutex_lock(&outMutex);
+	inca(outRead, res);
+	pthread_cond_broadcast(&outCond);
+	pthread_mutex_unlock(&outMutex);
+    }
+}
+
+/**
+ * Marks the device as unusable and releases senders,
+ * which wait for space.
+ */
+void packet::
+setFatal()
+{
+    pthread_mutex_lock(&outMutex);
+    lastFatal = true;
+    pthread_cond_broadcast(&outCond);
+    pthread_mutex_unlock(&outMutex);
+}
+
+/**
+ * Makes progress on the output ring, while the pump itself sends.
+ * Nobody else empties the ring, so the pump writes to the device
+ * directly, instead of waiting.
+ *
+ * @returns false, if the pump is stopped or the device is unusable.
+ */
+bool packet::
+drainOut()
+{
+    if (stopPump || (fd == -1) || lastFatal)
+	return false;
+    if (!hasData(out)) {
+	// Another sender is about to fill it.
+	sched_yield();
+	return true;
+    }
+    struct pollfd pfd[2];
+    pfd[0].fd = wakeFd[0];
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+    pfd[1].fd = fd;
+    pfd[1].events = POLLOUT;
+    pfd[1].revents = 0;
+    if (poll(pfd, 2, -1) <= 0)
+	return true;
+    if (pfd[0].revents & POLLIN)
+	drainWakeup();
+    if ((pfd[1].revents & (POLLERR | POLLHUP | POLLNVAL)) &&
+	!(pfd[1].revents & POLLOUT)) {
+	setFatal();
+	return false;
+    }
+    if (pfd[1].revents & POLLOUT)
+	writeOut();
+    return true;
+}
+
+/**
+ * Waits, until the pump has made room in the output ring.
+ * Must not be called by the pump.
+ *
+ * @returns false, if the pump is stopped or the device is unusable.
+ */
+bool packet::
+waitForSpace()
+{
+    bool ok = true;
+
+    wakePump();
+    pthread_mutex_lock(&outMutex);
     while (!hasSpace(out)) {
-	sigset_t sigs;
-	int dummy;
-	sigemptyset(&sigs);
-	sigaddset(&sigs, SIGUSR1);
-	sigwait(&sigs, &dummy);
+	if (stopPump || (fd == -1) || lastFatal) {
+	    ok = false;
+	    break;
+	}
+	pthread_cond_wait(&outCond, &outMutex);
     }
+    pthread_mutex_unlock(&outMutex);
+    return ok;
 }
 
 void packet::
@@ -370,21 +638,36 @@ findSync()
     p = (lastSYN >= 0) ? lastSYN : inRead;
     if (startPkt < 0) {
 	while (p != inw) {
-	    normalize(p);
-	    if (inBuffer[p++] != 0x16)
+	    // Search the contiguous part of the ring for a SYN
+	    int end = (inw > p) ? inw : BUFLEN;
+	    unsigned char *s = (unsigned char *)memchr(&inBuffer[p], 0x16, end - p);
+	    if (!s) {
+		p = end & BUFMASK;
+		lastSYN = p;
+		// Drop garbage, unless it is needed for baudrate detection.
+		if (!justStarted)
+		    inRead = p;
 		continue;
-	    lastSYN = p - 1;
-	    normalize(p);
-	    if (p == inw)
+	    }
+	    p = s - inBuffer;
+	    lastSYN = p;
+	    if (!justStarted)
+		inRead = p;
+	    int p1 = (p + 1) & BUFMASK;
+	    if (p1 == inw)
 		break;
-	    if (inBuffer[p++] != 0x10)
+	    if (inBuffer[p1] != 0x10) {
+		p = p1;
 		continue;
-	    normalize(p);
-	    if (p == inw)
+	    }
+	    int p2 = (p1 + 1) & BUFMASK;
+	    if (p2 == inw)
 		break;
-	    if (inBuffer[p++] != 0x02)
+	    if (inBuffer[p2] != 0x02) {
+		p = p1;
 		continue;
-	    normalize(p);
+	    }
+	    p = (p2 + 1) & BUFMASK;
 	    lastSYN = startPkt = p;
 	    crcIn = inCRCstate = 0;
 	    rcv.init();
@@ -395,6 +678,19 @@ findSync()
     if (startPkt >= 0) {
 	justStarted = false;
 	while (p != inw) {
+	    if ((inCRCstate == 0) && !esc) {
+		// Take everything up to the next DLE in one go.
+		int end = (inw > p) ? inw : BUFLEN;
+		unsigned char *s = &inBuffer[p];
+		unsigned char *d = (unsigned char *)memchr(s, 0x10, end - p);
+		int n = (d ? d : &inBuffer[end]) - s;
+		if (n > 0) {
+		    crcIn = crcBlock(s, n, crcIn);
+		    rcv.addBytes(s, n);
+		    inca(p, n);
+		    continue;
+		}
+	    }
 	    unsigned char c = inBuffer[p];
 	    switch (inCRCstate) {
 		case 0:
@@ -413,14 +709,8 @@ findSync()
 				rcv.addByte(c);
 				break;
 			}
-		    } else {
-			if (c == 0x10)
-			    esc = true;
-			else {
-			    addToCrc(c, &crcIn);
-			    rcv.addByte(c);
-			}
-		    }
+		    } else
+			esc = true;
 		    break;
 		case 1:
 		    receivedCRC = c;
@@ -473,15 +763,20 @@ findSync()
 bool packet::
 linkFailed()
 {
-    int arg;
+    int arg = 0;
     int res;
     bool failed = false;
 
     if (fd == -1)
 	return false;
     res = ioctl(fd, TIOCMGET, &arg);
-    if (res < 0)
+    if (res < 0) {
+	// A device without modem lines, e.g. the pseudo terminal
+	// of plpsim, is always connected.
+	if ((errno == ENOTTY) || (errno == EINVAL))
+	    return lastFatal;
 	lastFatal = true;
+    }
     if ((serialStatus == -1) || (arg != serialStatus)) {
 	if (verbose & PKT_DEBUG_HANDSHAKE)
 	    lout << "packet: < DTR:" << ((arg & TIOCM_DTR)?1:0)
@@ -32,6 +32,7 @@
 
 #include "bufferstore.h"
 #include "bufferarray.h"
+#include "linkframe.h"
 
 #define PKT_DEBUG_LOG       16
 #define PKT_DEBUG_DUMP      32
@@ -50,9 +51,15 @@ public:
     ~packet();
 
     /**
-     * Send a buffer out to serial line
+     * Send a frame out to serial line
      */
-    void send(bufferStore &b);
+    void send(const linkFrame &f);
+
+    /**
+     * Like send(), but returns false instead of waiting, if the frame
+     * does not fit into the output ring right now.
+     */
+    bool trySend(const linkFrame &f);
 
     void setEpoc(bool);
     void setVerbose(short int);
@@ -65,21 +72,40 @@ private:
     friend void * pump_run(void *);
 
     inline void addToCrc(unsigned char a, unsigned short *crc) {
-	*crc =  (*crc << 8) ^ crc_table[((*crc >> 8) ^ a) & 0xff];
+	*crc =  (*crc << 8) ^ crc_table[0][((*crc >> 8) ^ a) & 0xff];
     }
 
+    unsigned short crcBlock(const unsigned char *p, long len, unsigned short crc);
+    long encode(const unsigned char *p, long len, unsigned char *out);
+    long assemble(const linkFrame &f, bufferStore &stage);
     void findSync();
-    void opByte(unsigned char a);
-    void opCByte(unsigned char a, unsigned short *crc);
-    void realWrite();
+    void wakePump();
+    void drainWakeup();
+    bool waitForSpace();
+    bool drainOut();
+    void writeOut();
+    void setFatal();
+    void stopPumpThread();
     void internalReset();
 
     Link *theLINK;
     pthread_t datapump;
-    pthread_t thisThread;
-    unsigned int   crc_table[256];
+    /**
+     * Held by a sender, while it copies a frame into the output ring.
+     * outMutex protects outRead and outWrite.
+     */
+    pthread_mutex_t sendMutex;
+    pthread_mutex_t outMutex;
+    pthread_cond_t outCond;
+    int wakeFd[2];
+    bool stopPump;
+    /**
+     * CRC tables for slicing-by-4. crc_table[0] is the classic
+     * byte-wise table, crc_table[k] advances its entry by k
+     * additional zero bytes.
+     */
+    unsigned short crc_table[4][256];
 
-    unsigned short crcOut;
     unsigned short crcIn;
     unsigned short receivedCRC;
     unsigned short inCRCstate;
@@ -35,6 +35,7 @@
 
 #include "socketchan.h"
 #include "ncp.h"
+#include "link.h"
 #include "main.h"
 
 using namespace std;
@@ -123,6 +124,29 @@ ncpCommand(bufferStore & a)
 	a.addDWord(ncpGetSpeed());
 	skt->sendBufferStore(a);
 	ok = true;
+    } else if (!strncmp(str, "LSTA", 4)) {
+	// Get link statistics (round trip time, retransmissions,
+	// NCP throughput, buffer allocations, queue depth, frame size
+	// and acks). The reply carries the number of fields, followed
+	// by the fields as qwords. New fields are only ever appended,
+	// so clients can skip those they don't know about.
+	linkStats stats;
+	ncpGetLinkStats(stats);
+	u_int64_t f[] = {
+	    stats.srtt, stats.rttvar, stats.rto, stats.txFrames,
+	    stats.retransmits, stats.txBytes, stats.rxBytes,
+	    stats.allocations, stats.queuedBytes, stats.maxQueuedBytes,
+	    stats.throttles, stats.maxFrame, stats.probes,
+	    stats.probesFailed, stats.rxFrames, stats.acks
+	};
+	int n = sizeof(f) / sizeof(f[0]);
+	a.init();
+	a.addByte(rfsv::E_PSI_GEN_NONE);
+	a.addWord(n);
+	for (int i = 0; i < n; i++)
+	    a.addQWord(f[i]);
+	skt->sendBufferStore(a);
+	ok = true;
     } else if (!strncmp(str, "REGS", 4)) {
 	// Register a server-process on the PC side.
 	a.init();
@@ -154,6 +178,8 @@ ncpConnectAck()
     skt->sendBufferStore(a);
     connected = true;
     connectTry = 3;
+    // Have the main loop watch the socket again.
+    wakeupMainLoop();
 }
 
 void socketChan::
@@ -276,6 +302,18 @@ const {
     return connected;
 }
 
+bool socketChan::
+isConnecting()
+const {
+    return (registerName != 0) && !connected;
+}
+
+int socketChan::
+getSocket()
+const {
+    return skt->getSocket();
+}
+
 /*
  * Local variables:
  * c-basic-offset: 4
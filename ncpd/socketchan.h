@@ -44,6 +44,8 @@ public:
   void ncpConnectNak();
 
   bool isConnected() const;
+  bool isConnecting() const;
+  int getSocket() const;
   void socketPoll();
 private:
   enum protocolVersionType { PV_SERIES_5 = 6, PV_SERIES_3 = 3 };
@@ -28,6 +28,7 @@
 #endif
 
 #include <rfsv.h>
+#include <rfsvfactory.h>
 #include <rpcs.h>
 #include <rclip.h>
 #include <plpintl.h>
@@ -40,18 +41,25 @@
 #include <fstream>
 #include <string>
 #include <iomanip>
+#include <map>
+#include <deque>
+#include <vector>
 
 #include <sys/types.h>
 #include <dirent.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <signal.h>
 #include <netdb.h>
+#include <utime.h>
+#include <pthread.h>
 
 #include "ftp.h"
 
@@ -83,6 +91,15 @@ resetUnixPwd()
 ftp::ftp()
 {
     resetUnixPwd();
+    serverHost = "127.0.0.1";
+    serverPort = DPORT;
+}
+
+void ftp::
+setServer(const char *host, int port)
+{
+    serverHost = host;
+    serverPort = port;
 }
 
 ftp::~ftp()
@@ -108,6 +125,8 @@ void ftp::usage() {
     cout << "  put <unixfile>" << endl;
     cout << "  mget <shellpattern>" << endl;
     cout << "  mput <shellpattern>" << endl;
+    cout << "  dput <unixfile> [<psionfile>]" << endl;
+    cout << "  sync [-j <sessions>] <psiondir> [<unixdir>]" << endl;
     cout << "  cp <psionfile> <psionfile>" << endl;
     cout << "  del|rm <psionfile>" << endl;
     cout << "  mkdir <psiondir>" << endl;
@@ -115,6 +134,8 @@ void ftp::usage() {
     cout << "  volname <drive> <name>" << endl;
     cout << "  prompt" << endl;
     cout << "  hash" << endl;
+    cout << "  window [<requests>]" << endl;
+    cout << "  linkstats" << endl;
     cout << "  bye" << endl;
     cout << endl << _("Known RPC commands:") << endl << endl;
     cout << "  ps" << endl;
@@ -198,6 +219,13 @@ checkAbortHash(void *, u_int32_t)
     return continueRunning;
 }
 
+static int
+printDirent(void *, PlpDirent &e)
+{
+    cout << e << endl;
+    return 1;
+}
+
 static RETSIGTYPE
 sigint_handler(int i) {
     continueRunning = 0;
@@ -644,6 +672,375 @@ ftp::getClipData(rpcs & r, rfsv & a, rclip & rc, ppsocket & rclipSocket, const c
     return 0;
 }
 
+/* Name of the manifest, kept in the local directory of a sync */
+#define SYNC_MANIFEST ".plpftp-sync"
+
+/* Maximum number of parallel transfers of a sync */
+#define SYNC_MAX_SESSIONS 8
+
+/* Size and modification time of a Psion file, when it was last synced,
+   and modification time of the local copy at that time */
+typedef struct {
+    u_int32_t size;
+    time_t mtime;
+    time_t local;
+} syncStamp;
+
+typedef map<string, syncStamp> syncManifest;
+
+/* A file to be copied, with its path relative to the synced directories */
+typedef struct {
+    string name;
+    syncStamp stamp;
+} syncJob;
+
+/* State of a sync, shared by the transfer threads */
+static struct {
+    pthread_mutex_t lock;
+    string psionBase;
+    string unixBase;
+    deque<syncJob> jobs;
+    syncManifest old;		// Manifest of the previous sync
+    syncManifest done;		// Manifest of this sync
+    long copied;
+    long failed;
+    long skipped;
+    unsigned long long copiedBytes;
+    unsigned long long skippedBytes;
+} syncState;
+
+/* Directory being scanned */
+typedef struct {
+    string name;
+    vector<string> subdirs;
+} syncDir;
+
+static void
+syncLoadManifest(const string &file, syncManifest &m)
+{
+    ifstream in(file.c_str());
+    string line;
+
+    m.clear();
+    while (getline(in, line)) {
+	unsigned long size;
+	long mtime, local;
+	int n = 0;
+
+	if (sscanf(line.c_str(), "%lu %ld %ld %n", &size, &mtime, &local, &n) >= 3 && n > 0) {
+	    syncStamp &s = m[line.substr(n)];
+	    s.size = size;
+	    s.mtime = mtime;
+	    s.local = local;
+	}
+    }
+}
+
+static bool
+syncSaveManifest(const string &file, syncManifest &m)
+{
+    string tmp = file + ".tmp";
+    ofstream out(tmp.c_str());
+
+    for (syncManifest::iterator i = m.begin(); i != m.end(); i++)
+	out << (unsigned long)i->second.size << " "
+	    << (long)i->second.mtime << " "
+	    << (long)i->second.local << " " << i->first << "\n";
+    out.close();
+    if (!out || rename(tmp.c_str(), file.c_str())) {
+	unlink(tmp.c_str());
+	return false;
+    }
+    return true;
+}
+
+/* A file needs no transfer, if neither the Psion file nor the local
+   copy have changed since the last sync. The manifest keeps the local
+   modification time as it was after the copy, so files on local file
+   systems, which can't represent the Psion's time stamps exactly, are
+   still recognized. Without a manifest entry, e.g. on the first sync,
+   size and modification time of the local file are compared with the
+   Psion file. Records the local modification time in stamp. */
+static bool
+syncUnchanged(const string &name, syncStamp &stamp)
+{
+    string local = syncState.unixBase + name;
+    struct stat sb;
+
+    if (stat(local.c_str(), &sb) || !S_ISREG(sb.st_mode) ||
+	sb.st_size != (off_t)stamp.size)
+	return false;
+    stamp.local = sb.st_mtime;
+    syncManifest::iterator i = syncState.old.find(name);
+    if (i != syncState.old.end())
+	return (i->second.size == stamp.size) &&
+	    (i->second.mtime == stamp.mtime) && (i->second.local == stamp.local);
+    return stamp.local == stamp.mtime;
+}
+
+static int
+syncScanEntry(void *ptr, PlpDirent &e)
+{
+    syncDir *d = (syncDir *)ptr;
+    string name = d->name + e.getName();
+    long attr = e.getAttr();
+
+    if (attr & rfsv::PSI_A_VOLUME)
+	return continueRunning;
+    if (attr & rfsv::PSI_A_DIR) {
+	d->subdirs.push_back(name + "/");
+	return continueRunning;
+    }
+
+    syncJob j;
+    j.name = name;
+    j.stamp.size = e.getSize();
+    j.stamp.mtime = e.getPsiTime().getTime();
+    j.stamp.local = 0;
+    if (syncUnchanged(name, j.stamp)) {
+	syncState.done[name] = j.stamp;
+	syncState.skipped++;
+	syncState.skippedBytes += j.stamp.size;
+    } else
+	syncState.jobs.push_back(j);
+    return continueRunning;
+}
+
+/* Walk a Psion directory tree, creating local directories on the way.
+   Directories, which can't be read or created, are reported and
+   skipped, the rest of the tree is still synced. */
+static Enum<rfsv::errs>
+syncScan(rfsv &a, const string &name)
+{
+    syncDir d;
+    string psion = syncState.psionBase + name;
+    string local = syncState.unixBase + name;
+    Enum<rfsv::errs> res;
+    struct stat sb;
+
+    if (mkdir(local.c_str(), 0777) &&
+	(stat(local.c_str(), &sb) || !S_ISDIR(sb.st_mode))) {
+	syncState.failed++;
+	cerr << _("Error: ") << local << ": " << strerror(errno) << endl;
+	return rfsv::E_PSI_GEN_NONE;
+    }
+    for (string::iterator i = psion.begin(); i != psion.end(); i++)
+	if (*i == '/')
+	    *i = '\\';
+    d.name = name;
+    if ((res = a.dir(psion.c_str(), syncScanEntry, &d)) != rfsv::E_PSI_GEN_NONE) {
+	if (!continueRunning)
+	    return rfsv::E_PSI_FILE_CANCEL;
+	syncState.failed++;
+	cerr << _("Error: ") << psion << ": " << res << endl;
+    }
+    for (unsigned int i = 0; i < d.subdirs.size() && continueRunning; i++)
+	syncScan(a, d.subdirs[i]);
+    return continueRunning ? rfsv::E_PSI_GEN_NONE : rfsv::E_PSI_FILE_CANCEL;
+}
+
+/* Copies queued files, one thread per rfsv session */
+static void *
+syncWorker(void *arg)
+{
+    rfsv *a = (rfsv *)arg;
+
+    while (1) {
+	pthread_mutex_lock(&syncState.lock);
+	if (syncState.jobs.empty() || !continueRunning) {
+	    pthread_mutex_unlock(&syncState.lock);
+	    break;
+	}
+	syncJob j = syncState.jobs.front();
+	syncState.jobs.pop_front();
+	pthread_mutex_unlock(&syncState.lock);
+
+	string from = syncState.psionBase + j.name;
+	string to = syncState.unixBase + j.name;
+	for (string::iterator i = from.begin(); i != from.end(); i++)
+	    if (*i == '/')
+		*i = '\\';
+	Enum<rfsv::errs> res = a->copyFromPsion(from.c_str(), to.c_str(), NULL, checkAbortNoHash);
+
+	pthread_mutex_lock(&syncState.lock);
+	if (res == rfsv::E_PSI_GEN_NONE) {
+	    struct utimbuf ut;
+	    struct stat sb;
+
+	    ut.actime = ut.modtime = j.stamp.mtime;
+	    utime(to.c_str(), &ut);
+	    j.stamp.local = stat(to.c_str(), &sb) ? 0 : sb.st_mtime;
+	    syncState.done[j.name] = j.stamp;
+	    syncState.copied++;
+	    syncState.copiedBytes += j.stamp.size;
+	    cout << _("Got \"") << j.name << "\"" << endl;
+	} else {
+	    syncState.failed++;
+	    cerr << _("Error: ") << from << ": " << res << endl;
+	}
+	pthread_mutex_unlock(&syncState.lock);
+    }
+    return NULL;
+}
+
+void ftp::
+syncTree(rfsv &a, const char *psionPath, const char *unixPath, int sessions)
+{
+    struct timeval stime;
+    struct timeval etime;
+    vector<ppsocket *> skts;
+    vector<rfsv *> rfsvs;
+    vector<pthread_t> threads;
+    string manifest;
+    Enum<rfsv::errs> res;
+
+    gettimeofday(&stime, 0L);
+    syncState.psionBase = psionPath;
+    syncState.unixBase = unixPath;
+    if (syncState.unixBase.empty() || syncState.unixBase[syncState.unixBase.size() - 1] != '/')
+	syncState.unixBase += '/';
+    manifest = syncState.unixBase + SYNC_MANIFEST;
+    syncState.jobs.clear();
+    syncState.done.clear();
+    syncState.copied = syncState.failed = syncState.skipped = 0;
+    syncState.copiedBytes = syncState.skippedBytes = 0;
+    syncLoadManifest(manifest, syncState.old);
+
+    if ((res = syncScan(a, "")) != rfsv::E_PSI_GEN_NONE) {
+	continueRunning = 1;
+	cerr << _("Error: ") << res << endl;
+	return;
+    }
+    cout << syncState.jobs.size() << _(" file(s) to transfer, ")
+	 << syncState.skipped << _(" unchanged") << endl;
+
+    // Additional sessions, each on a connection of its own
+    rfsvs.push_back(&a);
+    while ((int)rfsvs.size() < sessions && rfsvs.size() < syncState.jobs.size()) {
+	ppsocket *skt = new ppsocket();
+	rfsv *r = NULL;
+
+	if (skt->connect(serverHost, serverPort)) {
+	    rfsvfactory rf(skt);
+	    r = rf.create(false);
+	}
+	if (!r) {
+	    delete skt;
+	    break;
+	}
+	r->setWindow(a.getWindow());
+	skts.push_back(skt);
+	rfsvs.push_back(r);
+    }
+
+    pthread_mutex_init(&syncState.lock, NULL);
+    for (unsigned int i = 1; i < rfsvs.size(); i++) {
+	pthread_t t;
+	if (pthread_create(&t, NULL, syncWorker, rfsvs[i]) == 0)
+	    threads.push_back(t);
+    }
+    syncWorker(&a);
+    for (unsigned int i = 0; i < threads.size(); i++)
+	pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&syncState.lock);
+    for (unsigned int i = 1; i < rfsvs.size(); i++)
+	delete rfsvs[i];
+    for (unsigned int i = 0; i < skts.size(); i++)
+	delete skts[i];
+
+    if (!syncSaveManifest(manifest, syncState.done))
+	cerr << _("Could not write ") << manifest << endl;
+    continueRunning = 1;
+
+    gettimeofday(&etime, 0L);
+    long dsec = etime.tv_sec - stime.tv_sec;
+    long dhse = (etime.tv_usec / 10000) - (stime.tv_usec / 10000);
+    if (dhse < 0) {
+	dsec--;
+	dhse = 100 + dhse;
+    }
+    cout << _("Sync complete, ") << syncState.copied << _(" file(s), ")
+	 << syncState.copiedBytes << _(" bytes in ") << dsec << "."
+	 << setw(2) << setfill('0') << dhse << setfill(' ')
+	 << _(" secs using ") << rfsvs.size() << _(" session(s)") << endl;
+    cout << syncState.skipped << _(" unchanged file(s), ")
+	 << syncState.skippedBytes << _(" bytes not transferred");
+    if (syncState.failed)
+	cout << ", " << syncState.failed << _(" failed");
+    cout << endl;
+}
+
+/* Directory in $HOME, holding a copy of each file sent by dput */
+#define DELTA_CACHE ".plpftp-delta"
+
+static bool
+deltaCopyLocal(const string &from, const string &to)
+{
+    string tmp = to + ".tmp";
+    ifstream in(from.c_str());
+    ofstream out(tmp.c_str());
+
+    if (in && out)
+	out << in.rdbuf();
+    out.close();
+    if (!in || !out || rename(tmp.c_str(), to.c_str())) {
+	unlink(tmp.c_str());
+	return false;
+    }
+    return true;
+}
+
+/* Send only the changed parts of a file, which has been sent with dput
+   before. The copy kept from that transfer is only used, if size and
+   modification time of the file on the Psion are still the same as
+   right after it. Otherwise, the whole file is sent. */
+Enum<rfsv::errs> ftp::
+deltaPut(rfsv &a, const char *from, const char *to, u_int32_t &sent, cpCallback_t cb)
+{
+    string cache;
+    string base;
+    string stampFile;
+    PlpDirent e;
+    Enum<rfsv::errs> res;
+    bool haveBase = false;
+    const char *home = getenv("HOME");
+
+    cache = string(home ? home : localDir) + "/" + DELTA_CACHE;
+    mkdir(cache.c_str(), 0700);
+    base = cache + "/";
+    for (const char *p = to; *p; p++)
+	base += (*p == ':' || *p == '/' || *p == '\\') ? '_' : tolower(*p);
+    stampFile = base + ".stamp";
+
+    if (a.fgeteattr(to, e) == rfsv::E_PSI_GEN_NONE) {
+	ifstream in(stampFile.c_str());
+	unsigned long size;
+	long mtime;
+
+	if ((in >> size >> mtime) && (size == e.getSize()) &&
+	    (mtime == (long)e.getPsiTime().getTime()))
+	    haveBase = true;
+    }
+    if (haveBase)
+	res = a.copyToPsionDelta(from, base.c_str(), to, sent, NULL, cb);
+    else {
+	struct stat stbuf;
+
+	res = a.copyToPsion(from, to, NULL, cb);
+	sent = (stat(from, &stbuf) == 0) ? stbuf.st_size : 0;
+    }
+
+    // Remember what the Psion has now for the next time
+    unlink(stampFile.c_str());
+    if ((res == rfsv::E_PSI_GEN_NONE) && deltaCopyLocal(from, base) &&
+	(a.fgeteattr(to, e) == rfsv::E_PSI_GEN_NONE)) {
+	ofstream out(stampFile.c_str());
+	out << (unsigned long)e.getSize() << " "
+	    << (long)e.getPsiTime().getTime() << "\n";
+    }
+    return res;
+}
+
 int ftp::
 session(rfsv & a, rpcs & r, rclip & rc, ppsocket & rclipSocket, int xargc, char **xargv)
 {
@@ -730,6 +1127,48 @@ session(rfsv & a, rpcs & r, rclip & rc, ppsocket & rclipSocket, int xargc, char
 	    cab = (hash) ? checkAbortHash : checkAbortNoHash;
 	    continue;
 	}
+	if (!strcmp(argv[0], "window") && (argc < 3)) {
+	    if (argc == 2) {
+		int n = atoi(argv[1]);
+		if ((n < 1) || (n > RFSV_MAXWINDOW)) {
+		    cerr << _("Invalid window size, must be 1 .. ")
+			 << RFSV_MAXWINDOW << endl;
+		    continue;
+		}
+		a.setWindow(n);
+	    }
+	    cout << _("Transfer window is ") << a.getWindow()
+		 << _(" request(s)") << endl;
+	    continue;
+	}
+	if (!strcmp(argv[0], "linkstats") && (argc == 1)) {
+	    static const char *names[] = {
+		N_("Smoothed RTT (ms)"), N_("RTT variation (ms)"),
+		N_("Retransmit timeout (ms)"), N_("Frames sent"),
+		N_("Retransmissions"), N_("Bytes sent"),
+		N_("Bytes received"), N_("Buffer allocations"),
+		N_("Bytes queued"), N_("Max. bytes queued"),
+		N_("Throttles"), N_("Max. frame size"),
+		N_("Frame size probes"), N_("Failed probes"),
+		N_("Frames received"), N_("Acks sent")
+	    };
+	    const unsigned int nnames = sizeof(names) / sizeof(names[0]);
+	    vector<u_int64_t> stats;
+
+	    if (!a.getLinkStats(stats)) {
+		cerr << _("Link statistics not available") << endl;
+		continue;
+	    }
+	    for (unsigned int i = 0; i < stats.size(); i++) {
+		cout << setiosflags(ios::left);
+		if (i < nnames)
+		    cout << setw(24) << _(names[i]);
+		else
+		    cout << _("Field ") << setw(18) << i;
+		cout << resetiosflags(ios::left) << stats[i] << endl;
+	    }
+	    continue;
+	}
 	if (!strcmp(argv[0], "pwd")) {
 	    cout << _("Local dir: \"") << localDir << "\"" << endl;
 	    cout << _("Psion dir: \"") << psionDir << "\"" << endl;
@@ -882,7 +1321,6 @@ session(rfsv & a, rpcs & r, rclip & rc, ppsocket & rclipSocket, int xargc, char
 	    continue;
 	}
 	if (!strcmp(argv[0], "ls") || !strcmp(argv[0], "dir")) {
-	    PlpDir files;
 	    char dtmp[1024];
 	    char *dname = psionDir;
 
@@ -919,13 +1357,9 @@ session(rfsv & a, rpcs & r, rclip & rc, ppsocket & rclipSocket, int xargc, char
 		dname = dtmp;
 	    }
 
-	    if ((res = a.dir(dname, files)) != rfsv::E_PSI_GEN_NONE)
+	    // Entries are printed as they arrive
+	    if ((res = a.dir(dname, printDirent, NULL)) != rfsv::E_PSI_GEN_NONE)
 		cerr << _("Error: ") << res << endl;
-	    else
-		while (!files.empty()) {
-		    cout << files[0] << endl;
-		    files.pop_front();
-		}
 	    continue;
 	}
 	if (!strcmp(argv[0], "lcd")) {
@@ -1074,6 +1508,68 @@ session(rfsv & a, rpcs & r, rclip & rc, ppsocket & rclipSocket, int xargc, char
 	    }
 	    continue;
 	}
+	if (!strcmp(argv[0], "sync") && (argc >= 2) && (argc <= 5)) {
+	    int sessions = 4;
+	    int i = 1;
+
+	    if (!strcmp(argv[1], "-j") && (argc >= 3)) {
+		sessions = atoi(argv[2]);
+		i = 3;
+	    }
+	    if ((sessions < 1) || (sessions > SYNC_MAX_SESSIONS) ||
+		(argc - i < 1) || (argc - i > 2)) {
+		cerr << _("Usage: sync [-j <sessions>] <psiondir> [<unixdir>]") << endl
+		     << _("At most ") << SYNC_MAX_SESSIONS << _(" sessions") << endl;
+		continue;
+	    }
+	    cd(psionDir, argv[i], f1);
+	    strcpy(f2, localDir);
+	    if (argc - i == 2) {
+		if (argv[i + 1][0] == '/')
+		    strcpy(f2, argv[i + 1]);
+		else
+		    strcat(f2, argv[i + 1]);
+	    }
+	    syncTree(a, f1, f2, sessions);
+	    continue;
+	}
+	if (!strcmp(argv[0], "dput") && (argc >= 2) && (argc <= 3)) {
+	    struct timeval stime;
+	    struct timeval etime;
+	    struct stat stbuf;
+	    u_int32_t sent;
+
+	    strcpy(f1, localDir);
+	    strcat(f1, argv[1]);
+	    strcpy(f2, psionDir);
+	    if (argc == 2)
+		strcat(f2, argv[1]);
+	    else
+		strcat(f2, argv[2]);
+	    gettimeofday(&stime, 0L);
+	    res = deltaPut(a, f1, f2, sent, cab);
+	    if (hash)
+		cout << endl;
+	    if (res != rfsv::E_PSI_GEN_NONE) {
+		continueRunning = 1;
+		cerr << _("Error: ") << res << endl;
+	    } else {
+		gettimeofday(&etime, 0L);
+		long dsec = etime.tv_sec - stime.tv_sec;
+		long dhse = (etime.tv_usec / 10000) -
+		    (stime.tv_usec /10000);
+		if (dhse < 0) {
+		    dsec--;
+		    dhse = 100 + dhse;
+		}
+		stat(f1, &stbuf);
+		cout << _("Transfer complete, (") << dec << sent
+		     << _(" of ") << stbuf.st_size
+		     << _(" bytes sent in ") << dsec << "."
+		     << dhse << _(" secs)\n");
+	    }
+	    continue;
+	}
 	if (!strcmp(argv[0], "put") && (argc >= 2)) {
 	    struct timeval stime;
 	    struct timeval etime;
@@ -1433,8 +1929,9 @@ session(rfsv & a, rpcs & r, rclip & rc, ppsocket & rclipSocket, int xargc, char
 static const char *all_commands[] = {
     "pwd", "ren", "touch", "gtime", "test", "gattr", "sattr", "devs",
     "dir", "ls", "dircnt", "cd", "lcd", "get", "put", "mget", "mput",
+    "dput", "sync",
     "del", "rm", "mkdir", "rmdir", "prompt", "bye", "cp", "volname",
-    "ps", "kill", "killsave", "runrestore", "run", "machinfo",
+    "window", "linkstats", "ps", "kill", "killsave", "runrestore", "run", "machinfo",
     "ownerinfo", "help", "settime", "setupinfo", NULL
 };
 
@@ -39,6 +39,7 @@ class ftp {
 	ftp();
 	~ftp();
         int session(rfsv & a, rpcs & r, rclip & rc, ppsocket & rclipSocket, int xargc, char **xargv);
+	void setServer(const char *host, int port);
         bool canClip;
 
 	private:
@@ -54,6 +55,8 @@ class ftp {
 	void resetUnixPwd();
 	void usage();
 	void cd(const char *source, const char *cdto, char *dest);
+	void syncTree(rfsv &a, const char *psionPath, const char *unixPath, int sessions);
+	Enum<rfsv::errs> deltaPut(rfsv &a, const char *from, const char *to, u_int32_t &sent, cpCallback_t cb);
 
 	// MJG: note, this isn't actually used anywhere
 	int convertName(const char *orig, char *retVal);
@@ -64,6 +67,8 @@ class ftp {
 #endif
 	char defDrive[9];
 	char localDir[1024];
+	const char *serverHost;
+	int serverPort;
 };
 
 #endif
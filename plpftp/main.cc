@@ -191,6 +191,7 @@ main(int argc, char **argv)
     if (rclipSocket)
         rc = new rclip(rclipSocket);
     f.canClip = rclipSocket && rc ? true : false;
+    f.setServer(host, sockNum);
     if ((a != NULL) && (r != NULL)) {
 	status = f.session(*a, *r, *rc, *rclipSocket, argc - optind, &argv[optind]);
 	delete r;
@@ -15,9 +15,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include <syslog.h>
 #ifdef HAVE_ATTR_XATTR_H
@@ -36,6 +41,9 @@
 /* Maximum length of a generated psion xattr string */
 #define XATTR_MAXLEN 3
 
+/* Inode number for directory entries, which have not been looked up yet */
+#define UNKNOWN_INO 0xffffffff
+
 #ifndef ENOMEDIUM
 #define ENOMEDIUM ENODEV
 #endif
@@ -114,9 +122,9 @@ pattr2xattr(long psiattr, char *xattr)
 }
 
 static void
-pattr2attr(long psiattr, long size, long ftime, struct stat *st, char *xattr)
+pattr2attr(fuse_req_t req, long psiattr, long size, long ftime, struct stat *st, char *xattr)
 {
-  struct fuse_context *ct = fuse_get_context();
+  const struct fuse_ctx *ct = fuse_req_ctx(req);
 
   memset(st, 0, sizeof(*st));
   st->st_uid = ct->uid;
@@ -142,8 +150,11 @@ pattr2attr(long psiattr, long size, long ftime, struct stat *st, char *xattr)
   pattr2xattr(psiattr, xattr);
 }
 
+/* The drive list is shared by all FUSE threads */
 static device *devices;
+static pthread_mutex_t devicesLock = PTHREAD_MUTEX_INITIALIZER;
 
+/* Must be called with devicesLock held */
 static int
 query_devices(void)
 {
@@ -161,48 +172,203 @@ query_devices(void)
   return 0;
 }
 
-static char *
-dirname(const char *dir)
+/*
+ * Inode table. Every name looked up by the kernel gets an inode number,
+ * which stays valid until the kernel forgets it. Names are EPOC paths
+ * without a trailing backslash: the root is "" and drives are "C:".
+ * As EPOC names are case insensitive, so is the table.
+ */
+#define INODE_HASH 1021
+
+static p_inode *byname[INODE_HASH], *bynum[INODE_HASH];
+static fuse_ino_t nextino = FUSE_ROOT_ID + 1;
+static pthread_mutex_t inodesLock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int
+name_hash(const char *name)
 {
-  static char *namebuf = NULL;
-  if (namebuf)
-    free(namebuf);
-  asprintf(&namebuf, "%s\\", dir);
-  return namebuf;
+  unsigned int h = 0;
+
+  for (; *name; name++)
+    h = h * 31 + tolower((unsigned char)*name);
+  return h % INODE_HASH;
 }
 
-static const char *
-filname(const char *dir)
+/* The following functions must be called with inodesLock held */
+
+static p_inode *
+find_name(const char *name)
 {
-  char *p;
-  if ((p = (char *) rindex(dir, '\\')))
-    return p + 1;
+  p_inode *p;
+
+  for (p = byname[name_hash(name)]; p; p = p->nextnam)
+    if (strcasecmp(p->name, name) == 0)
+      return p;
+  return NULL;
+}
+
+static p_inode *
+find_ino(fuse_ino_t ino)
+{
+  p_inode *p;
+
+  for (p = bynum[ino % INODE_HASH]; p; p = p->nextnum)
+    if (p->inode == ino)
+      return p;
+  return NULL;
+}
+
+static void
+hash_name(p_inode *p)
+{
+  unsigned int h = name_hash(p->name);
+
+  p->nextnam = byname[h];
+  byname[h] = p;
+  p->unlinked = 0;
+}
+
+/* The name is gone, but the inode stays until it is forgotten */
+static void
+unhash_name(p_inode *p)
+{
+  p_inode **pp;
+
+  if (p->unlinked)
+    return;
+  for (pp = &byname[name_hash(p->name)]; *pp; pp = &(*pp)->nextnam)
+    if (*pp == p) {
+      *pp = p->nextnam;
+      break;
+    }
+  p->unlinked = 1;
+}
+
+/* Count a lookup of a name, creating its inode if necessary */
+static fuse_ino_t
+remember(const char *name)
+{
+  p_inode *p;
+  fuse_ino_t ino;
+
+  pthread_mutex_lock(&inodesLock);
+  if ((p = find_name(name)) == NULL) {
+    if ((p = calloc(1, sizeof(p_inode))) == NULL ||
+        (p->name = strdup(name)) == NULL) {
+      free(p);
+      pthread_mutex_unlock(&inodesLock);
+      return 0;
+    }
+    p->inode = nextino++;
+    hash_name(p);
+    p->nextnum = bynum[p->inode % INODE_HASH];
+    bynum[p->inode % INODE_HASH] = p;
+  }
+  p->nlookup++;
+  ino = p->inode;
+  pthread_mutex_unlock(&inodesLock);
+  return ino;
+}
+
+static void
+forget(fuse_ino_t ino, unsigned long nlookup)
+{
+  p_inode *p, **pp;
+
+  pthread_mutex_lock(&inodesLock);
+  if ((p = find_ino(ino)) != NULL && (p->nlookup -= nlookup) == 0) {
+    unhash_name(p);
+    for (pp = &bynum[ino % INODE_HASH]; *pp; pp = &(*pp)->nextnum)
+      if (*pp == p) {
+        *pp = p->nextnum;
+        break;
+      }
+    free(p->name);
+    free(p);
+  }
+  pthread_mutex_unlock(&inodesLock);
+}
+
+/* Copy the name of an inode into path, which holds PATH_MAX bytes */
+static int
+get_path(fuse_ino_t ino, char *path)
+{
+  p_inode *p;
+  int ret = 0;
+
+  if (ino == FUSE_ROOT_ID) {
+    *path = '\0';
+    return 0;
+  }
+  pthread_mutex_lock(&inodesLock);
+  if ((p = find_ino(ino)) == NULL)
+    ret = -ESTALE;
+  else if (strlen(p->name) >= PATH_MAX)
+    ret = -ENAMETOOLONG;
   else
-    return dir;
+    strcpy(path, p->name);
+  pthread_mutex_unlock(&inodesLock);
+  return ret;
 }
 
+/* Build the name of an entry in a directory */
+static int
+child_path(fuse_ino_t parent, const char *name, char *path)
+{
+  size_t len;
+  int ret;
+
+  if ((ret = get_path(parent, path)) != 0)
+    return ret;
+  len = strlen(path);
+  if (len + strlen(name) + 2 > PATH_MAX)
+    return -ENAMETOOLONG;
+  if (len)
+    path[len++] = '\\';
+  strcpy(path + len, name);
+  return 0;
+}
+
+/* Move the inodes of a renamed file or directory and of everything below it */
+static void
+rename_inodes(const char *from, const char *to)
+{
+  size_t len = strlen(from);
+  p_inode *p;
+  int i;
+
+  pthread_mutex_lock(&inodesLock);
+  if ((p = find_name(to)) != NULL)
+    unhash_name(p);
+  for (i = 0; i < INODE_HASH; i++)
+    for (p = bynum[i]; p; p = p->nextnum) {
+      char *name;
+
+      if (p->unlinked || strncasecmp(p->name, from, len) != 0 ||
+          (p->name[len] != '\0' && p->name[len] != '\\'))
+        continue;
+      if ((name = malloc(strlen(to) + strlen(p->name + len) + 1)) == NULL)
+        continue;
+      strcpy(name, to);
+      strcat(name, p->name + len);
+      unhash_name(p);
+      free(p->name);
+      p->name = name;
+      hash_name(p);
+    }
+  pthread_mutex_unlock(&inodesLock);
+}
+
+/* Count the subdirectories of a directory, without listing it */
 static int
 dircount(const char *path, long *count)
 {
-  dentry *e = NULL;
   long ret = 0;
+  char dir[PATH_MAX + 1];
 
-  *count = 0;
   debuglog("dircount: %s", path);
-  debuglog("RFSV dir %s", path);
-  if ((ret = rfsv_dir(dirname(path), &e)) != 0)
-    return ret;
-  while (e) {
-    struct stat st;
-    dentry *o = e;
-    char xattr[XATTR_MAXLEN + 1];
-    pattr2attr(e->attr, e->size, e->time, &st, xattr);
-    free(e->name);
-    e = e->next;
-    free(o);
-    if (st.st_nlink > 1)
-      (*count)++;
-  }
+  snprintf(dir, sizeof(dir), "%s\\", path);
+  ret = rfsv_subdircount(dir, count);
 
   debuglog("count %d", *count);
   return ret;
@@ -217,47 +383,58 @@ static int getlinks(const char *path, struct stat *st)
   return ret;
 }
 
-static int plp_getattr(const char *path, struct stat *st)
+/* Get the attributes of the root, a drive or a file or directory */
+static int get_attr(fuse_req_t req, const char *path, struct stat *st)
 {
   char xattr[XATTR_MAXLEN + 1];
   int ret = 0;
 
-  debuglog("plp_getattr `%s'", ++path);
+  debuglog("get_attr `%s'", path);
 
   if (strcmp(path, "") == 0) {
-    pattr2attr(PSI_A_DIR, 0, 0, st, xattr);
+    pattr2attr(req, PSI_A_DIR, 0, 0, st, xattr);
+    pthread_mutex_lock(&devicesLock);
     if (!query_devices()) {
       device *dp;
-                
+
       for (dp = devices; dp; dp = dp->next)
         st->st_nlink++;
+      pthread_mutex_unlock(&devicesLock);
       debuglog("root has %d links", st->st_nlink);
-    } else
+    } else {
+      pthread_mutex_unlock(&devicesLock);
       return rfsv_isalive() ? -ENOENT : -ENOMEDIUM;
+    }
   } else {
     long pattr, psize, ptime;
 
     if (strlen(path) == 2 && path[1] == ':') {
       debuglog("getattr: device");
+      pthread_mutex_lock(&devicesLock);
       if (!query_devices()) {
         device *dp;
-                
+
         for (dp = devices; dp; dp = dp->next) {
           debuglog("cmp '%c', '%c'", dp->letter,
                    path[0]);
-          if (dp->letter == path[0])
+          if (toupper(dp->letter) == toupper(path[0]))
             break;
         }
         debuglog("device: %s", dp ? "exists" : "does not exist");
-        pattr2attr(PSI_A_DIR, 0, 0, st, xattr);
+        pthread_mutex_unlock(&devicesLock);
+        if (!dp)
+          return -ENOENT;
+        pattr2attr(req, PSI_A_DIR, 0, 0, st, xattr);
         return getlinks(path, st);
-      } else
+      } else {
+        pthread_mutex_unlock(&devicesLock);
         return rfsv_isalive() ? -ENOENT : -ENOMEDIUM;
+      }
     }
 
     debuglog("getattr: fileordir");
     if ((ret = rfsv_getattr(path, &pattr, &psize, &ptime)) == 0) {
-      pattr2attr(pattr, psize, ptime, st, xattr);
+      pattr2attr(req, pattr, psize, ptime, st, xattr);
       debuglog(" attrs Psion: %x %d %d, UNIX modes: %o, xattrs: %s", pattr, psize, ptime, st->st_mode, xattr);
       if (st->st_nlink > 1)
         ret = getlinks(path, st);
@@ -268,65 +445,190 @@ static int plp_getattr(const char *path, struct stat *st)
   return ret;
 }
 
-static int plp_access(const char *path, int mask)
+/* Reply to a request, which created or found a name */
+static void reply_entry(fuse_req_t req, const char *path)
+{
+  struct fuse_entry_param e;
+  int ret;
+
+  memset(&e, 0, sizeof(e));
+  if ((ret = get_attr(req, path, &e.attr)) != 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  if ((e.ino = remember(path)) == 0) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  e.attr.st_ino = e.ino;
+  e.attr_timeout = e.entry_timeout = cache_timeout;
+  /* The kernel does not know the inode, if the request was interrupted */
+  if (fuse_reply_entry(req, &e) != 0)
+    forget(e.ino, 1);
+}
+
+static void reply_attr(fuse_req_t req, fuse_ino_t ino, const char *path)
 {
+  struct stat st;
+  int ret;
+
+  if ((ret = get_attr(req, path, &st)) != 0)
+    fuse_reply_err(req, -ret);
+  else {
+    st.st_ino = ino;
+    fuse_reply_attr(req, &st, cache_timeout);
+  }
+}
+
+static void plp_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  char path[PATH_MAX];
+  int ret;
+
+  if ((ret = child_path(parent, name, path)) != 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  debuglog("plp_lookup `%s'", path);
+  reply_entry(req, path);
+}
+
+static void plp_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+  forget(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+static void plp_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  char path[PATH_MAX];
+  int ret;
+
+  (void)fi;
+  if ((ret = get_path(ino, path)) != 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  debuglog("plp_getattr `%s'", path);
+  reply_attr(req, ino, path);
+}
+
+static void plp_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+  (void)ino;
   (void)mask;
-  debuglog("plp_access `%s'", ++path);
-  return 0;
+  fuse_reply_err(req, 0);
+}
+
+static void plp_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+  (void)ino;
+  fuse_reply_err(req, EINVAL);
 }
 
-static int plp_readlink(const char *path, char *buf, size_t size)
+static const char *
+filname(const char *dir)
 {
-  (void)buf;
-  (void)size;
-  debuglog("plp_readlink `%s'", ++path);
-  return -EINVAL;
+  char *p;
+  if ((p = (char *) rindex(dir, '\\')))
+    return p + 1;
+  else
+    return dir;
 }
 
+/* A directory listing, read by the kernel in pieces */
+struct dirbuf {
+  char *p;
+  size_t size;
+  size_t alloc;
+};
 
-static int plp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                       off_t offset, struct fuse_file_info *fi)
+static int
+dirbuf_add(fuse_req_t req, struct dirbuf *b, const char *name, const struct stat *st)
 {
-  device *dp;
-  dentry *e = NULL;
+  size_t len = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+
+  if (b->size + len > b->alloc) {
+    size_t alloc = b->alloc ? b->alloc * 2 : 4096;
+    char *p;
+
+    while (alloc < b->size + len)
+      alloc *= 2;
+    if ((p = realloc(b->p, alloc)) == NULL)
+      return -ENOMEM;
+    b->p = p;
+    b->alloc = alloc;
+  }
+  fuse_add_direntry(req, b->p + b->size, len, name, st, b->size + len);
+  b->size += len;
+  return 0;
+}
+
+/* The whole listing is read on opendir, so that it stays consistent
+   while the kernel reads it. Reading it also fills the attribute
+   cache, so that the lookups of the entries need no further requests. */
+static void plp_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  char path[PATH_MAX];
+  struct dirbuf *b;
+  struct stat st;
   char xattr[XATTR_MAXLEN + 1];
+  int ret;
 
-  debuglog("plp_readdir `%s'", ++path);
+  if ((ret = get_path(ino, path)) != 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  debuglog("plp_opendir `%s'", path);
+  if ((b = calloc(1, sizeof(struct dirbuf))) == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
 
-  (void)offset;
-  (void)fi;
+  memset(&st, 0, sizeof(st));
+  st.st_mode = S_IFDIR;
+  st.st_ino = ino;
+  dirbuf_add(req, b, ".", &st);
+  st.st_ino = UNKNOWN_INO;
+  dirbuf_add(req, b, "..", &st);
 
   if (strcmp(path, "") == 0) {
+    device *dp;
+
     debuglog("readdir root");
+    pthread_mutex_lock(&devicesLock);
     if (query_devices() == 0) {
       for (dp = devices; dp; dp = dp->next) {
-        struct stat st;
-        unsigned char name[3];
+        char name[3];
 
         name[0] = dp->letter;
         name[1] = ':';
         name[2] = '\0';
-        pattr2attr(dp->attrib, 1, 0, &st, xattr);
-        if (filler(buf, (char *)name, &st, 0))
+        pattr2attr(req, dp->attrib, 1, 0, &st, xattr);
+        st.st_ino = UNKNOWN_INO;
+        if ((ret = dirbuf_add(req, b, name, &st)) != 0)
           break;
       }
     }
+    pthread_mutex_unlock(&devicesLock);
   } else {
-    int ret;
-    debuglog("RFSV dir `%s'", dirname(path));
-    if ((ret = rfsv_dir(dirname(path), &e)) != 0)
-      return ret;
+    char dir[PATH_MAX + 1];
+    dentry *e = NULL;
+
+    snprintf(dir, sizeof(dir), "%s\\", path);
+    debuglog("RFSV dir `%s'", dir);
+    ret = rfsv_dir(dir, &e);
 
     debuglog("scanning contents");
     while (e) {
       dentry *o;
-      struct stat st;
       const char *name = filname(e->name);
 
-      pattr2attr(e->attr, e->size, e->time, &st, xattr);
+      pattr2attr(req, e->attr, e->size, e->time, &st, xattr);
+      st.st_ino = UNKNOWN_INO;
       debuglog("  %s %o %d %d", name, st.st_mode, st.st_size, st.st_mtime);
-      if (filler(buf, name, &st, 0))
-        break;
+      if (ret == 0)
+        ret = dirbuf_add(req, b, name, &st);
       free(e->name);
       o = e;
       e = e->next;
@@ -334,73 +636,154 @@ static int plp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     }
   }
 
-  debuglog("readdir OK");
-  return 0;
+  if (ret != 0) {
+    free(b->p);
+    free(b);
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  fi->fh = (uint64_t)(unsigned long)b;
+  if (fuse_reply_open(req, fi) != 0) {
+    free(b->p);
+    free(b);
+  }
 }
 
-static int plp_mknod(const char *path, mode_t mode, dev_t dev)
+static void plp_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                        off_t off, struct fuse_file_info *fi)
 {
-  int ret = -EINVAL;
+  struct dirbuf *b = (struct dirbuf *)(unsigned long)fi->fh;
+
+  (void)ino;
+  if (off < b->size)
+    fuse_reply_buf(req, b->p + off, b->size - off < size ? b->size - off : size);
+  else
+    fuse_reply_buf(req, NULL, 0);
+}
 
-  debuglog("plp_mknod `%s' %o", ++path, mode);
+static void plp_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  struct dirbuf *b = (struct dirbuf *)(unsigned long)fi->fh;
+
+  (void)ino;
+  free(b->p);
+  free(b);
+  fuse_reply_err(req, 0);
+}
+
+static void plp_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      mode_t mode, dev_t dev)
+{
+  char path[PATH_MAX];
+  int ret = -EINVAL;
 
-  if (S_ISREG(mode) && dev == 0) {
-    u_int32_t phandle;
-    if ((ret = rfsv_fcreate(0x200, path, &phandle)) == 0)
-      rfsv_fclose(phandle);
+  if (S_ISREG(mode) && dev == 0 && (ret = child_path(parent, name, path)) == 0) {
+    debuglog("plp_mknod `%s' %o", path, mode);
+    ret = rfsv_fcreate(0x200, path);
   }
+  if (ret != 0)
+    fuse_reply_err(req, -ret);
+  else
+    reply_entry(req, path);
+}
 
-  return ret;
+static void plp_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+  char path[PATH_MAX];
+  int ret;
+
+  if ((ret = child_path(parent, name, path)) == 0) {
+    debuglog("plp_mkdir `%s' %o", path, mode);
+    ret = rfsv_mkdir(path);
+  }
+  if (ret != 0)
+    fuse_reply_err(req, -ret);
+  else
+    reply_entry(req, path);
 }
 
-static int plp_mkdir(const char *path, mode_t mode)
+/* Forget a removed name, so that a new file of that name gets a new inode */
+static void unlink_name(const char *path)
 {
-  debuglog("plp_mkdir `%s' %o", ++path, mode);
-  return rfsv_mkdir(path);
+  p_inode *p;
+
+  pthread_mutex_lock(&inodesLock);
+  if ((p = find_name(path)) != NULL)
+    unhash_name(p);
+  pthread_mutex_unlock(&inodesLock);
 }
 
-static int plp_unlink(const char *path)
+static void plp_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-  debuglog("plp_unlink `%s'", ++path);
-  return rfsv_remove(path);
+  char path[PATH_MAX];
+  int ret;
+
+  if ((ret = child_path(parent, name, path)) == 0) {
+    debuglog("plp_unlink `%s'", path);
+    if ((ret = rfsv_remove(path)) == 0)
+      unlink_name(path);
+  }
+  fuse_reply_err(req, -ret);
 }
 
-static int plp_rmdir(const char *path)
+static void plp_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-  debuglog("plp_rmdir `%s'", ++path);
-  return rfsv_rmdir(path);
+  char path[PATH_MAX];
+  int ret;
+
+  if ((ret = child_path(parent, name, path)) == 0) {
+    debuglog("plp_rmdir `%s'", path);
+    if ((ret = rfsv_rmdir(path)) == 0)
+      unlink_name(path);
+  }
+  fuse_reply_err(req, -ret);
 }
 
-static int plp_symlink(const char *from, const char *to)
+static void plp_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                        const char *name)
 {
-  debuglog("plp_symlink `%s' -> `'%s'", ++from, ++to);
-  return -EPERM;
+  (void)link;
+  (void)parent;
+  debuglog("plp_symlink `%s'", name);
+  fuse_reply_err(req, EPERM);
 }
 
-static int plp_rename(const char *from, const char *to)
+static void plp_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                       fuse_ino_t newparent, const char *newname)
 {
-  debuglog("plp_rename `%s' -> `%s'", ++from, ++to);
-  rfsv_remove(to);
-  return rfsv_rename(from, to);
+  char from[PATH_MAX], to[PATH_MAX];
+  int ret;
+
+  if ((ret = child_path(parent, name, from)) == 0 &&
+      (ret = child_path(newparent, newname, to)) == 0) {
+    debuglog("plp_rename `%s' -> `%s'", from, to);
+    rfsv_remove(to);
+    if ((ret = rfsv_rename(from, to)) == 0)
+      rename_inodes(from, to);
+  }
+  fuse_reply_err(req, -ret);
 }
 
-static int plp_link(const char *from, const char *to)
+static void plp_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                     const char *newname)
 {
-  debuglog("plp_link `%s' -> `%s'", ++from, ++to);
-  return -EPERM;
+  (void)ino;
+  (void)newparent;
+  debuglog("plp_link `%s'", newname);
+  fuse_reply_err(req, EPERM);
 }
 
-static int plp_chmod(const char *path, mode_t mode)
+static int plp_chmod(fuse_req_t req, const char *path, mode_t mode)
 {
   int ret;
   long psisattr, psidattr, pattr, psize, ptime;
   struct stat st;
   char xattr[XATTR_MAXLEN + 1];
 
-  debuglog("plp_chmod `%s'", ++path);
+  debuglog("plp_chmod `%s'", path);
 
   if ((ret = rfsv_getattr(path, &pattr, &psize, &ptime)) == 0) {
-    pattr2attr(pattr, psize, ptime, &st, xattr);
+    pattr2attr(req, pattr, psize, ptime, &st, xattr);
     attr2pattr(st.st_mode, mode, "", "", &psisattr, &psidattr);
     debuglog("  UNIX old, new: %o, %o; Psion set, clear: %x, %x", st.st_mode, mode, psisattr, psidattr);
     if ((ret = rfsv_setattr(path, psisattr, psidattr)) == 0)
@@ -410,157 +793,238 @@ static int plp_chmod(const char *path, mode_t mode)
   return ret;
 }
 
-static int plp_getxattr(const char *path, const char *name, char *value, size_t size)
+static void plp_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                        int to_set, struct fuse_file_info *fi)
 {
-  debuglog("plp_getxattr `%s' %s", ++path, name);
-  if (strcmp(name, XATTR_NAME) == 0) {
-    if (size >= XATTR_MAXLEN) {
-      long pattr, psize, ptime;
-      int ret;
-      if ((ret = rfsv_getattr(path, &pattr, &psize, &ptime)) == 0) {
-        pattr2xattr(pattr, value);
-        debuglog("getxattr succeeded: %s", value);
-        return strlen(value);
-      } else
-        return ret;
-    } else {
-      debuglog("only gave %d bytes, need %d", size, XATTR_MAXLEN);
-      return XATTR_MAXLEN;
-    }
-  } 
-  return 0;
+  char path[PATH_MAX];
+  int ret;
+
+  (void)fi;
+  if ((ret = get_path(ino, path)) != 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  debuglog("plp_setattr `%s' %x", path, to_set);
+  if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+    ret = -EPERM;
+  if (ret == 0 && (to_set & FUSE_SET_ATTR_MODE))
+    ret = plp_chmod(req, path, attr->st_mode);
+  if (ret == 0 && (to_set & FUSE_SET_ATTR_SIZE))
+    ret = rfsv_setsize(path, attr->st_size);
+#ifdef FUSE_SET_ATTR_MTIME_NOW
+  if (ret == 0 && (to_set & FUSE_SET_ATTR_MTIME_NOW))
+    ret = rfsv_setmtime(path, time(NULL));
+  else
+#endif
+  if (ret == 0 && (to_set & FUSE_SET_ATTR_MTIME))
+    ret = rfsv_setmtime(path, attr->st_mtime);
+  if (ret != 0)
+    fuse_reply_err(req, -ret);
+  else
+    reply_attr(req, ino, path);
+}
+
+static void plp_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+  char path[PATH_MAX];
+  char value[XATTR_MAXLEN + 1];
+  long pattr, psize, ptime;
+  int ret;
+
+  if ((ret = get_path(ino, path)) != 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  debuglog("plp_getxattr `%s' %s", path, name);
+  if (strcmp(name, XATTR_NAME) != 0) {
+    if (size == 0)
+      fuse_reply_xattr(req, 0);
+    else
+      fuse_reply_buf(req, NULL, 0);
+  } else if (size == 0)
+    fuse_reply_xattr(req, XATTR_MAXLEN);
+  else if (size < XATTR_MAXLEN) {
+    debuglog("only gave %d bytes, need %d", size, XATTR_MAXLEN);
+    fuse_reply_err(req, ERANGE);
+  } else if ((ret = rfsv_getattr(path, &pattr, &psize, &ptime)) == 0) {
+    pattr2xattr(pattr, value);
+    debuglog("getxattr succeeded: %s", value);
+    fuse_reply_buf(req, value, strlen(value));
+  } else
+    fuse_reply_err(req, -ret);
 }
 
-static int plp_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+static void plp_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                         const char *value, size_t size, int flags)
 {
-  debuglog("plp_setxattr `%s'", ++path);
+  char path[PATH_MAX];
+  int ret;
+
+  if ((ret = get_path(ino, path)) != 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  debuglog("plp_setxattr `%s'", path);
   if (strcmp(name, XATTR_NAME) == 0) {
-    int ret;
-    long psisattr, psidattr;
+    long psisattr, psidattr, pattr, psize, ptime;
     char oxattr[XATTR_MAXLEN + 1], nxattr[XATTR_MAXLEN + 1];
 
-    if (flags & XATTR_CREATE)
-      return -EEXIST;
+    if (flags & XATTR_CREATE) {
+      fuse_reply_err(req, EEXIST);
+      return;
+    }
 
+    memset(nxattr, 0, sizeof(nxattr));
     strncpy(nxattr, value, size < XATTR_MAXLEN ? size : XATTR_MAXLEN);
-    nxattr[XATTR_MAXLEN] = '\0';
-    /* Need to undo earlier increment of path when calling plp_getxattr */
-    plp_getxattr(path - 1, name, oxattr, XATTR_MAXLEN);
-    psisattr = psidattr = 0;
-    xattr2pattr(&psisattr, &psidattr, oxattr, value);
-    debuglog("attrs set %x delete %x; %s, %s", psisattr, psidattr, oxattr, value);
-    if ((ret = rfsv_setattr(path, psisattr, psidattr)) != 0)
-      return ret;
-
-    debuglog("setxattr succeeded");
-    return 0;
-  } else {
-    if (flags & XATTR_REPLACE)
-      return -ENOATTR;
-    else
-      return -ENOTSUP;
-  }
+    if ((ret = rfsv_getattr(path, &pattr, &psize, &ptime)) == 0) {
+      pattr2xattr(pattr, oxattr);
+      psisattr = psidattr = 0;
+      xattr2pattr(&psisattr, &psidattr, oxattr, nxattr);
+      debuglog("attrs set %x delete %x; %s, %s", psisattr, psidattr, oxattr, nxattr);
+      if ((ret = rfsv_setattr(path, psisattr, psidattr)) == 0)
+        debuglog("setxattr succeeded");
+    }
+    fuse_reply_err(req, -ret);
+  } else
+    fuse_reply_err(req, (flags & XATTR_REPLACE) ? ENOATTR : ENOTSUP);
 }
 
-static int plp_listxattr(const char *path, char *list, size_t size)
+static void plp_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 {
-  debuglog("plp_listxattr `%s'", ++path);
-  if (size > sizeof(XATTR_NAME))
-    strcpy(list, XATTR_NAME);
-  return sizeof(XATTR_NAME);
+  (void)ino;
+  debuglog("plp_listxattr");
+  if (size == 0)
+    fuse_reply_xattr(req, sizeof(XATTR_NAME));
+  else if (size < sizeof(XATTR_NAME))
+    fuse_reply_err(req, ERANGE);
+  else
+    fuse_reply_buf(req, XATTR_NAME, sizeof(XATTR_NAME));
 }
 
-static int plp_removexattr(const char *path, const char *name)
+static void plp_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
 {
-  debuglog("plp_removexattr `%s'", ++path);
+  (void)ino;
   (void)name;
-  return -ENOTSUP;
+  debuglog("plp_removexattr");
+  fuse_reply_err(req, ENOTSUP);
 }
 
-static int plp_chown(const char *path, uid_t uid, gid_t gid)
+static void plp_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-  (void)uid;
-  (void)gid;
-  debuglog("plp_chown `%s'", ++path);
-  return -EPERM;
+  char path[PATH_MAX];
+  int ret;
+
+  if ((ret = get_path(ino, path)) == 0) {
+    debuglog("plp_open `%s'", path);
+    ret = rfsv_fhopen(path, fi->flags & O_ACCMODE, &fi->fh);
+  }
+  if (ret != 0)
+    fuse_reply_err(req, -ret);
+  else if (fuse_reply_open(req, fi) != 0)
+    rfsv_fhrelease(fi->fh);
 }
 
-static int plp_truncate(const char *path, off_t size)
+static void plp_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-  debuglog("plp_truncate `%s'", ++path);
-  return rfsv_setsize(path, size);
+  (void)ino;
+  debuglog("plp_flush");
+  fuse_reply_err(req, -rfsv_fhflush(fi->fh));
 }
 
-static int plp_utimens(const char *path, const struct timespec ts[2])
+static void plp_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                      struct fuse_file_info *fi)
 {
-  debuglog("plp_utimens `%s'", ++path);
-  return rfsv_setmtime(path, ts[1].tv_sec);
+  (void)ino;
+  (void)datasync;
+  debuglog("plp_fsync");
+  fuse_reply_err(req, -rfsv_fhflush(fi->fh));
 }
 
-static int plp_open(const char *path, struct fuse_file_info *fi)
+static void plp_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-  debuglog("plp_open `%s'", ++path);
-  (void)fi;
-  return 0;
+  (void)ino;
+  debuglog("plp_release");
+  fuse_reply_err(req, -rfsv_fhrelease(fi->fh));
 }
 
-static int plp_read(const char *path, char *buf, size_t size, off_t offset,
-                    struct fuse_file_info *fi)
+static void plp_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                     struct fuse_file_info *fi)
 {
   long read;
+  char *buf;
 
-  (void)fi;
-  debuglog("plp_read `%s' offset %lld size %ld", ++path, offset, size);
-  read = rfsv_read(buf, (long)offset, size, path);
+  (void)ino;
+  debuglog("plp_read offset %lld size %ld", offset, size);
+  if ((buf = malloc(size)) == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  read = rfsv_fhread(fi->fh, buf, (long)offset, size);
   debuglog("read returned %ld", read);
-  return read;
+  if (read < 0)
+    fuse_reply_err(req, -read);
+  else
+    fuse_reply_buf(req, buf, read);
+  free(buf);
 }
 
-static int plp_write(const char *path, const char *buf, size_t size,
-                     off_t offset, struct fuse_file_info *fi)
+static void plp_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                      size_t size, off_t offset, struct fuse_file_info *fi)
 {
   long written;
 
-  (void)fi;
-  debuglog("plp_write `%s' offset %lld size %ld", ++path, offset, size);
-  written = rfsv_write(buf, offset, size, path);
+  (void)ino;
+  debuglog("plp_write offset %lld size %ld", offset, size);
+  written = rfsv_fhwrite(fi->fh, buf, offset, size);
   debuglog("write returned %ld", written);
-  return written;
+  if (written < 0)
+    fuse_reply_err(req, -written);
+  else
+    fuse_reply_write(req, written);
 }
 
-static int plp_statfs(const char *path, struct statvfs *stbuf)
+static void plp_statfs(fuse_req_t req, fuse_ino_t ino)
 {
+  struct statvfs stbuf;
   device *dp;
 
-  (void)path;
+  (void)ino;
   debuglog("plp_statfs");
 
-  stbuf->f_bsize = BLOCKSIZE;
-  stbuf->f_frsize = BLOCKSIZE;
+  memset(&stbuf, 0, sizeof(stbuf));
+  stbuf.f_bsize = BLOCKSIZE;
+  stbuf.f_frsize = BLOCKSIZE;
+  pthread_mutex_lock(&devicesLock);
   if (query_devices() == 0) {
     for (dp = devices; dp; dp = dp->next) {
-      stbuf->f_blocks += (dp->total + BLOCKSIZE - 1) / BLOCKSIZE;
-      stbuf->f_bfree += (dp->free + BLOCKSIZE - 1) / BLOCKSIZE;
+      stbuf.f_blocks += (dp->total + BLOCKSIZE - 1) / BLOCKSIZE;
+      stbuf.f_bfree += (dp->free + BLOCKSIZE - 1) / BLOCKSIZE;
     }
   }
-  stbuf->f_bavail = stbuf->f_bfree;
+  pthread_mutex_unlock(&devicesLock);
+  stbuf.f_bavail = stbuf.f_bfree;
 
   /* Don't have numbers for these */
-  stbuf->f_files = 0;
-  stbuf->f_ffree = stbuf->f_favail = 0;
+  stbuf.f_files = 0;
+  stbuf.f_ffree = stbuf.f_favail = 0;
 
-  stbuf->f_fsid = FID;
-  stbuf->f_flag = 0;    /* don't have mount flags */
-  stbuf->f_namemax = 255; /* KDMaxFileNameLen% */
-    
-  return 0;
+  stbuf.f_fsid = FID;
+  stbuf.f_flag = 0;    /* don't have mount flags */
+  stbuf.f_namemax = 255; /* KDMaxFileNameLen% */
+
+  fuse_reply_statfs(req, &stbuf);
 }
 
-struct fuse_operations plp_oper = {
+struct fuse_lowlevel_ops plp_oper = {
+  .lookup	= plp_lookup,
+  .forget	= plp_forget,
   .getattr	= plp_getattr,
+  .setattr	= plp_setattr,
   .access	= plp_access,
   .readlink	= plp_readlink,
+  .opendir	= plp_opendir,
   .readdir	= plp_readdir,
+  .releasedir	= plp_releasedir,
   .mknod	= plp_mknod,
   .mkdir	= plp_mkdir,
   .symlink	= plp_symlink,
@@ -568,15 +1032,14 @@ struct fuse_operations plp_oper = {
   .rmdir	= plp_rmdir,
   .rename	= plp_rename,
   .link		= plp_link,
-  .chmod	= plp_chmod,
   .setxattr	= plp_setxattr,
   .getxattr	= plp_getxattr,
   .listxattr	= plp_listxattr,
   .removexattr	= plp_removexattr,
-  .chown	= plp_chown,
-  .truncate	= plp_truncate,
-  .utimens	= plp_utimens,
   .open		= plp_open,
+  .flush	= plp_flush,
+  .release	= plp_release,
+  .fsync	= plp_fsync,
   .read		= plp_read,
   .write	= plp_write,
   .statfs	= plp_statfs,
@@ -36,12 +36,18 @@
 
 #include <iostream>
 #include <string>
+#include <list>
+#include <map>
+#include <vector>
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <signal.h>
 #include <unistd.h>
 #include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "rfsv_api.h"
 
@@ -54,13 +60,208 @@
 
 using namespace std;
 
-static rfsv *a;
-static rfsvfactory *rf;
-
 static rpcs *r;
 static rpcsfactory *rp;
 static bufferStore owner;
 
+/* Maximum number of rfsv sessions (NCP channels) to ncpd */
+#define MAX_SESSIONS 16
+
+/* Maximum number of Psion file handles kept open per session */
+#define MAX_PSION_HANDLES 8
+
+/* Readahead starts small and grows, as long as a file is read sequentially */
+#define MIN_READAHEAD 8192
+#define MAX_READAHEAD 65536
+
+/* Maximum amount of written data, held back per file and in total */
+#define MAX_WRITEBEHIND 65536
+#define MAX_DIRTY (4 * MAX_WRITEBEHIND)
+
+struct session;
+
+/* A file, opened via FUSE. All opens of the same file share one entry.
+   The Psion handle is closed, if too many files are open, and reopened
+   on the next access. refs is protected by filesLock, everything else
+   by lock. The Psion handle belongs to session s and is only used with
+   the session's lock held as well. */
+typedef struct {
+    string name;
+    long mode;
+    int refs;
+    pthread_mutex_t lock;
+    struct session *s;
+    bool open;
+    u_int32_t handle;
+    u_int32_t pos;
+    /* Readahead buffer */
+    char *rbuf;
+    long rsize;
+    long roff;
+    long rlen;
+    long readahead;
+    long nextRead;
+    /* Written data, not yet sent to the Psion */
+    char *wbuf;
+    long woff;
+    long wlen;
+    /* Error of a delayed write, reported by the next flush */
+    int error;
+} openFile;
+
+/* A connection to ncpd with its own rfsv. Requests on one session are
+   serialized, requests on different sessions run in parallel. */
+struct session {
+    rfsvfactory *factory;
+    rfsv *a;
+    pthread_mutex_t lock;
+    int files;			/* Open files, using this session */
+    list<openFile *> lru;	/* Its files with a Psion handle, most recent first */
+};
+
+static session sessions[MAX_SESSIONS];
+static int numSessions = 4;
+static unsigned int nextSession;
+
+static map<string, openFile *> openFiles;
+static pthread_mutex_t filesLock = PTHREAD_MUTEX_INITIALIZER;
+static long dirtyBytes;
+
+/* Number of seconds, attributes and directory listings are cached */
+long cache_timeout = 5;
+
+/* Attributes of a file or directory, as returned by fgeteattr */
+typedef struct {
+    long attr;
+    long size;
+    long time;
+    time_t expires;
+} cachedAttr;
+
+/* Contents of a directory */
+typedef struct {
+    PlpDir entries;
+    time_t expires;
+} cachedDir;
+
+/* Both caches are keyed by cache_key() and protected by cacheLock */
+static map<string, cachedAttr> attrCache;
+static map<string, cachedDir> dirCache;
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* EPOC names are case insensitive and may use either separator */
+static string cache_key(const char *name) {
+    string key;
+
+    for (; *name; name++)
+	key += (*name == '/') ? '\\' : tolower(*name);
+    while (!key.empty() && key[key.size() - 1] == '\\')
+	key.erase(key.size() - 1);
+    return key;
+}
+
+/* Remove a name, everything below it and its parent's listing from the caches */
+static void cache_invalidate(const char *name) {
+    string key = cache_key(name);
+    string prefix = key + '\\';
+    string::size_type sep = key.rfind('\\');
+
+    pthread_mutex_lock(&cacheLock);
+    attrCache.erase(key);
+    dirCache.erase(key);
+    if (sep != string::npos)
+	dirCache.erase(key.substr(0, sep));
+    map<string, cachedAttr>::iterator i = attrCache.lower_bound(prefix);
+    while (i != attrCache.end() && i->first.compare(0, prefix.size(), prefix) == 0)
+	attrCache.erase(i++);
+    map<string, cachedDir>::iterator j = dirCache.lower_bound(prefix);
+    while (j != dirCache.end() && j->first.compare(0, prefix.size(), prefix) == 0)
+	dirCache.erase(j++);
+    pthread_mutex_unlock(&cacheLock);
+}
+
+static bool cache_getattr(const string &key, long *attr, long *size, long *time) {
+    bool found = false;
+
+    pthread_mutex_lock(&cacheLock);
+    map<string, cachedAttr>::iterator i = attrCache.find(key);
+    if (i != attrCache.end() && i->second.expires > ::time(NULL)) {
+	*attr = i->second.attr;
+	*size = i->second.size;
+	*time = i->second.time;
+	found = true;
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return found;
+}
+
+static void cache_putattr(const string &key, long attr, long size, long time) {
+    if (cache_timeout <= 0)
+	return;
+    pthread_mutex_lock(&cacheLock);
+    cachedAttr &c = attrCache[key];
+    c.attr = attr;
+    c.size = size;
+    c.time = time;
+    c.expires = ::time(NULL) + cache_timeout;
+    pthread_mutex_unlock(&cacheLock);
+}
+
+static bool cache_getdir(const string &key, PlpDir &entries) {
+    bool found = false;
+
+    pthread_mutex_lock(&cacheLock);
+    map<string, cachedDir>::iterator i = dirCache.find(key);
+    if (i != dirCache.end() && i->second.expires > time(NULL)) {
+	entries = i->second.entries;
+	found = true;
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return found;
+}
+
+static void cache_putdir(const string &key, PlpDir &entries) {
+    if (cache_timeout <= 0)
+	return;
+    pthread_mutex_lock(&cacheLock);
+    time_t expires = time(NULL) + cache_timeout;
+    cachedDir &d = dirCache[key];
+
+    d.entries = entries;
+    d.expires = expires;
+    /* Also remember the attributes of all entries */
+    for (int i = 0; i < entries.size(); i++) {
+	PlpDirent &pe = entries[i];
+	cachedAttr &c = attrCache[key + '\\' + cache_key(pe.getName())];
+
+	c.attr = pe.getAttr();
+	c.size = pe.getSize();
+	c.time = pe.getPsiTime().getTime();
+	c.expires = expires;
+    }
+    pthread_mutex_unlock(&cacheLock);
+}
+
+/* Get a session for a path based request, preferably an idle one.
+   It must be returned with put_session(). */
+static session *get_session(void) {
+    unsigned int start = __sync_fetch_and_add(&nextSession, 1);
+    session *s;
+
+    for (int i = 0; i < numSessions; i++) {
+	s = &sessions[(start + i) % numSessions];
+	if (pthread_mutex_trylock(&s->lock) == 0)
+	    return s;
+    }
+    s = &sessions[start % numSessions];
+    pthread_mutex_lock(&s->lock);
+    return s;
+}
+
+static void put_session(session *s) {
+    pthread_mutex_unlock(&s->lock);
+}
+
 /* Translate EPOC/SIBO error to UNIX error code, leaving positive
    numbers alone */
 int epocerr_to_errno(long epocerr) {
@@ -144,165 +345,684 @@ int epocerr_to_errno(long epocerr) {
 }
 
 int rfsv_isalive(void) {
-    if (!a) {
-	if (!(a = rf->create(true)))
+    int alive = 0;
+
+    for (int i = 0; i < numSessions; i++) {
+	session *s = &sessions[i];
+
+	pthread_mutex_lock(&s->lock);
+	if (!s->a)
+	    s->a = s->factory->create(true);
+	if (s->a && s->a->getStatus() == rfsv::E_PSI_GEN_NONE)
+	    alive = 1;
+	pthread_mutex_unlock(&s->lock);
+    }
+    return alive;
+}
+
+static void flush_all(void);
+static void flush_name(const char *name);
+static void close_handle(const char *name);
+
+/* Where the entries of a directory go, while it is being read */
+typedef struct {
+    dentry **e;		/* List for FUSE, if not NULL */
+    PlpDir *entries;	/* Copy for the cache, if not NULL */
+} dirState;
+
+static int dir_entry(void *ptr, PlpDirent &pe) {
+    dirState *d = (dirState *)ptr;
+
+    if (d->entries)
+	d->entries->push_back(pe);
+    if (d->e) {
+	dentry *tmp = *d->e;
+
+	if (!(*d->e = (dentry *)calloc(1, sizeof(dentry)))) {
+	    *d->e = tmp;
 	    return 0;
+	}
+	(*d->e)->time = pe.getPsiTime().getTime();
+	(*d->e)->size = pe.getSize();
+	(*d->e)->attr = pe.getAttr();
+	(*d->e)->name = strdup(pe.getName());
+	(*d->e)->next = tmp;
     }
-    return a->getStatus() == rfsv::E_PSI_GEN_NONE;
+    return 1;
 }
 
-int rfsv_dir(const char *file, dentry **e) {
+/* Read a directory in one pass, from the cache if possible. Entries are
+   added to e and subdirectories are counted, both unless NULL. */
+static int read_dir(const char *file, dentry **e, u_int32_t *subdirs) {
     PlpDir entries;
-    dentry *tmp;
+    dirState d;
     long ret;
+    string key = cache_key(file);
 
-    if (!a)
-	return -ENODEV;
-    ret = a->dir(file, entries);
+    if (dirtyBytes)
+	flush_all();
+    d.e = e;
+    if (cache_getdir(key, entries)) {
+	d.entries = NULL;
+	if (subdirs)
+	    *subdirs = 0;
+	for (int i = 0; i < entries.size(); i++) {
+	    if (subdirs && (entries[i].getAttr() & PSI_A_DIR))
+		(*subdirs)++;
+	    if (e && !dir_entry(&d, entries[i]))
+		return -ENOMEM;
+	}
+	return 0;
+    }
 
-    for (int i = 0; i < entries.size(); i++) {
-	PlpDirent pe = entries[i];
-	tmp = *e;
-	*e = (dentry *)calloc(1, sizeof(dentry));
-	if (!*e)
-	    return -ENODEV;
-	(*e)->time = pe.getPsiTime().getTime();
-	(*e)->size = pe.getSize();
-	(*e)->attr = pe.getAttr();
-	(*e)->name = strdup(pe.getName());
-	(*e)->next = tmp;
+    session *s = get_session();
+
+    if (!s->a) {
+	put_session(s);
+	return -ENODEV;
     }
+    d.entries = (cache_timeout > 0) ? &entries : NULL;
+    ret = s->a->dir(file, dir_entry, &d, subdirs);
+    put_session(s);
+    if (ret == rfsv::E_PSI_FILE_CANCEL)
+	return -ENOMEM;
+    if (ret == rfsv::E_PSI_GEN_NONE && d.entries)
+	cache_putdir(key, entries);
     return epocerr_to_errno(ret);
 }
 
-int rfsv_dircount(const char *file, u_int32_t *count) {
-    if (!a)
-	return -ENODEV;
-    return epocerr_to_errno(a->dircount(file, *count));
+int rfsv_dir(const char *file, dentry **e) {
+    return read_dir(file, e, NULL);
+}
+
+int rfsv_subdircount(const char *file, long *count) {
+    u_int32_t n = 0;
+    int ret = read_dir(file, NULL, &n);
+
+    *count = n;
+    return ret;
 }
 
 int rfsv_rmdir(const char *name) {
-    if (!a)
-	return -ENODEV;
-    return epocerr_to_errno(a->rmdir(name));
+    session *s = get_session();
+    int ret = -ENODEV;
+
+    if (s->a) {
+	cache_invalidate(name);
+	ret = epocerr_to_errno(s->a->rmdir(name));
+    }
+    put_session(s);
+    return ret;
 }
 
 int rfsv_mkdir(const char *file) {
-    if (!a)
-	return -ENODEV;
-    return epocerr_to_errno(a->mkdir(file));
+    session *s = get_session();
+    int ret = -ENODEV;
+
+    if (s->a) {
+	cache_invalidate(file);
+	ret = epocerr_to_errno(s->a->mkdir(file));
+    }
+    put_session(s);
+    return ret;
 }
 
 int rfsv_remove(const char *file) {
-    if (!a)
-	return -ENODEV;
-    return epocerr_to_errno(a->remove(file));
-}
+    session *s;
+    int ret = -ENODEV;
 
-int rfsv_fclose(long handle) {
-    if (!a)
-	return -ENODEV;
-    return epocerr_to_errno(a->fclose(handle));
+    close_handle(file);
+    s = get_session();
+    if (s->a) {
+	cache_invalidate(file);
+	ret = epocerr_to_errno(s->a->remove(file));
+    }
+    put_session(s);
+    return ret;
 }
 
-int rfsv_fcreate(long attr, const char *file, u_int32_t *handle) {
+int rfsv_fcreate(long attr, const char *file) {
+    session *s = get_session();
     u_int32_t ph;
     long ret;
 
-    if (!a)
+    if (!s->a) {
+	put_session(s);
 	return -ENODEV;
-    ret = a->fcreatefile(attr, file, ph);
-    *handle = ph;
+    }
+    cache_invalidate(file);
+    if ((ret = s->a->fcreatefile(attr, file, ph)) == rfsv::E_PSI_GEN_NONE)
+	s->a->fclose(ph);
+    put_session(s);
     return epocerr_to_errno(ret);
 }
 
-int rfsv_open(const char *name, long mode, u_int32_t *handle) {
+/* Open a file on a session, retrying while it is locked.
+   Must be called with the session's lock held. */
+static int open_handle(session *s, const char *name, long mode, u_int32_t *handle) {
     long ret, retry;
 
-    if (!a)
+    if (!s->a)
 	return -ENODEV;
     if (mode == O_RDONLY)
         mode = rfsv::PSI_O_RDONLY;
     else
         mode = rfsv::PSI_O_RDWR;
-    for (retry = 100; retry > 0 && (ret = a->fopen(a->opMode(mode), name, *handle)) != rfsv::E_PSI_GEN_NONE; retry--)
+    for (retry = 100; retry > 0 && (ret = s->a->fopen(s->a->opMode(mode), name, *handle)) != rfsv::E_PSI_GEN_NONE; retry--)
         usleep(20000);
     return epocerr_to_errno(ret);
 }
 
-int rfsv_read(char *buf, long offset, long len, const char *name) {
-    u_int32_t ret = 0, r_offset, handle;
+/* The following functions must be called with the file's lock and
+   its session's lock held, see lock_file(). */
 
-    if (!a)
+/* Close the Psion handle of an open file. */
+static void release_handle(openFile *of) {
+    if (of->open) {
+	of->s->a->fclose(of->handle);
+	of->open = false;
+	of->s->lru.remove(of);
+    }
+}
+
+static int flush_file(openFile *of);
+
+/* Write back pending data and close the Psion handle of an open file. */
+static void drop_handle(openFile *of) {
+    flush_file(of);
+    release_handle(of);
+}
+
+/* Make sure, an open file has a Psion handle and mark it as used. */
+static int get_handle(openFile *of) {
+    session *s = of->s;
+    int ret;
+
+    if (!s->a)
 	return -ENODEV;
-    if ((ret = rfsv_open(name, O_RDONLY, &handle)))
-        return ret;
-    if (a->fseek(handle, offset, rfsv::PSI_SEEK_SET, r_offset) != rfsv::E_PSI_GEN_NONE ||
-        offset != r_offset ||
-        a->fread(handle, (unsigned char *)buf, len, ret) != rfsv::E_PSI_GEN_NONE)
-	ret = -1;
-    rfsv_fclose(handle);
-    return epocerr_to_errno(ret);
+    if (of->open) {
+	if (s->lru.front() != of) {
+	    s->lru.remove(of);
+	    s->lru.push_front(of);
+	}
+	return 0;
+    }
+    while (s->lru.size() >= MAX_PSION_HANDLES) {
+	/* Close the least recently used handle, whose file is not busy */
+	list<openFile *>::reverse_iterator i;
+	openFile *victim = NULL;
+
+	for (i = s->lru.rbegin(); i != s->lru.rend(); i++)
+	    if (pthread_mutex_trylock(&(*i)->lock) == 0) {
+		victim = *i;
+		break;
+	    }
+	if (!victim)
+	    break;
+	drop_handle(victim);
+	pthread_mutex_unlock(&victim->lock);
+    }
+    if ((ret = open_handle(s, of->name.c_str(), of->mode, &of->handle)))
+	return ret;
+    of->open = true;
+    of->pos = 0;
+    s->lru.push_front(of);
+    return 0;
 }
 
-int rfsv_write(const char *buf, long offset, long len, const char *name) {
-    u_int32_t ret = 0, r_offset, handle;
+/* Position the Psion handle, unless it is already there. */
+static int seek_handle(openFile *of, long offset) {
+    u_int32_t r_offset;
+
+    if (of->pos == (u_int32_t)offset)
+	return 0;
+    if (of->s->a->fseek(of->handle, offset, rfsv::PSI_SEEK_SET, r_offset) != rfsv::E_PSI_GEN_NONE ||
+	(u_int32_t)offset != r_offset) {
+	release_handle(of);
+	return -EIO;
+    }
+    of->pos = r_offset;
+    return 0;
+}
+
+/* Write to the Psion at the given offset */
+static long write_file(openFile *of, const char *buf, long offset, long len) {
+    u_int32_t count;
+    long ret;
 
-    if (!a)
+    if ((ret = get_handle(of)) || (ret = seek_handle(of, offset)))
+	return ret;
+    cache_invalidate(of->name.c_str());
+    if ((ret = of->s->a->fwrite(of->handle, (const unsigned char *)buf, len, count)) != rfsv::E_PSI_GEN_NONE) {
+	release_handle(of);
+	return epocerr_to_errno(ret);
+    }
+    of->pos += count;
+    return count;
+}
+
+/* Send held back data to the Psion */
+static int flush_file(openFile *of) {
+    long ret;
+
+    if (of->wlen == 0)
+	return 0;
+    ret = write_file(of, of->wbuf, of->woff, of->wlen);
+    __sync_fetch_and_sub(&dirtyBytes, of->wlen);
+    of->wlen = 0;
+    if (ret < 0) {
+	of->error = ret;
+	return ret;
+    }
+    return 0;
+}
+
+/* Read from the Psion into the readahead buffer */
+static long fill_buffer(openFile *of, long offset, long len) {
+    u_int32_t count;
+    long ret;
+
+    of->rlen = 0;
+    if (len > of->rsize) {
+	char *p = (char *)realloc(of->rbuf, len);
+	if (!p)
+	    return -ENOMEM;
+	of->rbuf = p;
+	of->rsize = len;
+    }
+    if ((ret = get_handle(of)) || (ret = seek_handle(of, offset)))
+	return ret;
+    if ((ret = of->s->a->fread(of->handle, (unsigned char *)of->rbuf, len, count)) != rfsv::E_PSI_GEN_NONE) {
+	release_handle(of);
+	return epocerr_to_errno(ret);
+    }
+    of->pos += count;
+    of->roff = offset;
+    of->rlen = count;
+    return count;
+}
+
+static void lock_file(openFile *of) {
+    pthread_mutex_lock(&of->lock);
+    pthread_mutex_lock(&of->s->lock);
+}
+
+static void unlock_file(openFile *of) {
+    pthread_mutex_unlock(&of->s->lock);
+    pthread_mutex_unlock(&of->lock);
+}
+
+/* Look up an open file by name and keep it from being freed,
+   until put_file() is called. */
+static openFile *find_file(const char *name) {
+    openFile *of = NULL;
+
+    pthread_mutex_lock(&filesLock);
+    map<string, openFile *>::iterator i = openFiles.find(name);
+    if (i != openFiles.end()) {
+	of = i->second;
+	of->refs++;
+    }
+    pthread_mutex_unlock(&filesLock);
+    return of;
+}
+
+/* Drop a reference to an open file and free it, if it was the last one. */
+static void put_file(openFile *of) {
+    bool last;
+
+    pthread_mutex_lock(&filesLock);
+    last = (--of->refs == 0);
+    if (last) {
+	openFiles.erase(of->name);
+	of->s->files--;
+    }
+    pthread_mutex_unlock(&filesLock);
+    if (!last)
+	return;
+    lock_file(of);
+    if (of->s->a)
+	drop_handle(of);
+    __sync_fetch_and_sub(&dirtyBytes, of->wlen);
+    unlock_file(of);
+    pthread_mutex_destroy(&of->lock);
+    free(of->rbuf);
+    free(of->wbuf);
+    delete of;
+}
+
+/* Write back pending data of all files. */
+static void flush_all(void) {
+    vector<openFile *> files;
+    map<string, openFile *>::iterator i;
+
+    pthread_mutex_lock(&filesLock);
+    for (i = openFiles.begin(); i != openFiles.end(); i++) {
+	i->second->refs++;
+	files.push_back(i->second);
+    }
+    pthread_mutex_unlock(&filesLock);
+    for (unsigned int n = 0; n < files.size(); n++) {
+	lock_file(files[n]);
+	flush_file(files[n]);
+	unlock_file(files[n]);
+	put_file(files[n]);
+    }
+}
+
+/* Write back pending data of a file, before its attributes are used. */
+static void flush_name(const char *name) {
+    openFile *of = find_file(name);
+
+    if (of) {
+	lock_file(of);
+	flush_file(of);
+	unlock_file(of);
+	put_file(of);
+    }
+}
+
+/* Close the Psion handle of a file, before it is changed by name. */
+static void close_handle(const char *name) {
+    openFile *of = find_file(name);
+
+    if (of) {
+	lock_file(of);
+	if (of->s->a)
+	    drop_handle(of);
+	unlock_file(of);
+	put_file(of);
+    }
+}
+
+int rfsv_fhopen(const char *name, long mode, uint64_t *fh) {
+    openFile *of;
+    int ret;
+
+    mode = (mode == O_RDONLY) ? O_RDONLY : O_RDWR;
+    pthread_mutex_lock(&filesLock);
+    map<string, openFile *>::iterator i = openFiles.find(name);
+    if (i != openFiles.end()) {
+	of = i->second;
+	of->refs++;
+    } else {
+	of = new openFile;
+	of->name = name;
+	of->mode = mode;
+	of->refs = 1;
+	pthread_mutex_init(&of->lock, NULL);
+	/* Use the session with the fewest open files */
+	of->s = &sessions[0];
+	for (int n = 1; n < numSessions; n++)
+	    if (sessions[n].files < of->s->files)
+		of->s = &sessions[n];
+	of->s->files++;
+	of->open = false;
+	of->rbuf = of->wbuf = NULL;
+	of->rsize = of->rlen = of->wlen = 0;
+	of->roff = of->woff = 0;
+	of->readahead = MIN_READAHEAD;
+	of->nextRead = -1;
+	of->error = 0;
+	openFiles[of->name] = of;
+    }
+    pthread_mutex_unlock(&filesLock);
+
+    lock_file(of);
+    if (of->mode != mode && mode == O_RDWR && of->s->a) {
+	drop_handle(of);
+	of->mode = mode;
+    }
+    ret = get_handle(of);
+    unlock_file(of);
+    if (ret) {
+	put_file(of);
+	return ret;
+    }
+    *fh = (uint64_t)of;
+    return 0;
+}
+
+int rfsv_fhrelease(uint64_t fh) {
+    put_file((openFile *)fh);
+    return 0;
+}
+
+int rfsv_fhflush(uint64_t fh) {
+    openFile *of = (openFile *)fh;
+    int ret = -ENODEV;
+
+    lock_file(of);
+    if (of->s->a) {
+	ret = flush_file(of);
+	if (ret == 0)
+	    ret = of->error;
+	of->error = 0;
+    }
+    unlock_file(of);
+    return ret;
+}
+
+int rfsv_fhread(uint64_t fh, char *buf, long offset, long len) {
+    openFile *of = (openFile *)fh;
+    long done = 0;
+    long ret;
+
+    lock_file(of);
+    if (!of->s->a) {
+	unlock_file(of);
 	return -ENODEV;
-    if ((ret = rfsv_open(name, O_RDWR, &handle)))
-        return ret;
-    if (a->fseek(handle, offset, rfsv::PSI_SEEK_SET, r_offset) != rfsv::E_PSI_GEN_NONE ||
-        offset != r_offset ||
-        a->fwrite(handle, (unsigned char *)buf, len, ret) != rfsv::E_PSI_GEN_NONE)
-	ret = -1;
-    rfsv_fclose(handle);
-    return epocerr_to_errno(ret);
+    }
+    /* Data just written must be read back */
+    if ((ret = flush_file(of))) {
+	unlock_file(of);
+	return ret;
+    }
+    if (offset == of->nextRead) {
+	if (of->readahead < MAX_READAHEAD)
+	    of->readahead *= 2;
+    } else
+	of->readahead = MIN_READAHEAD;
+    while (done < len) {
+	long o = offset + done;
+
+	if (o >= of->roff && o < of->roff + of->rlen) {
+	    long n = of->roff + of->rlen - o;
+
+	    if (n > len - done)
+		n = len - done;
+	    memcpy(buf + done, of->rbuf + (o - of->roff), n);
+	    done += n;
+	    continue;
+	}
+	ret = fill_buffer(of, o, (len - done > of->readahead) ? len - done : of->readahead);
+	if (ret < 0) {
+	    unlock_file(of);
+	    return done ? done : ret;
+	}
+	if (ret == 0)
+	    break;
+    }
+    of->nextRead = offset + done;
+    unlock_file(of);
+    return done;
 }
 
-int rfsv_setmtime(const char *name, long time) {
-    if (!a)
+int rfsv_fhwrite(uint64_t fh, const char *buf, long offset, long len) {
+    openFile *of = (openFile *)fh;
+    long ret = 0;
+
+    lock_file(of);
+    if (!of->s->a) {
+	unlock_file(of);
 	return -ENODEV;
-    return epocerr_to_errno(a->fsetmtime(name, PsiTime(time)));
+    }
+    cache_invalidate(of->name.c_str());
+    of->rlen = 0;
+    /* Only consecutive writes are collected */
+    if (of->wlen && (offset != of->woff + of->wlen || of->wlen + len > MAX_WRITEBEHIND))
+	ret = flush_file(of);
+    if (ret < 0)
+	len = ret;
+    else if (len >= MAX_WRITEBEHIND ||
+	(!of->wbuf && !(of->wbuf = (char *)malloc(MAX_WRITEBEHIND))))
+	len = write_file(of, buf, offset, len);
+    else {
+	if (of->wlen == 0)
+	    of->woff = offset;
+	memcpy(of->wbuf + of->wlen, buf, len);
+	of->wlen += len;
+	/* Keep the total below MAX_DIRTY by writing back right away */
+	if (__sync_add_and_fetch(&dirtyBytes, len) > MAX_DIRTY && flush_file(of))
+	    len = of->error;
+    }
+    unlock_file(of);
+    return len;
+}
+
+int rfsv_setmtime(const char *name, long time) {
+    session *s;
+    int ret = -ENODEV;
+
+    flush_name(name);
+    s = get_session();
+    if (s->a) {
+	cache_invalidate(name);
+	ret = epocerr_to_errno(s->a->fsetmtime(name, PsiTime(time)));
+    }
+    put_session(s);
+    return ret;
 }
 
 int rfsv_setsize(const char *name, long size) {
+    session *s;
     u_int32_t ph;
     long ret;
 
-    if (!a)
+    close_handle(name);
+    s = get_session();
+    if (!s->a) {
+	put_session(s);
 	return -ENODEV;
-    ret = a->fopen(a->opMode(rfsv::PSI_O_RDWR), name, ph);
+    }
+    cache_invalidate(name);
+    ret = s->a->fopen(s->a->opMode(rfsv::PSI_O_RDWR), name, ph);
     if (!ret) {
-	ret = a->fsetsize(ph, size);
-	a->fclose(ph);
+	ret = s->a->fsetsize(ph, size);
+	s->a->fclose(ph);
     }
+    put_session(s);
     return epocerr_to_errno(ret);
 }
 
 int rfsv_setattr(const char *name, long sattr, long dattr) {
-    if (!a)
-	return -ENODEV;
-    return epocerr_to_errno(a->fsetattr(name, sattr, dattr));
+    session *s;
+    int ret = -ENODEV;
+
+    flush_name(name);
+    s = get_session();
+    if (s->a) {
+	cache_invalidate(name);
+	ret = epocerr_to_errno(s->a->fsetattr(name, sattr, dattr));
+    }
+    put_session(s);
+    return ret;
 }
 
 int rfsv_getattr(const char *name, long *attr, long *size, long *time) {
+    session *s;
     long res;
     PlpDirent e;
+    string key = cache_key(name);
 
-    if (!a)
+    /* Sizes are only right after writing back */
+    if (dirtyBytes)
+	flush_name(name);
+    if (cache_getattr(key, attr, size, time))
+	return 0;
+    s = get_session();
+    if (!s->a) {
+	put_session(s);
 	return -ENODEV;
-    res = a->fgeteattr(name, e);
+    }
+    res = s->a->fgeteattr(name, e);
+    put_session(s);
     *attr = e.getAttr();
     *size = e.getSize();
     *time = e.getPsiTime().getTime();
+    if (res == rfsv::E_PSI_GEN_NONE)
+	cache_putattr(key, *attr, *size, *time);
     return epocerr_to_errno(res);
 }
 
-int rfsv_rename(const char *oldname, const char *newname) {
-    if (!a)
+static int copy_progress(void *ptr, u_int32_t total) {
+    debuglog("copy `%s': %lu bytes", (const char *)ptr, (unsigned long)total);
+    return 1;
+}
+
+/* Copy a file on the Psion, without its contents crossing the link. */
+int rfsv_copy(const char *from, const char *to) {
+    session *s;
+    long ret;
+
+    /* EPOC refuses to copy a file, which is open for writing */
+    close_handle(from);
+    close_handle(to);
+    s = get_session();
+    if (!s->a) {
+	put_session(s);
 	return -ENODEV;
-    return epocerr_to_errno(a->rename(oldname, newname));
+    }
+    cache_invalidate(to);
+    ret = s->a->copyOnPsion(from, to, (void *)to, copy_progress);
+    put_session(s);
+    return epocerr_to_errno(ret);
+}
+
+int rfsv_rename(const char *oldname, const char *newname) {
+    session *s;
+    openFile *of;
+    int ret;
+
+    if (toupper(oldname[0]) != toupper(newname[0])) {
+	/* EPOC can't rename across drives, so files are copied instead */
+	long attr, size, time;
+
+	if ((ret = rfsv_getattr(oldname, &attr, &size, &time)))
+	    return ret;
+	if (attr & PSI_A_DIR)
+	    return -EXDEV;
+	if ((ret = rfsv_copy(oldname, newname)) == 0)
+	    ret = rfsv_remove(oldname);
+    } else {
+	close_handle(oldname);
+	close_handle(newname);
+	s = get_session();
+	if (!s->a) {
+	    put_session(s);
+	    return -ENODEV;
+	}
+	cache_invalidate(oldname);
+	cache_invalidate(newname);
+	ret = epocerr_to_errno(s->a->rename(oldname, newname));
+	put_session(s);
+    }
+    if (ret == 0 && (of = find_file(oldname))) {
+	/* Reopen files under their new name */
+	pthread_mutex_lock(&of->lock);
+	pthread_mutex_lock(&filesLock);
+	map<string, openFile *>::iterator i = openFiles.find(oldname);
+	if (i != openFiles.end() && i->second == of &&
+	    openFiles.find(newname) == openFiles.end()) {
+	    openFiles.erase(i);
+	    of->name = newname;
+	    openFiles[of->name] = of;
+	}
+	pthread_mutex_unlock(&filesLock);
+	pthread_mutex_unlock(&of->lock);
+	put_file(of);
+    }
+    return ret;
 }
 
 int rfsv_drivelist(int *cnt, device **dlist) {
@@ -310,9 +1030,13 @@ int rfsv_drivelist(int *cnt, device **dlist) {
     u_int32_t devbits;
     long ret;
     int i;
+    session *s = get_session();
+    rfsv *a = s->a;
 
-    if (!a)
+    if (!a) {
+	put_session(s);
 	return -ENODEV;
+    }
     ret = a->devlist(devbits);
     if (ret == 0)
 	for (i = 0; i < 26; i++) {
@@ -333,6 +1057,7 @@ int rfsv_drivelist(int *cnt, device **dlist) {
 	    }
 	    devbits >>= 1;
 	}
+    put_session(s);
     return epocerr_to_errno(ret);
 }
 
@@ -350,7 +1075,14 @@ help()
 	"    -p, --port=[HOST:]PORT  Connect to port PORT on host HOST\n"
 	"                            Default for HOST is 127.0.0.1\n"
 	"                            Default for PORT is "
-	) << DPORT << "\n\n";
+	) << DPORT << "\n" << _(
+	"    -c, --cache=SECS        Cache attributes and directories for SECS\n"
+	"                            seconds, 0 disables caching. Default is "
+	) << cache_timeout << "\n" << _(
+	"    -n, --sessions=N        Use N parallel connections to ncpd, at most "
+	) << MAX_SESSIONS << "\n" << _(
+	"                            Default is "
+	) << numSessions << "\n\n";
 }
 
 static struct option opts[] = {
@@ -358,6 +1090,8 @@ static struct option opts[] = {
     {"debug",      no_argument,       0, 'd'},
     {"version",    no_argument,       0, 'V'},
     {"port",       required_argument, 0, 'p'},
+    {"cache",      required_argument, 0, 'c'},
+    {"sessions",   required_argument, 0, 'n'},
     {NULL,       0,                 0,  0 }
 };
 
@@ -395,14 +1129,21 @@ int fuse(int argc, char *argv[])
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     struct fuse_chan *ch;
     char *mountpoint;
-    int err = -1, foreground;
+    int err = -1, multithreaded, foreground;
 
-    if (fuse_parse_cmdline(&args, &mountpoint, NULL, &foreground) != -1 &&
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1 &&
         (ch = fuse_mount(mountpoint, &args)) != NULL) {
         if (fuse_daemonize(foreground) != -1) {
-            struct fuse *fp = fuse_new(ch, &args, &plp_oper, sizeof(plp_oper), NULL);
-            if (fp != NULL)
-                err = fuse_loop(fp);
+            struct fuse_session *se = fuse_lowlevel_new(&args, &plp_oper, sizeof(plp_oper), NULL);
+            if (se != NULL) {
+                if (fuse_set_signal_handlers(se) != -1) {
+                    fuse_session_add_chan(se, ch);
+                    err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                    fuse_remove_signal_handlers(se);
+                    fuse_session_remove_chan(ch);
+                }
+                fuse_session_destroy(se);
+            }
         }
         fuse_unmount(mountpoint, ch);
     }
@@ -411,10 +1152,28 @@ int fuse(int argc, char *argv[])
     return err ? 1 : 0;
 }
 
+/* Remove the option just parsed by getopt_long and its argument from argv */
+static void
+remove_option(int &argc, char **argv)
+{
+    int first = optind - 1, n = 1;
+
+    if (argv[first] == optarg && first > 0) {
+        /* Argument given separately */
+        first--;
+        n = 2;
+    }
+    argc -= n;
+    for (int i = first; i < argc; i++)
+        argv[i] = argv[i + n];
+    argv[argc] = NULL;
+    optind -= n;
+}
+
 int main(int argc, char**argv) {
-    ppsocket *skt, *skt2;
+    ppsocket *skt;
     const char *host = "127.0.0.1";
-    int sockNum = DPORT, i, c, oldoptind = 1;
+    int sockNum = DPORT, c;
 
     struct servent *se = getservbyname("psion", "tcp");
     endservent();
@@ -422,12 +1181,12 @@ int main(int argc, char**argv) {
 	sockNum = ntohs(se->s_port);
 
     /* N.B. Option handling is kludged. Most of the options are shared
-       with FUSE, except for -p/--port, which has to be removed from
+       with FUSE, except for -p/--port, -c/--cache and -n/--sessions, which have to be removed from
        argv so that FUSE doesn't see it. Hence, we don't complain
        about unknown options, but leave that to FUSE, and similarly we
        don't quit after issuing a version or help message. */
     opterr = 0; // Suppress errors from unknown options
-    while ((c = getopt_long(argc, argv, "hVp:d", opts, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "hVp:c:n:d", opts, NULL)) != -1) {
 	switch (c) {
         case 'V':
             cerr << _("plpfuse version ") << VERSION << endl;
@@ -440,31 +1199,48 @@ int main(int argc, char**argv) {
             break;
         case 'p':
             parse_destination(optarg, &host, &sockNum);
-            argc -= optind - oldoptind;
-            for (i = oldoptind; i < argc; i++)
-              argv[i] = argv[i + (optind - oldoptind)];
+            remove_option(argc, argv);
+            break;
+        case 'c':
+            cache_timeout = atol(optarg);
+            if (cache_timeout < 0)
+              cache_timeout = 0;
+            remove_option(argc, argv);
+            break;
+        case 'n':
+            numSessions = atoi(optarg);
+            if (numSessions < 1)
+              numSessions = 1;
+            if (numSessions > MAX_SESSIONS)
+              numSessions = MAX_SESSIONS;
+            remove_option(argc, argv);
             break;
 	}
         if (optind >= argc)
             break;
     }
 
+    /* Each session gets its own connection, hence its own rfsv channel */
+    for (int i = 0; i < numSessions; i++) {
+        skt = new ppsocket();
+        if (!skt->connect(host, sockNum)) {
+            cerr << _("plpfuse: could not connect to ncpd") << endl;
+            return 1;
+        }
+        pthread_mutex_init(&sessions[i].lock, NULL);
+        sessions[i].factory = new rfsvfactory(skt);
+        sessions[i].a = sessions[i].factory->create(true);
+        sessions[i].files = 0;
+    }
     skt = new ppsocket();
     if (!skt->connect(host, sockNum)) {
-        cerr << _("plpfuse: could not connect to ncpd") << endl;
-	return 1;
-    }
-    skt2 = new ppsocket();
-    if (!skt2->connect(host, sockNum)) {
         cerr << _("plpfuse: could not connect to ncpd") << endl;
         return 1;
     }
 
-    rf = new rfsvfactory(skt);
-    rp = new rpcsfactory(skt2);
-    a = rf->create(true);
+    rp = new rpcsfactory(skt);
     r = rp->create(true);
-    if (a != NULL && r != NULL)
+    if (sessions[0].a != NULL && r != NULL)
         debuglog("plpfuse: connected");
     else
         debuglog("plpfuse: could not create rfsv or rpcs object, connect delayed");
@@ -5,11 +5,13 @@
 #ifndef _plpfuse_h_
 #define _plpfuse_h_
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 
 typedef struct p_inode {
-	int inode;
+	fuse_ino_t inode;
 	char *name;
+	unsigned long nlookup;	/* Lookups, not yet forgotten by the kernel */
+	int unlinked;		/* Not in the name hash any more */
 	struct p_inode *nextnam, *nextnum;
 } p_inode;
 
@@ -39,6 +41,7 @@ typedef struct p_dentry
 } dentry;
 
 extern int debug;
+extern long cache_timeout;
 
 extern int debuglog(char *fmt, ...);
 extern int errorlog(char *fmt, ...);
@@ -49,4 +52,4 @@ extern int infolog(char *fmt, ...);
 
 #endif
 
-extern struct fuse_operations plp_oper;
+extern struct fuse_lowlevel_ops plp_oper;
@@ -35,17 +35,19 @@ extern int rfsv_mkdir(const char *name);
 extern int rfsv_rmdir(const char *name);
 extern int rfsv_remove(const char *name);
 extern int rfsv_rename(const char *oldname, const char *newname);
-extern int rfsv_open(const char *name, long mode, u_int32_t *handle);
-extern int rfsv_fclose(long handle);
-extern int rfsv_fcreate(long attr, const char *name, u_int32_t *handle);
-extern int rfsv_read(char *buf, long offset, long len, const char *name);
-extern int rfsv_write(const char *buf, long offset, long len, const char *name);
+extern int rfsv_copy(const char *from, const char *to);
+extern int rfsv_fcreate(long attr, const char *name);
+extern int rfsv_fhopen(const char *name, long mode, uint64_t *fh);
+extern int rfsv_fhread(uint64_t fh, char *buf, long offset, long len);
+extern int rfsv_fhwrite(uint64_t fh, const char *buf, long offset, long len);
+extern int rfsv_fhflush(uint64_t fh);
+extern int rfsv_fhrelease(uint64_t fh);
 extern int rfsv_getattr(const char *name, long *attr, long *size, long *time);
 extern int rfsv_setattr(const char *name, long sattr, long dattr);
 extern int rfsv_setsize(const char *name, long size);
 extern int rfsv_setmtime(const char *name, long time);
 extern int rfsv_drivelist(int *cnt, device **devlist);
-extern int rfsv_dircount(const char *name, long *count);
+extern int rfsv_subdircount(const char *name, long *count);
 extern int rfsv_isalive(void);
 
 /* File attributes, C-style */
@@ -0,0 +1,314 @@
+/*-*-c++-*-
+ * $Id$
+ *
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <iostream>
+#include <cstring>
+#include <cmath>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+
+#include "line.h"
+
+/**
+ * Bytes, which may be waiting for the simulated Psion to read them,
+ * before ncpd is blocked. Roughly the buffers of a UART and its driver.
+ */
+#define SIM_RX_BUFFER 4096
+
+/**
+ * Bytes are put on the wire in slices of at most this many
+ * microseconds, each of which arrives at its own time.
+ */
+#define SIM_SLICE_TIME 1000
+
+using namespace std;
+
+u_int64_t
+simClock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+simLine::simLine(int _baud, unsigned long _latency, double _ber, long seed)
+    : baud(_baud)
+    , latency(_latency)
+    , ber(_ber)
+    , fd(-1)
+    , slaveFd(-1)
+    , txBusy(0)
+    , rxBusy(0)
+    , rxQueued(0)
+    , txOffset(0)
+{
+    rand48[0] = 0x330e;
+    rand48[1] = seed & 0xffff;
+    rand48[2] = (seed >> 16) & 0xffff;
+    errorGap = nextError();
+    txStats.bytes = rxStats.bytes = 0;
+    txStats.errors = rxStats.errors = 0;
+}
+
+simLine::~simLine()
+{
+    if (!linkName.empty())
+	unlink(linkName.c_str());
+    if (slaveFd != -1)
+	close(slaveFd);
+    if (fd != -1)
+	close(fd);
+}
+
+bool simLine::
+open(const char *link)
+{
+    fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd == -1) {
+	perror("posix_openpt");
+	return false;
+    }
+    if ((grantpt(fd) != 0) || (unlockpt(fd) != 0)) {
+	perror("grantpt");
+	return false;
+    }
+    slaveName = ptsname(fd);
+
+    // Keep the slave open ourselves, so that the master does not
+    // see a hangup, while ncpd closes and reopens the device.
+    slaveFd = ::open(slaveName.c_str(), O_RDWR | O_NOCTTY);
+    if (slaveFd == -1) {
+	perror(slaveName.c_str());
+	return false;
+    }
+    struct termios ti;
+    tcgetattr(slaveFd, &ti);
+    cfmakeraw(&ti);
+    tcsetattr(slaveFd, TCSANOW, &ti);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    if (link) {
+	unlink(link);
+	if (symlink(slaveName.c_str(), link) != 0) {
+	    perror(link);
+	    return false;
+	}
+	linkName = link;
+    }
+    return true;
+}
+
+const char *simLine::
+getName()
+{
+    return slaveName.c_str();
+}
+
+int simLine::
+getFd()
+{
+    return fd;
+}
+
+/**
+ * Returns the number of error free bits until the next bit error.
+ * The gaps between errors are geometrically distributed.
+ */
+long simLine::
+nextError()
+{
+    if (ber <= 0)
+	return -1;
+    double u = erand48(rand48);
+    if (u <= 0)
+	u = 1e-12;
+    double gap = floor(log(u) / log(1.0 - ber));
+    return (gap > 1e15) ? -1 : (long)gap;
+}
+
+/**
+ * Flips bits in a chunk of data on the wire.
+ */
+void simLine::
+corrupt(bufferStore &b, simLineStats &st)
+{
+    long bits = b.getLen() * 8;
+    long pos = 0;
+
+    if (errorGap < 0)
+	return;
+    unsigned char *p = (unsigned char *)b.getString(0);
+    while (pos + errorGap < bits) {
+	pos += errorGap;
+	p[pos / 8] ^= (1 << (pos % 8));
+	st.errors++;
+	pos++;
+	errorGap = nextError();
+	if (errorGap < 0)
+	    return;
+    }
+    errorGap -= (bits - pos);
+}
+
+/**
+ * Puts a chunk on one direction of the wire and returns the time,
+ * at which its last byte arrives at the other end. The chunk is
+ * split into slices, so that the first bytes of a large write (e.g.
+ * a whole window of frames) arrive, while the rest is still being
+ * sent, like on a real serial line.
+ */
+u_int64_t simLine::
+transit(deque<chunk> &q, u_int64_t &busy, bufferStore &b, u_int64_t now, simLineStats &st)
+{
+    chunk c;
+    u_int64_t start = (busy > now) ? busy : now;
+    long len = b.getLen();
+    long slice = len;
+
+    corrupt(b, st);
+    st.bytes += len;
+    if (baud > 0) {
+	slice = (long)baud * SIM_SLICE_TIME / 10000000;
+	if (slice < 1)
+	    slice = 1;
+    }
+    c.due = start + latency;
+    for (long off = 0; off < len; off += slice) {
+	long n = (len - off < slice) ? len - off : slice;
+	if (baud > 0)
+	    busy = start + (u_int64_t)(off + n) * 10000000 / baud;
+	else
+	    busy = start;
+	c.due = busy + latency;
+	c.data = bufferStore(b, off, n);
+	q.push_back(c);
+    }
+    return c.due;
+}
+
+void simLine::
+send(const bufferStore &b)
+{
+    bufferStore tmp;
+
+    // A private copy, since the wire may scribble on it.
+    memcpy(tmp.extend(b.getLen()), b.getString(0), b.getLen());
+    transit(txQueue, txBusy, tmp, simClock(), txStats);
+}
+
+short simLine::
+pollEvents(u_int64_t now)
+{
+    short ev = 0;
+
+    if (rxQueued < SIM_RX_BUFFER)
+	ev |= POLLIN;
+    if (!txQueue.empty() && (txQueue.front().due <= now))
+	ev |= POLLOUT;
+    return ev;
+}
+
+void simLine::
+service(short revents, u_int64_t now)
+{
+    if (revents & POLLIN) {
+	unsigned char buf[SIM_RX_BUFFER];
+	int n = read(fd, buf, SIM_RX_BUFFER - rxQueued);
+	if (n > 0) {
+	    bufferStore b(buf, n);
+	    rxQueued += n;
+	    transit(rxQueue, rxBusy, b, now, rxStats);
+	}
+    }
+    while (!txQueue.empty() && (txQueue.front().due <= now)) {
+	chunk &c = txQueue.front();
+	long len = c.data.getLen() - txOffset;
+	int n = write(fd, c.data.getString(txOffset), len);
+	if (n < 0) {
+	    if ((errno == EAGAIN) || (errno == EINTR))
+		break;
+	    // Nobody listening: The bytes are lost on the wire.
+	    n = len;
+	}
+	if (n < len) {
+	    txOffset += n;
+	    break;
+	}
+	txOffset = 0;
+	txQueue.pop_front();
+    }
+}
+
+bool simLine::
+receive(bufferStore &b, u_int64_t now)
+{
+    bool got = false;
+
+    while (!rxQueue.empty() && (rxQueue.front().due <= now)) {
+	b.addBuff(rxQueue.front().data);
+	rxQueued -= rxQueue.front().data.getLen();
+	rxQueue.pop_front();
+	got = true;
+    }
+    return got;
+}
+
+u_int64_t simLine::
+nextDeadline()
+{
+    u_int64_t d = 0;
+
+    if (!txQueue.empty())
+	d = txQueue.front().due;
+    if (!rxQueue.empty() && ((d == 0) || (rxQueue.front().due < d)))
+	d = rxQueue.front().due;
+    return d;
+}
+
+bool simLine::
+txIdle()
+{
+    return txQueue.empty();
+}
+
+void simLine::
+getStats(simLineStats &tx, simLineStats &rx)
+{
+    tx = txStats;
+    rx = rxStats;
+}
+
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * End:
+ */
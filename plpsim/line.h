@@ -0,0 +1,172 @@
+/*-*-c++-*-
+ * $Id$
+ *
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+#ifndef _SIM_LINE_H_
+#define _SIM_LINE_H_
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string>
+#include <deque>
+
+#include <bufferstore.h>
+#include <plp_inttypes.h>
+
+/**
+ * Returns the current time of the monotonic clock in microseconds.
+ */
+u_int64_t simClock();
+
+/**
+ * Statistics of a @ref simLine , one set per direction.
+ */
+struct simLineStats {
+    /**
+     * Number of bytes, which have passed the line.
+     */
+    unsigned long long bytes;
+    /**
+     * Number of bits, which have been flipped on the line.
+     */
+    unsigned long errors;
+};
+
+/**
+ * The simulated serial line between ncpd and the simulated Psion.
+ *
+ * The line is a pseudo terminal. ncpd opens its slave side like a
+ * serial device, the simulator talks to the master side. Both
+ * directions are modelled as a wire of a given speed (10 bit times
+ * per byte, like 8N1) and latency, which may flip bits at a given
+ * bit error rate. Bytes are handed on, when they would have arrived
+ * at the other end of a real line.
+ */
+class simLine {
+public:
+    /**
+     * Constructs a new line.
+     *
+     * @param baud The line rate in bits per second, 0 for unlimited.
+     * @param latency The one way latency in microseconds.
+     * @param ber The bit error rate (probability of any single bit
+     *  being flipped).
+     * @param seed The seed of the error generator, so that runs
+     *  can be reproduced.
+     */
+    simLine(int baud, unsigned long latency, double ber, long seed);
+    ~simLine();
+
+    /**
+     * Creates the pseudo terminal.
+     *
+     * @param link If not NULL, a symbolic link with this name is
+     *  created, which points to the slave device.
+     *
+     * @returns true on success.
+     */
+    bool open(const char *link);
+
+    /**
+     * Returns the name of the slave device, which ncpd has to use.
+     */
+    const char *getName();
+
+    /**
+     * Returns the file descriptor of the master side.
+     */
+    int getFd();
+
+    /**
+     * Puts bytes on the line towards ncpd.
+     */
+    void send(const bufferStore &b);
+
+    /**
+     * Returns the events, the master side has to be polled for.
+     */
+    short pollEvents(u_int64_t now);
+
+    /**
+     * Reads from and writes to the master side, according
+     * to the events returned by poll().
+     */
+    void service(short revents, u_int64_t now);
+
+    /**
+     * Fetches the bytes from ncpd, which have arrived at
+     * the Psion's end of the line by now.
+     *
+     * @returns true, if any bytes have been appended to @p b .
+     */
+    bool receive(bufferStore &b, u_int64_t now);
+
+    /**
+     * Returns the time, at which bytes next arrive at either end,
+     * or 0 if the line is idle.
+     */
+    u_int64_t nextDeadline();
+
+    /**
+     * Returns true, if nothing is travelling towards ncpd.
+     */
+    bool txIdle();
+
+    void getStats(simLineStats &tx, simLineStats &rx);
+
+private:
+    struct chunk {
+	u_int64_t due;
+	bufferStore data;
+    };
+
+    u_int64_t transit(std::deque<chunk> &q, u_int64_t &busy, bufferStore &b, u_int64_t now, simLineStats &st);
+    void corrupt(bufferStore &b, simLineStats &st);
+    long nextError();
+
+    int baud;
+    unsigned long latency;
+    double ber;
+    long errorGap;
+    unsigned short rand48[3];
+
+    int fd;
+    int slaveFd;
+    std::string slaveName;
+    std::string linkName;
+
+    std::deque<chunk> txQueue;
+    std::deque<chunk> rxQueue;
+    u_int64_t txBusy;
+    u_int64_t rxBusy;
+    long rxQueued;
+    long txOffset;
+    simLineStats txStats;
+    simLineStats rxStats;
+};
+
+#endif
+
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * End:
+ */
@@ -0,0 +1,278 @@
+/*-*-c++-*-
+ * $Id$
+ *
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string>
+#include <cstring>
+#include <iostream>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <plpintl.h>
+
+#include "line.h"
+#include "peer.h"
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <getopt.h>
+
+using namespace std;
+
+static volatile bool active = true;
+
+static RETSIGTYPE
+term_handler(int)
+{
+    active = false;
+}
+
+static void
+help()
+{
+    cout << _(
+	"Usage: plpsim [OPTIONS]...\n"
+	"\n"
+	"Simulates a Psion on a pseudo terminal, to which ncpd can connect\n"
+	"with its -s option. The name of the terminal is printed on startup.\n"
+	"\n"
+	"Supported options:\n"
+	"\n"
+	" -h, --help              Display this text.\n"
+	" -V, --version           Print version and exit.\n"
+	" -3, --sibo              Simulate a SIBO (Series 3) machine.\n"
+	"                         Default: EPOC (Series 5).\n"
+	" -r, --root=[X=]DIR      Serve drive X: (default C:) from directory DIR.\n"
+	"                         May be given once per drive. Default: C=.\n"
+	" -L, --link=NAME         Create a symlink NAME to the pseudo terminal.\n"
+	" -b, --baudrate=RATE     Simulated line rate. Default: 115200,\n"
+	"                         0 for unlimited.\n"
+	" -l, --latency=MS        One way latency of the line. Default: 0.\n"
+	" -e, --errors=BER        Bit error rate of the line. Default: 0.\n"
+	" -S, --seed=N            Seed of the error generator. Default: 1.\n"
+	" -t, --timeout=MS        Retransmission timeout. Default: 1000.\n"
+	" -x, --service=MS        Time, the Psion takes to process a request.\n"
+	"                         Sends XOFF, while requests pile up.\n"
+	"                         Default: 0.\n"
+	" -m, --maxframe=BYTES    Drop frames from ncpd, which are longer\n"
+	"                         than BYTES. Default: 0 (no limit).\n"
+	" -v, --verbose=CLASS     Log CLASS events to stderr. Valid classes\n"
+	"                         are ll (link), nl (NCP), ld (data dump)\n"
+	"                         and all.\n"
+	"\n"
+	"Statistics are printed to stderr on exit (SIGINT or SIGTERM).\n"
+	);
+}
+
+static void
+usage() {
+    cerr << _("Try `plpsim --help' for more information") << endl;
+}
+
+static struct option opts[] = {
+    {"help",       no_argument,       0, 'h'},
+    {"version",    no_argument,       0, 'V'},
+    {"sibo",       no_argument,       0, '3'},
+    {"root",       required_argument, 0, 'r'},
+    {"link",       required_argument, 0, 'L'},
+    {"baudrate",   required_argument, 0, 'b'},
+    {"latency",    required_argument, 0, 'l'},
+    {"errors",     required_argument, 0, 'e'},
+    {"seed",       required_argument, 0, 'S'},
+    {"timeout",    required_argument, 0, 't'},
+    {"service",    required_argument, 0, 'x'},
+    {"maxframe",   required_argument, 0, 'm'},
+    {"verbose",    required_argument, 0, 'v'},
+    {NULL,         0,                 0,  0 }
+};
+
+static void
+printStats(simLine &line, simPeer &peer)
+{
+    simLineStats tx, rx;
+    simPeerStats ps;
+
+    line.getStats(tx, rx);
+    peer.getStats(ps);
+    cerr << "line: " << rx.bytes << " bytes from ncpd, "
+	 << tx.bytes << " bytes to ncpd, "
+	 << rx.errors + tx.errors << " bits flipped" << endl;
+    cerr << "from ncpd: " << ps.rxData << " data frames ("
+	 << ps.rxDataBytes << " bytes, " << ps.rxPayload << " payload), "
+	 << ps.rxAcks << " acks (" << ps.rxAckBytes << " bytes), "
+	 << ps.rxCtl << " link control (" << ps.rxCtlBytes << " bytes), "
+	 << ps.rxDups << " duplicates, " << ps.rxBadCrc << " CRC errors, "
+	 << ps.rxTooLong << " too long" << endl;
+    cerr << "to ncpd: " << ps.txData << " data frames ("
+	 << ps.txPayload << " payload), " << ps.txAcks << " acks, "
+	 << ps.txRetransmits << " retransmissions, "
+	 << ps.txXoff << " XOFF" << endl;
+}
+
+int
+main(int argc, char **argv)
+{
+    string roots[26];
+    const char *link = NULL;
+    bool epoc = true;
+    int baud = 115200;
+    unsigned long latency = 0;
+    unsigned long rto = 1000;
+    unsigned long service = 0;
+    long maxFrame = 0;
+    double ber = 0;
+    long seed = 1;
+    unsigned short verbose = 0;
+
+    while (1) {
+	int c = getopt_long(argc, argv, "hV3r:L:b:l:e:S:t:x:m:v:", opts, NULL);
+	if (c == -1)
+	    break;
+	switch (c) {
+	    case '?':
+		usage();
+		return -1;
+	    case 'V':
+		cout << _("plpsim Version ") << VERSION << endl;
+		return 0;
+	    case 'h':
+		help();
+		return 0;
+	    case '3':
+		epoc = false;
+		break;
+	    case 'r':
+		if (isalpha(optarg[0]) && (optarg[1] == '='))
+		    roots[toupper(optarg[0]) - 'A'] = optarg + 2;
+		else
+		    roots['C' - 'A'] = optarg;
+		break;
+	    case 'L':
+		link = optarg;
+		break;
+	    case 'b':
+		baud = atoi(optarg);
+		break;
+	    case 'l':
+		latency = atol(optarg);
+		break;
+	    case 'e':
+		ber = atof(optarg);
+		break;
+	    case 'S':
+		seed = atol(optarg);
+		break;
+	    case 't':
+		rto = atol(optarg);
+		break;
+	    case 'x':
+		service = atol(optarg);
+		break;
+	    case 'm':
+		maxFrame = atol(optarg);
+		break;
+	    case 'v':
+		if (!strcmp(optarg, "ll"))
+		    verbose |= SIM_DEBUG_LINK;
+		if (!strcmp(optarg, "nl"))
+		    verbose |= SIM_DEBUG_NCP;
+		if (!strcmp(optarg, "ld"))
+		    verbose |= SIM_DEBUG_DUMP;
+		if (!strcmp(optarg, "all"))
+		    verbose = SIM_DEBUG_LINK | SIM_DEBUG_NCP | SIM_DEBUG_DUMP;
+		break;
+	}
+    }
+    if ((optind < argc) || (baud < 0) || (ber < 0) || (ber >= 1) ||
+	(rto == 0) || (maxFrame < 0)) {
+	usage();
+	return -1;
+    }
+    int ndrives = 0;
+    for (int i = 0; i < 26; i++) {
+	struct stat st;
+	if (roots[i].empty())
+	    continue;
+	if ((stat(roots[i].c_str(), &st) != 0) || !S_ISDIR(st.st_mode)) {
+	    cerr << roots[i] << _(": not a directory") << endl;
+	    return 1;
+	}
+	ndrives++;
+    }
+    if (ndrives == 0)
+	roots['C' - 'A'] = ".";
+
+    simLine line(baud, latency * 1000, ber, seed);
+    if (!line.open(link))
+	return 1;
+    simPeer peer(&line, epoc, roots, rto * 1000, service * 1000, maxFrame,
+		 verbose);
+
+    signal(SIGTERM, term_handler);
+    signal(SIGINT, term_handler);
+    signal(SIGPIPE, SIG_IGN);
+    cout << line.getName() << endl;
+
+    while (active) {
+	u_int64_t now = simClock();
+	struct pollfd pfd;
+	int timeout = -1;
+
+	u_int64_t d = line.nextDeadline();
+	u_int64_t pd = peer.nextDeadline();
+	if (pd && (!d || (pd < d)))
+	    d = pd;
+	if (d)
+	    timeout = (d > now) ? (d - now + 999) / 1000 : 0;
+	pfd.fd = line.getFd();
+	pfd.events = line.pollEvents(now);
+	pfd.revents = 0;
+	if ((poll(&pfd, 1, timeout) < 0) && (errno != EINTR)) {
+	    perror("poll");
+	    break;
+	}
+	now = simClock();
+	line.service(pfd.revents, now);
+
+	bufferStore b;
+	if (line.receive(b, now))
+	    peer.receive(b, now);
+	peer.expire(now);
+	// Send, what the peer has just produced, if it is due already.
+	line.service(0, simClock());
+    }
+    printStats(line, peer);
+    return 0;
+}
+
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * End:
+ */
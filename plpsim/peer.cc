@@ -0,0 +1,745 @@
+/*-*-c++-*-
+ * $Id$
+ *
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <iostream>
+#include <cstring>
+
+#include <stdlib.h>
+#include <time.h>
+
+#include <rfsv.h>
+
+#include "peer.h"
+#include "line.h"
+#include "rfsvserver.h"
+
+using namespace std;
+
+/**
+ * Inter controller message types of the NCP, see ncpd/ncp.h
+ */
+enum {
+    NCON_MSG_DATA_XOFF = 1,
+    NCON_MSG_DATA_XON = 2,
+    NCON_MSG_CONNECT_TO_SERVER = 3,
+    NCON_MSG_CONNECT_RESPONSE = 4,
+    NCON_MSG_CHANNEL_CLOSED = 5,
+    NCON_MSG_NCP_INFO = 6,
+    NCON_MSG_CHANNEL_DISCONNECT = 7,
+    NCON_MSG_NCP_END = 8
+};
+
+enum { LAST_MESS = 1, NOT_LAST_MESS = 2 };
+
+// States of the PLP frame receiver
+enum { RX_SYN, RX_DLE, RX_STX, RX_DATA, RX_CRC1, RX_CRC2 };
+
+simPeer::simPeer(simLine *_line, bool _epoc, const string *_roots,
+		 unsigned long _rto, unsigned long _service,
+		 unsigned long _maxFrame,
+		 unsigned short _verbose)
+    : line(_line)
+    , epoc(_epoc)
+    , roots(_roots)
+    , verbose(_verbose)
+    , rxState(RX_SYN)
+    , esc(false)
+    , rto(_rto)
+    , service(_service)
+    , maxFrame(_maxFrame)
+    , linkChan(0)
+{
+    crcTable[0] = 0;
+    for (int i = 0; i < 128; i++) {
+	unsigned int carry = crcTable[i] & 0x8000;
+	unsigned int tmp = (crcTable[i] << 1) & 0xffff;
+	crcTable[i * 2 + (carry ? 0 : 1)] = tmp ^ 0x1021;
+	crcTable[i * 2 + (carry ? 1 : 0)] = tmp;
+    }
+    for (int i = 0; i < 256; i++) {
+	channels[i].type = CH_FREE;
+	channels[i].server = NULL;
+	channels[i].xoff = false;
+    }
+    memset(&stats, 0, sizeof(stats));
+    linkReset();
+}
+
+simPeer::~simPeer()
+{
+    ncpReset();
+}
+
+void simPeer::
+getStats(simPeerStats &s)
+{
+    s = stats;
+}
+
+bool simPeer::
+isConnected()
+{
+    return ncpUp;
+}
+
+inline void simPeer::
+addToCrc(unsigned char c, unsigned short *crc)
+{
+    *crc = (*crc << 8) ^ crcTable[((*crc >> 8) ^ c) & 0xff];
+}
+
+/**
+ * Frames a PLP packet and puts it on the line.
+ */
+void simPeer::
+sendPacket(const bufferStore &b)
+{
+    long len = b.getLen();
+    const unsigned char *p = (const unsigned char *)b.getString(0);
+    unsigned short crc = 0;
+    bufferStore f;
+
+    f.addByte(0x16);
+    f.addByte(0x10);
+    f.addByte(0x02);
+    for (long i = 0; i < len; i++) {
+	unsigned char c = p[i];
+	addToCrc(c, &crc);
+	if (c == 0x10) {
+	    f.addByte(0x10);
+	    f.addByte(0x10);
+	} else if (epoc && (c == 0x03)) {
+	    f.addByte(0x10);
+	    f.addByte(0x04);
+	} else
+	    f.addByte(c);
+    }
+    f.addByte(0x10);
+    f.addByte(0x03);
+    f.addByte(crc >> 8);
+    f.addByte(crc & 0xff);
+    line->send(f);
+}
+
+void simPeer::
+receive(const bufferStore &b, u_int64_t now)
+{
+    const unsigned char *p = (const unsigned char *)b.getString(0);
+    long len = b.getLen();
+
+    for (long i = 0; i < len; i++)
+	decode(p[i], now);
+}
+
+/**
+ * Runs the PLP frame receiver on a single byte.
+ */
+void simPeer::
+decode(unsigned char c, u_int64_t now)
+{
+    wireLen++;
+    switch (rxState) {
+	case RX_SYN:
+	    if (c == 0x16) {
+		rxState = RX_DLE;
+		wireLen = 1;
+	    }
+	    break;
+	case RX_DLE:
+	    if (c == 0x10)
+		rxState = RX_STX;
+	    else if (c != 0x16)
+		rxState = RX_SYN;
+	    break;
+	case RX_STX:
+	    if (c == 0x02) {
+		rxState = RX_DATA;
+		esc = false;
+		crcIn = 0;
+		rcv.init();
+	    } else
+		rxState = (c == 0x16) ? RX_DLE : RX_SYN;
+	    break;
+	case RX_DATA:
+	    if (esc) {
+		esc = false;
+		if (c == 0x03) {
+		    rxState = RX_CRC1;
+		    break;
+		}
+		if (c == 0x04)
+		    c = 0x03;
+	    } else if (c == 0x10) {
+		esc = true;
+		break;
+	    }
+	    addToCrc(c, &crcIn);
+	    rcv.addByte(c);
+	    break;
+	case RX_CRC1:
+	    rxCrc = c << 8;
+	    rxState = RX_CRC2;
+	    break;
+	case RX_CRC2:
+	    rxCrc |= c;
+	    rxState = RX_SYN;
+	    if ((rxCrc != crcIn) || rcv.empty()) {
+		stats.rxBadCrc++;
+		if (verbose & SIM_DEBUG_LINK)
+		    cerr << "link: BAD CRC" << endl;
+	    } else if (maxFrame && (rcv.getLen() > maxFrame)) {
+		// Did not fit into the receive buffer
+		stats.rxTooLong++;
+		if (verbose & SIM_DEBUG_LINK)
+		    cerr << "link: frame too long (" << rcv.getLen()
+			 << " bytes)" << endl;
+	    } else
+		packetReceived(rcv, wireLen, now);
+	    rcv.init();
+	    break;
+    }
+}
+
+void simPeer::
+packetReceived(bufferStore &b, long len, u_int64_t now)
+{
+    int type = b.getByte(0);
+    int seq = type & 0x0f;
+
+    type &= 0xf0;
+    if (seq & 8) {
+	if (b.getLen() < 2)
+	    return;
+	seq = (b.getByte(1) << 3) + (seq & 7);
+	b.discardFirstBytes(2);
+    } else
+	b.discardFirstBytes(1);
+
+    switch (type) {
+	case 0x30:
+	    stats.rxData++;
+	    stats.rxDataBytes += len;
+	    if (!up)
+		break;
+	    if (((rxSequence + 1) & seqMask) == seq) {
+		rxSequence = seq;
+		if (verbose & SIM_DEBUG_LINK)
+		    cerr << "link: << dat seq=" << seq << " len="
+			 << b.getLen() << endl;
+		stats.rxPayload += b.getLen();
+		sendAck(rxSequence);
+		ncpReceive(b);
+	    } else {
+		if (verbose & SIM_DEBUG_LINK)
+		    cerr << "link: << DUP seq=" << seq << endl;
+		stats.rxDups++;
+		sendAck(rxSequence);
+	    }
+	    break;
+
+	case 0x00:
+	    stats.rxAcks++;
+	    stats.rxAckBytes += len;
+	    linkAck(seq, now);
+	    break;
+
+	case 0x20:
+	    stats.rxCtl++;
+	    stats.rxCtlBytes += len;
+	    if (verbose & SIM_DEBUG_LINK)
+		cerr << "link: << req seq=" << seq << endl;
+	    linkReset();
+	    if (epoc && (seq == 4)) {
+		// ncpd confirms a link, which it thinks we have requested.
+		// Its next data frame will have sequence number 0.
+		rxSequence = seqMask;
+		sendAck(0);
+		linkUp();
+	    } else if (epoc) {
+		conPending = true;
+		sendCon();
+	    } else {
+		// A SIBO machine treats the request as a plain link request.
+		sendAck(0);
+		linkUp();
+	    }
+	    break;
+
+	case 0x10:
+	    stats.rxCtl++;
+	    stats.rxCtlBytes += len;
+	    if (verbose & SIM_DEBUG_LINK)
+		cerr << "link: << DISC" << endl;
+	    linkReset();
+	    break;
+
+	default:
+	    cerr << "link: unknown packet type " << type << endl;
+    }
+}
+
+void simPeer::
+linkReset()
+{
+    up = false;
+    conPending = false;
+    seqMask = epoc ? 0x7ff : 7;
+    maxOutstanding = epoc ? 8 : 1;
+    txSequence = 1;
+    rxSequence = 0;
+    fastSeq = -1;
+    sendWindow.clear();
+    waitQueue.clear();
+    ncpReset();
+}
+
+void simPeer::
+linkUp()
+{
+    bufferStore b;
+
+    if (verbose & SIM_DEBUG_LINK)
+	cerr << "link: UP (" << (epoc ? "EPOC" : "SIBO") << ")" << endl;
+    up = true;
+    conPending = false;
+
+    // NCP starts with the exchange of version information
+    b.addByte(epoc ? 6 : 3);
+    b.addDWord(time(NULL));
+    controlMessage(0, NCON_MSG_NCP_INFO, b);
+}
+
+void simPeer::
+sendCon()
+{
+    bufferStore b;
+
+    if (verbose & SIM_DEBUG_LINK)
+	cerr << "link: >> con seq=4" << endl;
+    b.addByte(0x24);
+    b.addDWord(random());
+    conStamp = simClock();
+    sendPacket(b);
+}
+
+void simPeer::
+sendAck(int seq)
+{
+    bufferStore b;
+
+    if (verbose & SIM_DEBUG_LINK)
+	cerr << "link: >> ack seq=" << seq << endl;
+    if (seq > 7) {
+	b.addByte((seq & 7) | 8);
+	b.addByte(seq >> 3);
+    } else
+	b.addByte(seq);
+    stats.txAcks++;
+    sendPacket(b);
+}
+
+void simPeer::
+linkAck(int seq, u_int64_t now)
+{
+    if (conPending) {
+	if (seq == 0)
+	    linkUp();
+	return;
+    }
+    if (!up || sendWindow.empty())
+	return;
+
+    // Acks are cumulative
+    int n = ((seq - sendWindow.front().seq) & seqMask) + 1;
+    if (n <= (int)sendWindow.size()) {
+	if (verbose & SIM_DEBUG_LINK)
+	    cerr << "link: << ack seq=" << seq << endl;
+	while (n-- > 0)
+	    sendWindow.pop_front();
+	fastSeq = -1;
+	transmitWaiting();
+	return;
+    }
+
+    // An ack for the frame before the window tells us, that ncpd has
+    // missed the first frame in the window. Go back once per loss.
+    int first = sendWindow.front().seq;
+    if ((seq == ((first - 1) & seqMask)) && (fastSeq != first)) {
+	fastSeq = first;
+	deque<sentFrame>::iterator i;
+	for (i = sendWindow.begin(); i != sendWindow.end(); i++) {
+	    if (verbose & SIM_DEBUG_LINK)
+		cerr << "link: >> RETRANSMIT seq=" << i->seq << endl;
+	    i->stamp = now;
+	    stats.txRetransmits++;
+	    sendPacket(i->frame);
+	}
+    }
+}
+
+/**
+ * Queues an NCP frame for transmission.
+ */
+void simPeer::
+linkSend(bufferStore &b)
+{
+    if (!up)
+	return;
+    waitQueue.push_back(b);
+    transmitWaiting();
+}
+
+/**
+ * Sends waiting NCP frames, as long as the window has room.
+ */
+void simPeer::
+transmitWaiting()
+{
+    while (!waitQueue.empty() &&
+	   ((int)sendWindow.size() < maxOutstanding)) {
+	sentFrame f;
+	bufferStore &b = waitQueue.front();
+
+	f.seq = txSequence;
+	txSequence = (txSequence + 1) & seqMask;
+	if (f.seq > 7) {
+	    f.frame.addByte(0x30 | (f.seq & 7) | 8);
+	    f.frame.addByte(f.seq >> 3);
+	} else
+	    f.frame.addByte(0x30 | f.seq);
+	f.frame.addBuff(b);
+	f.stamp = simClock();
+	if (verbose & SIM_DEBUG_LINK)
+	    cerr << "link: >> dat seq=" << f.seq << " len="
+		 << b.getLen() << endl;
+	stats.txData++;
+	stats.txPayload += b.getLen();
+	sendPacket(f.frame);
+	sendWindow.push_back(f);
+	waitQueue.pop_front();
+    }
+}
+
+void simPeer::
+expire(u_int64_t now)
+{
+    if (service)
+	for (int i = 1; i < 256; i++)
+	    if (!channels[i].pending.empty())
+		serve(i, now);
+    if (conPending && (now >= conStamp + rto)) {
+	sendCon();
+	return;
+    }
+    if (!up || sendWindow.empty() || (now < sendWindow.front().stamp + rto))
+	return;
+    // Go back N: ncpd drops everything after a missing frame.
+    deque<sentFrame>::iterator i;
+    for (i = sendWindow.begin(); i != sendWindow.end(); i++) {
+	if (verbose & SIM_DEBUG_LINK)
+	    cerr << "link: >> RETRANSMIT seq=" << i->seq << endl;
+	i->stamp = now;
+	stats.txRetransmits++;
+	sendPacket(i->frame);
+    }
+}
+
+u_int64_t simPeer::
+nextDeadline()
+{
+    u_int64_t d = 0;
+
+    if (conPending)
+	d = conStamp + rto;
+    else if (up && !sendWindow.empty())
+	d = sendWindow.front().stamp + rto;
+    if (service)
+	for (int i = 1; i < 256; i++)
+	    if (!channels[i].pending.empty() &&
+		((d == 0) || (channels[i].due < d)))
+		d = channels[i].due;
+    return d;
+}
+
+void simPeer::
+ncpReset()
+{
+    for (int i = 1; i < 256; i++)
+	closeChannel(i);
+    ncpUp = false;
+    linkChan = 0;
+}
+
+void simPeer::
+closeChannel(int chan)
+{
+    delete channels[chan].server;
+    channels[chan].server = NULL;
+    channels[chan].type = CH_FREE;
+    channels[chan].msg.init();
+    channels[chan].pending.clear();
+    channels[chan].xoff = false;
+}
+
+int simPeer::
+freeChannel()
+{
+    for (int i = 1; i < 256; i++)
+	if (channels[i].type == CH_FREE)
+	    return i;
+    return 0;
+}
+
+void simPeer::
+ncpReceive(bufferStore &b)
+{
+    if (b.getLen() < 3) {
+	cerr << "ncp: short frame" << endl;
+	return;
+    }
+    int chan = b.getByte(0);
+    b.discardFirstBytes(1);
+    if (chan == 0) {
+	ncpControl(b);
+	return;
+    }
+    int flag = b.getByte(1);
+    b.discardFirstBytes(2);
+    if (channels[chan].type == CH_FREE) {
+	cerr << "ncp: data for unknown channel " << chan << endl;
+	return;
+    }
+    bufferStore &msg = channels[chan].msg;
+    if (msg.empty())
+	msg = b;
+    else
+	msg.addBuff(b);
+    if (flag == LAST_MESS) {
+	bufferStore m = msg;
+	msg.init();
+	channelMessage(chan, m);
+    }
+}
+
+void simPeer::
+ncpControl(bufferStore &b)
+{
+    int remote = b.getByte(0);
+    int type = b.getByte(1);
+    bufferStore r;
+    int chan;
+
+    b.discardFirstBytes(2);
+    if (verbose & SIM_DEBUG_NCP)
+	cerr << "ncp: << ctl " << type << " from " << remote << endl;
+    switch (type) {
+	case NCON_MSG_NCP_INFO:
+	    // Version exchange done, now connect to ncpd's LINK server
+	    chan = freeChannel();
+	    channels[chan].type = CH_LINK;
+	    channels[chan].remote = 0;
+	    linkChan = chan;
+	    r.addStringT("LINK.*");
+	    controlMessage(chan, NCON_MSG_CONNECT_TO_SERVER, r);
+	    break;
+
+	case NCON_MSG_CONNECT_TO_SERVER: {
+	    string name = b.getString(0);
+	    if (verbose & SIM_DEBUG_NCP)
+		cerr << "ncp: connect to " << name << endl;
+	    chan = 0;
+	    if (!strncmp(name.c_str(), "LINK", 4) && linkChan) {
+		// ncpd's link channel uses the same channel both ways
+		chan = linkChan;
+		channels[chan].remote = remote;
+	    } else if (!strncmp(name.c_str(), "SYS$RFSV", 8) &&
+		       (chan = freeChannel())) {
+		channels[chan].type = CH_RFSV;
+		channels[chan].remote = remote;
+		channels[chan].server = rfsvServer::create(epoc, roots);
+	    }
+	    r.addByte(remote);
+	    r.addByte(chan ? rfsv::E_PSI_GEN_NONE : rfsv::E_PSI_FILE_NXIST);
+	    controlMessage(chan, NCON_MSG_CONNECT_RESPONSE, r);
+	    break;
+	}
+
+	case NCON_MSG_CONNECT_RESPONSE:
+	    chan = b.getByte(0);
+	    if ((chan == linkChan) && (b.getByte(1) == 0)) {
+		channels[chan].remote = remote;
+		ncpUp = true;
+		if (verbose & SIM_DEBUG_NCP)
+		    cerr << "ncp: UP" << endl;
+	    }
+	    break;
+
+	case NCON_MSG_CHANNEL_DISCONNECT:
+	    chan = b.getByte(0);
+	    if ((chan > 0) && (chan != linkChan)) {
+		if (verbose & SIM_DEBUG_NCP)
+		    cerr << "ncp: disconnect " << chan << endl;
+		closeChannel(chan);
+	    }
+	    break;
+
+	case NCON_MSG_NCP_END:
+	    ncpReset();
+	    break;
+
+	default:
+	    break;
+    }
+}
+
+void simPeer::
+controlMessage(int chan, int type, bufferStore &data)
+{
+    bufferStore b;
+
+    if (verbose & SIM_DEBUG_NCP)
+	cerr << "ncp: >> ctl " << type << " from " << chan << endl;
+    b.addByte(0);
+    b.addByte(chan);
+    b.addByte(type);
+    b.addBuff(data);
+    linkSend(b);
+}
+
+/**
+ * Sends a message on a channel, fragmented into NCP frames.
+ */
+void simPeer::
+ncpSend(int chan, bufferStore &msg)
+{
+    long len = msg.getLen();
+    long off = 0;
+
+    do {
+	long l = len - off;
+	bufferStore b;
+
+	if (l > SIM_NCP_SENDLEN)
+	    l = SIM_NCP_SENDLEN;
+	b.addByte(channels[chan].remote);
+	b.addByte(chan);
+	b.addByte(((off + l) < len) ? NOT_LAST_MESS : LAST_MESS);
+	b.addBytes((const unsigned char *)msg.getString(off), l);
+	linkSend(b);
+	off += l;
+    } while (off < len);
+}
+
+void simPeer::
+channelMessage(int chan, bufferStore &msg)
+{
+    bufferStore reply;
+
+    if (verbose & SIM_DEBUG_NCP) {
+	cerr << "ncp: << chan " << chan << " len=" << msg.getLen();
+	if (verbose & SIM_DEBUG_DUMP)
+	    cerr << " " << msg;
+	cerr << endl;
+    }
+    switch (channels[chan].type) {
+	case CH_LINK:
+	    linkServer(chan, msg);
+	    break;
+	case CH_RFSV:
+	    if (service) {
+		simChannel &ch = channels[chan];
+		u_int64_t now = simClock();
+		if (ch.pending.empty())
+		    ch.due = now + service;
+		ch.pending.push_back(msg);
+		if (!ch.xoff && (ch.pending.size() >= SIM_XOFF_DEPTH)) {
+		    bufferStore none;
+		    ch.xoff = true;
+		    stats.txXoff++;
+		    controlMessage(chan, NCON_MSG_DATA_XOFF, none);
+		}
+		break;
+	    }
+	    channels[chan].server->request(msg, reply);
+	    if (!reply.empty())
+		ncpSend(chan, reply);
+	    break;
+	default:
+	    break;
+    }
+}
+
+/**
+ * Processes the waiting requests of a slow server, whose
+ * service time is over.
+ */
+void simPeer::
+serve(int chan, u_int64_t now)
+{
+    simChannel &ch = channels[chan];
+
+    while (!ch.pending.empty() && (ch.due <= now)) {
+	bufferStore reply;
+	ch.server->request(ch.pending.front(), reply);
+	ch.pending.pop_front();
+	ch.due += service;
+	if (!reply.empty())
+	    ncpSend(chan, reply);
+    }
+    if (ch.xoff && (ch.pending.size() <= 1)) {
+	bufferStore none;
+	ch.xoff = false;
+	controlMessage(chan, NCON_MSG_DATA_XON, none);
+    }
+}
+
+/**
+ * The Psion's LINK server. ncpd asks it to start servers by name,
+ * before it connects to them. Only SYS$RFSV is available here.
+ */
+void simPeer::
+linkServer(int chan, bufferStore &msg)
+{
+    bufferStore reply;
+
+    if ((msg.getLen() < 4) || (msg.getByte(0) != 0))
+	return;
+    msg.addByte(0);
+    string name = msg.getString(3);
+    reply.addByte(1);
+    reply.addWord(msg.getWord(1));
+    if (!strncmp(name.c_str(), "SYS$RFSV", 8))
+	reply.addWord(0);
+    else
+	reply.addWord(rfsv::E_PSI_FILE_NXIST & 0xffff);
+    reply.addWord(0);
+    reply.addStringT(name.c_str());
+    ncpSend(chan, reply);
+}
+
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * End:
+ */
@@ -0,0 +1,217 @@
+/*-*-c++-*-
+ * $Id$
+ *
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+#ifndef _SIM_PEER_H_
+#define _SIM_PEER_H_
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string>
+#include <deque>
+
+#include <bufferstore.h>
+#include <plp_inttypes.h>
+
+class simLine;
+class rfsvServer;
+
+#define SIM_DEBUG_LINK 1
+#define SIM_DEBUG_NCP  2
+#define SIM_DEBUG_DUMP 4
+
+/**
+ * Maximum number of bytes in the data part of an NCP frame,
+ * which the simulated Psion sends.
+ */
+#define SIM_NCP_SENDLEN 250
+
+/**
+ * Number of requests, which may wait for a slow server (see the
+ * service time of @ref simPeer ), before it sends an XOFF.
+ */
+#define SIM_XOFF_DEPTH 4
+
+/**
+ * Statistics of a @ref simPeer . Counts of received frames refer
+ * to frames from ncpd, which arrived with a correct CRC.
+ * Byte counts include the framing, escapes and CRC.
+ */
+struct simPeerStats {
+    unsigned long rxData;
+    unsigned long rxAcks;
+    unsigned long rxCtl;
+    unsigned long rxDups;
+    unsigned long rxBadCrc;
+    unsigned long rxTooLong;
+    unsigned long long rxDataBytes;
+    unsigned long long rxAckBytes;
+    unsigned long long rxCtlBytes;
+    unsigned long long rxPayload;
+    unsigned long txData;
+    unsigned long txAcks;
+    unsigned long txRetransmits;
+    unsigned long long txPayload;
+    unsigned long txXoff;
+};
+
+/**
+ * The simulated Psion. It speaks the PLP link protocol (SIBO or EPOC
+ * variant), the NCP and serves SYS$RFSV from a set of local directories.
+ * Everything runs from the simulator's single event loop.
+ */
+class simPeer {
+public:
+    /**
+     * Constructs a new Psion.
+     *
+     * @param line The line, the Psion is attached to.
+     * @param epoc true for a Series 5 (EPOC), false for a Series 3 (SIBO).
+     * @param roots The host directories of the drives A: to Z:. Empty
+     *  strings denote drives which are not present.
+     * @param rto The retransmission timeout in microseconds.
+     * @param service The time in microseconds, the servers take
+     *  to process a request, 0 for no delay. Servers with too many
+     *  requests waiting send an XOFF, like a busy Psion.
+     * @param maxFrame The longest frame (link header and data), the
+     *  Psion receives, 0 for no limit. Longer frames are dropped.
+     * @param verbose Debug flags (SIM_DEBUG_...).
+     */
+    simPeer(simLine *line, bool epoc, const std::string *roots,
+	    unsigned long rto, unsigned long service = 0,
+	    unsigned long maxFrame = 0, unsigned short verbose = 0);
+    ~simPeer();
+
+    /**
+     * Processes bytes, which arrived from ncpd.
+     */
+    void receive(const bufferStore &b, u_int64_t now);
+
+    /**
+     * Retransmits frames, whose acknowledgement is overdue, and
+     * processes requests, whose service time is over.
+     */
+    void expire(u_int64_t now);
+
+    /**
+     * Returns the time of the next retransmission or of the end of
+     * a service time, or 0 if none is due.
+     */
+    u_int64_t nextDeadline();
+
+    /**
+     * Returns true, once NCP is up and ncpd has connected
+     * to the LINK server.
+     */
+    bool isConnected();
+
+    void getStats(simPeerStats &stats);
+
+private:
+    enum channelType { CH_FREE, CH_LINK, CH_RFSV };
+
+    struct simChannel {
+	channelType type;
+	int remote;
+	bufferStore msg;
+	rfsvServer *server;
+	std::deque<bufferStore> pending;
+	u_int64_t due;
+	bool xoff;
+    };
+
+    struct sentFrame {
+	int seq;
+	u_int64_t stamp;
+	bufferStore frame;
+    };
+
+    // PLP framing
+    void sendPacket(const bufferStore &b);
+    void decode(unsigned char c, u_int64_t now);
+    void packetReceived(bufferStore &b, long wireLen, u_int64_t now);
+    void addToCrc(unsigned char c, unsigned short *crc);
+
+    // Link layer
+    void linkReset();
+    void linkAck(int seq, u_int64_t now);
+    void sendAck(int seq);
+    void sendCon();
+    void linkSend(bufferStore &b);
+    void transmitWaiting();
+    void linkUp();
+
+    // NCP
+    void ncpReset();
+    void ncpReceive(bufferStore &b);
+    void ncpControl(bufferStore &b);
+    void ncpSend(int chan, bufferStore &msg);
+    void controlMessage(int chan, int type, bufferStore &data);
+    void channelMessage(int chan, bufferStore &msg);
+    void serve(int chan, u_int64_t now);
+    void linkServer(int chan, bufferStore &msg);
+    int freeChannel();
+    void closeChannel(int chan);
+
+    simLine *line;
+    bool epoc;
+    const std::string *roots;
+    unsigned short verbose;
+    unsigned short crcTable[256];
+
+    // Receiver state of the PLP framing
+    int rxState;
+    bool esc;
+    unsigned short crcIn;
+    unsigned short rxCrc;
+    long wireLen;
+    bufferStore rcv;
+
+    // Link layer state
+    bool up;
+    bool conPending;
+    u_int64_t conStamp;
+    int seqMask;
+    int maxOutstanding;
+    int txSequence;
+    int rxSequence;
+    int fastSeq;
+    unsigned long rto;
+    unsigned long service;
+    unsigned long maxFrame;
+    std::deque<sentFrame> sendWindow;
+    std::deque<bufferStore> waitQueue;
+
+    // NCP state
+    bool ncpUp;
+    int linkChan;
+    simChannel channels[256];
+
+    simPeerStats stats;
+};
+
+#endif
+
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * End:
+ */
@@ -0,0 +1,1169 @@
+/*-*-c++-*-
+ * $Id$
+ *
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/time.h>
+#include <sys/statvfs.h>
+
+#include <rfsv.h>
+#include <psitime.h>
+
+#include "rfsvserver.h"
+
+using namespace std;
+
+rfsvServer *rfsvServer::
+create(bool epoc, const string *roots)
+{
+    if (epoc)
+	return new rfsv32Server(roots);
+    return new rfsv16Server(roots);
+}
+
+rfsvServer::rfsvServer(const string *_roots)
+    : roots(_roots)
+    , nextHandle(1)
+{
+}
+
+rfsvServer::~rfsvServer()
+{
+    map<u_int32_t, simHandle>::iterator i;
+    for (i = handles.begin(); i != handles.end(); i++)
+	if (i->second.fd != -1)
+	    close(i->second.fd);
+}
+
+rfsvServer::simErr rfsvServer::
+fromErrno(int e)
+{
+    switch (e) {
+	case 0:
+	    return SIM_OK;
+	case ENOENT:
+	    return SIM_NOT_FOUND;
+	case ENOTDIR:
+	    return SIM_PATH_NOT_FOUND;
+	case EEXIST:
+	    return SIM_EXISTS;
+	case EACCES:
+	case EPERM:
+	case EROFS:
+	case EISDIR:
+	    return SIM_ACCESS;
+	case ENOTEMPTY:
+	case EBUSY:
+	    return SIM_IN_USE;
+	case EBADF:
+	    return SIM_BAD_HANDLE;
+	case ENOSPC:
+	    return SIM_FULL;
+	case ENAMETOOLONG:
+	    return SIM_BAD_NAME;
+	case EINVAL:
+	    return SIM_ARGUMENT;
+    }
+    return SIM_GENERAL;
+}
+
+/**
+ * Maps a Psion path to a path on the host. A missing drive means C:.
+ * The Psion's file systems are case insensitive, so each component is
+ * looked up ignoring case, if it does not exist as given.
+ */
+rfsvServer::simErr rfsvServer::
+hostPath(const string &name, string &path)
+{
+    char drive = 'C';
+    size_t p = 0;
+
+    if ((name.size() >= 2) && (name[1] == ':')) {
+	drive = toupper(name[0]);
+	p = 2;
+    }
+    if ((drive < 'A') || (drive > 'Z') || roots[drive - 'A'].empty())
+	return SIM_NOT_READY;
+    path = roots[drive - 'A'];
+    while (p < name.size()) {
+	size_t e = name.find('\\', p);
+	if (e == string::npos)
+	    e = name.size();
+	string comp = name.substr(p, e - p);
+	p = e + 1;
+	if (comp.empty() || (comp == "."))
+	    continue;
+	if ((comp == "..") || (comp.find('/') != string::npos))
+	    return SIM_BAD_NAME;
+	string cand = path + "/" + comp;
+	struct stat st;
+	if (lstat(cand.c_str(), &st) != 0) {
+	    DIR *d = opendir(path.c_str());
+	    if (d) {
+		struct dirent *de;
+		while ((de = readdir(d)) != NULL)
+		    if (!strcasecmp(de->d_name, comp.c_str())) {
+			cand = path + "/" + de->d_name;
+			break;
+		    }
+		closedir(d);
+	    }
+	}
+	path = cand;
+    }
+    return SIM_OK;
+}
+
+/**
+ * Returns the volume name of a drive, the last component
+ * of its directory on the host.
+ */
+string rfsvServer::
+volumeName(char drive)
+{
+    string dir = roots[drive - 'A'];
+    while ((dir.size() > 1) && (dir[dir.size() - 1] == '/'))
+	dir.erase(dir.size() - 1);
+    size_t p = dir.rfind('/');
+    return (p == string::npos) ? dir : dir.substr(p + 1);
+}
+
+string rfsvServer::
+baseName(const string &name)
+{
+    size_t p = name.find_last_of("\\:");
+    return (p == string::npos) ? name : name.substr(p + 1);
+}
+
+u_int32_t rfsvServer::
+addHandle(const simHandle &h)
+{
+    // Handles must fit into the 16 bits of the SIBO protocol
+    while (handles.find(nextHandle) != handles.end())
+	nextHandle = (nextHandle % 0xffff) + 1;
+    u_int32_t n = nextHandle;
+    handles[n] = h;
+    nextHandle = (nextHandle % 0xffff) + 1;
+    return n;
+}
+
+rfsvServer::simHandle *rfsvServer::
+getHandle(u_int32_t h)
+{
+    map<u_int32_t, simHandle>::iterator i = handles.find(h);
+    return (i == handles.end()) ? NULL : &i->second;
+}
+
+rfsvServer::simErr rfsvServer::
+closeHandle(u_int32_t h)
+{
+    map<u_int32_t, simHandle>::iterator i = handles.find(h);
+    if (i == handles.end())
+	return SIM_BAD_HANDLE;
+    if (i->second.fd != -1)
+	close(i->second.fd);
+    handles.erase(i);
+    return SIM_OK;
+}
+
+rfsvServer::simErr rfsvServer::
+openFile(const string &name, int flags, u_int32_t &h)
+{
+    string path;
+    simErr e = hostPath(name, path);
+    if (e != SIM_OK)
+	return e;
+    int fd = ::open(path.c_str(), flags, 0666);
+    if (fd == -1)
+	return fromErrno(errno);
+    struct stat st;
+    if ((fstat(fd, &st) == 0) && S_ISDIR(st.st_mode)) {
+	close(fd);
+	return SIM_ACCESS;
+    }
+    simHandle sh;
+    sh.fd = fd;
+    sh.next = 0;
+    h = addHandle(sh);
+    return SIM_OK;
+}
+
+/**
+ * Opens a directory listing. The last component of @p name is a
+ * pattern, which may contain wildcards. An empty pattern lists
+ * everything.
+ */
+rfsvServer::simErr rfsvServer::
+openDir(const string &name, bool dirs, u_int32_t &h)
+{
+    size_t p = name.find_last_of("\\:");
+    string dir = (p == string::npos) ? "" : name.substr(0, p + 1);
+    string pattern = (p == string::npos) ? name : name.substr(p + 1);
+    simHandle sh;
+
+    if (pattern.empty() || (pattern == "*.*"))
+	pattern = "*";
+    simErr e = hostPath(dir, sh.dir);
+    if (e != SIM_OK)
+	return e;
+    DIR *d = opendir(sh.dir.c_str());
+    if (!d)
+	return (errno == ENOENT) ? SIM_PATH_NOT_FOUND : fromErrno(errno);
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+	if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+	    continue;
+	if (fnmatch(pattern.c_str(), de->d_name, FNM_CASEFOLD) != 0)
+	    continue;
+	if (!dirs) {
+	    struct stat st;
+	    string full = sh.dir + "/" + de->d_name;
+	    if ((::stat(full.c_str(), &st) == 0) && S_ISDIR(st.st_mode))
+		continue;
+	}
+	sh.entries.push_back(de->d_name);
+    }
+    closedir(d);
+    sort(sh.entries.begin(), sh.entries.end());
+    sh.fd = -1;
+    sh.next = 0;
+    h = addHandle(sh);
+    return SIM_OK;
+}
+
+/**
+ * Opens a listing of the drive letters.
+ */
+rfsvServer::simErr rfsvServer::
+openDrives(u_int32_t &h)
+{
+    simHandle sh;
+
+    for (int i = 0; i < 26; i++)
+	if (!roots[i].empty())
+	    sh.entries.push_back(string(1, 'A' + i));
+    sh.fd = -1;
+    sh.next = 0;
+    h = addHandle(sh);
+    return SIM_OK;
+}
+
+rfsvServer::simErr rfsvServer::
+nextEntry(simHandle &h, string &name, struct stat &st)
+{
+    while (h.next < h.entries.size()) {
+	name = h.entries[h.next++];
+	if (h.dir.empty())
+	    return SIM_OK;
+	string full = h.dir + "/" + name;
+	if (::stat(full.c_str(), &st) == 0)
+	    return SIM_OK;
+    }
+    return SIM_EOF;
+}
+
+rfsvServer::simErr rfsvServer::
+makeTemp(string &name, u_int32_t &h)
+{
+    string path;
+    simErr e = hostPath("C:\\", path);
+    if (e != SIM_OK)
+	return e;
+    path += "/TMPXXXXXX";
+    char *tmpl = strdup(path.c_str());
+    int fd = mkstemp(tmpl);
+    if (fd == -1) {
+	free(tmpl);
+	return fromErrno(errno);
+    }
+    name = string("C:\\") + (strrchr(tmpl, '/') + 1);
+    free(tmpl);
+    simHandle sh;
+    sh.fd = fd;
+    sh.next = 0;
+    h = addHandle(sh);
+    return SIM_OK;
+}
+
+rfsvServer::simErr rfsvServer::
+read(u_int32_t h, u_int32_t len, bufferStore &data)
+{
+    simHandle *sh = getHandle(h);
+    if (!sh || (sh->fd == -1))
+	return SIM_BAD_HANDLE;
+    unsigned char *p = data.extend(len);
+    u_int32_t done = 0;
+    while (done < len) {
+	ssize_t n = ::read(sh->fd, p + done, len - done);
+	if (n < 0) {
+	    data.truncate(0);
+	    return fromErrno(errno);
+	}
+	if (n == 0)
+	    break;
+	done += n;
+    }
+    data.truncate(done);
+    return SIM_OK;
+}
+
+rfsvServer::simErr rfsvServer::
+write(u_int32_t h, const unsigned char *data, long len)
+{
+    simHandle *sh = getHandle(h);
+    if (!sh || (sh->fd == -1))
+	return SIM_BAD_HANDLE;
+    while (len > 0) {
+	ssize_t n = ::write(sh->fd, data, len);
+	if (n < 0)
+	    return fromErrno(errno);
+	data += n;
+	len -= n;
+    }
+    return SIM_OK;
+}
+
+rfsvServer::simErr rfsvServer::
+seek(u_int32_t h, int32_t pos, int mode, u_int32_t &res)
+{
+    static const int whence[] = { SEEK_SET, SEEK_CUR, SEEK_END };
+    simHandle *sh = getHandle(h);
+    if (!sh || (sh->fd == -1))
+	return SIM_BAD_HANDLE;
+    if ((mode < 1) || (mode > 3))
+	return SIM_ARGUMENT;
+    off_t o = lseek(sh->fd, pos, whence[mode - 1]);
+    if (o == (off_t)-1)
+	return fromErrno(errno);
+    res = o;
+    return SIM_OK;
+}
+
+rfsvServer::simErr rfsvServer::
+setSize(u_int32_t h, u_int32_t size)
+{
+    simHandle *sh = getHandle(h);
+    if (!sh || (sh->fd == -1))
+	return SIM_BAD_HANDLE;
+    return (ftruncate(sh->fd, size) == 0) ? SIM_OK : fromErrno(errno);
+}
+
+rfsvServer::simErr rfsvServer::
+copy(u_int32_t to, u_int32_t from, u_int32_t len, u_int32_t &done)
+{
+    done = 0;
+    while (done < len) {
+	bufferStore b;
+	u_int32_t l = len - done;
+	if (l > 65536)
+	    l = 65536;
+	simErr e = read(from, l, b);
+	if (e != SIM_OK)
+	    return e;
+	if (b.empty())
+	    break;
+	e = write(to, (const unsigned char *)b.getString(0), b.getLen());
+	if (e != SIM_OK)
+	    return e;
+	done += b.getLen();
+    }
+    return SIM_OK;
+}
+
+rfsvServer::simErr rfsvServer::
+stat(const string &name, struct stat &st)
+{
+    string path;
+    simErr e = hostPath(name, path);
+    if (e != SIM_OK)
+	return e;
+    return (::stat(path.c_str(), &st) == 0) ? SIM_OK : fromErrno(errno);
+}
+
+rfsvServer::simErr rfsvServer::
+remove(const string &name)
+{
+    string path;
+    struct stat st;
+    simErr e = hostPath(name, path);
+    if (e != SIM_OK)
+	return e;
+    if (::stat(path.c_str(), &st) != 0)
+	return fromErrno(errno);
+    if (S_ISDIR(st.st_mode))
+	return SIM_ACCESS;
+    return (unlink(path.c_str()) == 0) ? SIM_OK : fromErrno(errno);
+}
+
+rfsvServer::simErr rfsvServer::
+rename(const string &from, const string &to, bool replace)
+{
+    string f, t;
+    struct stat sf, st;
+    simErr e = hostPath(from, f);
+    if (e == SIM_OK)
+	e = hostPath(to, t);
+    if (e != SIM_OK)
+	return e;
+    if (::stat(f.c_str(), &sf) != 0)
+	return fromErrno(errno);
+    // Changing only the case of a name is no conflict.
+    if (!replace && (::stat(t.c_str(), &st) == 0) &&
+	((st.st_ino != sf.st_ino) || (st.st_dev != sf.st_dev)))
+	return SIM_EXISTS;
+    if (t != f) {
+	// Keep the name as given, not the one found by hostPath().
+	size_t p = t.rfind('/');
+	t = t.substr(0, p + 1) + baseName(to);
+    }
+    return (::rename(f.c_str(), t.c_str()) == 0) ? SIM_OK : fromErrno(errno);
+}
+
+rfsvServer::simErr rfsvServer::
+mkdir(const string &name, bool parents)
+{
+    string path;
+    struct stat st;
+    simErr e = hostPath(name, path);
+    if (e != SIM_OK)
+	return e;
+    if (::stat(path.c_str(), &st) == 0)
+	return SIM_EXISTS;
+    if (parents)
+	for (size_t p = path.find('/', 1); p != string::npos;
+	     p = path.find('/', p + 1))
+	    ::mkdir(path.substr(0, p).c_str(), 0777);
+    if (::mkdir(path.c_str(), 0777) != 0)
+	return (errno == ENOENT) ? SIM_PATH_NOT_FOUND : fromErrno(errno);
+    return SIM_OK;
+}
+
+rfsvServer::simErr rfsvServer::
+rmdir(const string &name)
+{
+    string path;
+    simErr e = hostPath(name, path);
+    if (e != SIM_OK)
+	return e;
+    return (::rmdir(path.c_str()) == 0) ? SIM_OK : fromErrno(errno);
+}
+
+rfsvServer::simErr rfsvServer::
+setReadOnly(const string &name, bool ronly)
+{
+    string path;
+    struct stat st;
+    simErr e = hostPath(name, path);
+    if (e != SIM_OK)
+	return e;
+    if (::stat(path.c_str(), &st) != 0)
+	return fromErrno(errno);
+    mode_t m = ronly ? (st.st_mode & ~0222) : (st.st_mode | S_IWUSR);
+    return (chmod(path.c_str(), m & 07777) == 0) ? SIM_OK : fromErrno(errno);
+}
+
+rfsvServer::simErr rfsvServer::
+setMtime(const string &name, time_t t)
+{
+    string path;
+    struct stat st;
+    simErr e = hostPath(name, path);
+    if (e != SIM_OK)
+	return e;
+    if (::stat(path.c_str(), &st) != 0)
+	return fromErrno(errno);
+    struct timeval tv[2];
+    tv[0].tv_sec = st.st_atime;
+    tv[0].tv_usec = 0;
+    tv[1].tv_sec = t;
+    tv[1].tv_usec = 0;
+    return (utimes(path.c_str(), tv) == 0) ? SIM_OK : fromErrno(errno);
+}
+
+rfsvServer::simErr rfsvServer::
+driveSpace(char drive, u_int64_t &size, u_int64_t &free)
+{
+    struct statvfs sv;
+
+    drive = toupper(drive);
+    if ((drive < 'A') || (drive > 'Z') || roots[drive - 'A'].empty())
+	return SIM_NOT_READY;
+    if (statvfs(roots[drive - 'A'].c_str(), &sv) != 0)
+	return fromErrno(errno);
+    size = (u_int64_t)sv.f_blocks * sv.f_frsize;
+    free = (u_int64_t)sv.f_bavail * sv.f_frsize;
+    return SIM_OK;
+}
+
+// rfsv32
+
+enum {
+    EPOC_ATTR_RONLY = 0x0001,
+    EPOC_ATTR_HIDDEN = 0x0002,
+    EPOC_ATTR_DIRECTORY = 0x0010,
+    EPOC_ATTR_ARCHIVE = 0x0020,
+    EPOC_OMODE_READ_WRITE = 0x0200
+};
+
+enum {
+    CLOSE_HANDLE = 0x01,
+    OPEN_DIR = 0x10,
+    READ_DIR = 0x12,
+    GET_DRIVE_LIST = 0x13,
+    DRIVE_INFO = 0x14,
+    OPEN_FILE = 0x16,
+    TEMP_FILE = 0x17,
+    READ_FILE = 0x18,
+    WRITE_FILE = 0x19,
+    SEEK_FILE = 0x1a,
+    DELETE = 0x1b,
+    REMOTE_ENTRY = 0x1c,
+    FLUSH = 0x1d,
+    SET_SIZE = 0x1e,
+    RENAME = 0x1f,
+    MK_DIR_ALL = 0x20,
+    RM_DIR = 0x21,
+    SET_ATT = 0x22,
+    ATT = 0x23,
+    SET_MODIFIED = 0x24,
+    MODIFIED = 0x25,
+    READ_WRITE_FILE = 0x28,
+    CREATE_FILE = 0x29,
+    REPLACE_FILE = 0x2a,
+    PATH_TEST = 0x2b,
+    REPLACE = 0x32
+};
+
+static u_int32_t
+epocAttr(const string &name, const struct stat &st)
+{
+    u_int32_t attr = S_ISDIR(st.st_mode) ? EPOC_ATTR_DIRECTORY : EPOC_ATTR_ARCHIVE;
+
+    if (!(st.st_mode & S_IWUSR))
+	attr |= EPOC_ATTR_RONLY;
+    if (name[0] == '.')
+	attr |= EPOC_ATTR_HIDDEN;
+    return attr;
+}
+
+int32_t rfsv32Server::
+errorCode(simErr e)
+{
+    static const int32_t codes[] = {
+	0,	// SIM_OK
+	-1,	// SIM_NOT_FOUND
+	-12,	// SIM_PATH_NOT_FOUND
+	-11,	// SIM_EXISTS
+	-21,	// SIM_ACCESS
+	-14,	// SIM_IN_USE
+	-8,	// SIM_BAD_HANDLE
+	-25,	// SIM_EOF
+	-26,	// SIM_FULL
+	-28,	// SIM_BAD_NAME
+	-18,	// SIM_NOT_READY
+	-5,	// SIM_NOT_SUPPORTED
+	-6,	// SIM_ARGUMENT
+	-2	// SIM_GENERAL
+    };
+    return codes[e];
+}
+
+void rfsv32Server::
+request(bufferStore &req, bufferStore &reply)
+{
+    bufferStore out;
+
+    if (req.getLen() < 4)
+	return;
+    int cmd = req.getWord(0);
+    int ser = req.getWord(2);
+    req.discardFirstBytes(4);
+    simErr e = dispatch(cmd, req, out);
+    reply.addWord(0x11);
+    reply.addWord(ser);
+    reply.addDWord(errorCode(e));
+    if (e == SIM_OK)
+	reply.addBuff(out);
+}
+
+/**
+ * Fetches a name, which is preceded by its length as a word.
+ */
+string rfsv32Server::
+getName(bufferStore &a, long &pos)
+{
+    if (pos + 2 > (long)a.getLen())
+	return "";
+    long len = a.getWord(pos);
+    pos += 2;
+    if (pos + len > (long)a.getLen())
+	len = a.getLen() - pos;
+    string s(a.getString(pos), len);
+    pos += len;
+    return s;
+}
+
+void rfsv32Server::
+addEntry(bufferStore &out, const string &name, const struct stat &st)
+{
+    PsiTime t(st.st_mtime);
+
+    out.addDWord(0);
+    out.addDWord(epocAttr(name, st));
+    out.addDWord(S_ISDIR(st.st_mode) ? 0 : st.st_size);
+    out.addDWord(t.getPsiTimeLo());
+    out.addDWord(t.getPsiTimeHi());
+    out.addDWord(0);
+    out.addDWord(0);
+    out.addDWord(0);
+    out.addDWord(name.size());
+    out.addString(name.c_str());
+    while (out.getLen() % 4)
+	out.addByte(0);
+}
+
+rfsvServer::simErr rfsv32Server::
+dispatch(int cmd, bufferStore &a, bufferStore &out)
+{
+    long len = a.getLen();
+    long pos = 0;
+    u_int32_t h;
+    u_int32_t n;
+    struct stat st;
+    simErr e;
+    string name;
+
+    switch (cmd) {
+	case CLOSE_HANDLE:
+	case FLUSH:
+	    if (len < 4)
+		return SIM_ARGUMENT;
+	    if (cmd == FLUSH)
+		return getHandle(a.getDWord(0)) ? SIM_OK : SIM_BAD_HANDLE;
+	    return closeHandle(a.getDWord(0));
+
+	case OPEN_DIR:
+	    if (len < 4)
+		return SIM_ARGUMENT;
+	    pos = 4;
+	    name = getName(a, pos);
+	    e = openDir(name, a.getDWord(0) & EPOC_ATTR_DIRECTORY, h);
+	    if (e == SIM_OK)
+		out.addDWord(h);
+	    return e;
+
+	case READ_DIR: {
+	    if (len < 4)
+		return SIM_ARGUMENT;
+	    simHandle *sh = getHandle(a.getDWord(0));
+	    if (!sh || sh->dir.empty())
+		return SIM_BAD_HANDLE;
+	    // As many entries as fit into a reply
+	    while (sh->next < sh->entries.size()) {
+		if (out.getLen() + 40 + sh->entries[sh->next].size() >
+		    (unsigned long)RFSV_SENDLEN)
+		    break;
+		if (nextEntry(*sh, name, st) == SIM_OK)
+		    addEntry(out, name, st);
+	    }
+	    return out.empty() ? SIM_EOF : SIM_OK;
+	}
+
+	case GET_DRIVE_LIST:
+	    for (int i = 0; i < 26; i++)
+		out.addByte(roots[i].empty() ? 0 : 1);
+	    return SIM_OK;
+
+	case DRIVE_INFO: {
+	    u_int64_t size, free;
+	    if (len < 4)
+		return SIM_ARGUMENT;
+	    char drive = 'A' + (a.getDWord(0) % 26);
+	    if ((e = driveSpace(drive, size, free)) != SIM_OK)
+		return e;
+	    name = volumeName(drive);
+	    out.addDWord(5);	// RAM
+	    out.addDWord(0);
+	    out.addDWord((drive == 'C') ? 0x10 : 0);	// internal
+	    out.addDWord(0);
+	    out.addDWord(0x504c5000 + drive);
+	    out.addDWord(size & 0xffffffff);
+	    out.addDWord(size >> 32);
+	    out.addDWord(free & 0xffffffff);
+	    out.addDWord(free >> 32);
+	    out.addDWord(name.size());
+	    out.addString(name.c_str());
+	    return SIM_OK;
+	}
+
+	case OPEN_FILE:
+	case CREATE_FILE:
+	case REPLACE_FILE: {
+	    if (len < 4)
+		return SIM_ARGUMENT;
+	    int flags = (a.getDWord(0) & EPOC_OMODE_READ_WRITE) ?
+		O_RDWR : O_RDONLY;
+	    if (cmd == CREATE_FILE)
+		flags = O_RDWR | O_CREAT | O_EXCL;
+	    else if (cmd == REPLACE_FILE)
+		flags = O_RDWR | O_CREAT | O_TRUNC;
+	    pos = 4;
+	    e = openFile(getName(a, pos), flags, h);
+	    if (e == SIM_OK)
+		out.addDWord(h);
+	    return e;
+	}
+
+	case TEMP_FILE:
+	    if ((e = makeTemp(name, h)) == SIM_OK) {
+		out.addDWord(h);
+		out.addWord(name.size());
+		out.addStringT(name.c_str());
+	    }
+	    return e;
+
+	case READ_FILE:
+	    if (len < 8)
+		return SIM_ARGUMENT;
+	    n = a.getDWord(4);
+	    if (n > 65536)
+		n = 65536;
+	    return read(a.getDWord(0), n, out);
+
+	case WRITE_FILE:
+	    if (len < 4)
+		return SIM_ARGUMENT;
+	    return write(a.getDWord(0),
+			 (const unsigned char *)a.getString(4), len - 4);
+
+	case SEEK_FILE:
+	    if (len < 12)
+		return SIM_ARGUMENT;
+	    e = seek(a.getDWord(4), (int32_t)a.getDWord(0), a.getDWord(8), n);
+	    if (e == SIM_OK)
+		out.addDWord(n);
+	    return e;
+
+	case SET_SIZE:
+	    if (len < 8)
+		return SIM_ARGUMENT;
+	    return setSize(a.getDWord(0), a.getDWord(4));
+
+	case READ_WRITE_FILE:
+	    if (len < 12)
+		return SIM_ARGUMENT;
+	    e = copy(a.getDWord(4), a.getDWord(8), a.getDWord(0), n);
+	    if (e == SIM_OK)
+		out.addDWord(n);
+	    return e;
+
+	case DELETE:
+	    return remove(getName(a, pos));
+
+	case REMOTE_ENTRY:
+	    name = getName(a, pos);
+	    if ((e = stat(name, st)) == SIM_OK)
+		addEntry(out, baseName(name), st);
+	    return e;
+
+	case RENAME:
+	case REPLACE:
+	    name = getName(a, pos);
+	    return rename(name, getName(a, pos), cmd == REPLACE);
+
+	case MK_DIR_ALL:
+	    return mkdir(getName(a, pos), true);
+
+	case RM_DIR:
+	    return rmdir(getName(a, pos));
+
+	case SET_ATT: {
+	    if (len < 8)
+		return SIM_ARGUMENT;
+	    u_int32_t seta = a.getDWord(0);
+	    u_int32_t unseta = a.getDWord(4);
+	    pos = 8;
+	    name = getName(a, pos);
+	    if ((e = stat(name, st)) != SIM_OK)
+		return e;
+	    if ((seta | unseta) & EPOC_ATTR_RONLY)
+		return setReadOnly(name, seta & EPOC_ATTR_RONLY);
+	    return SIM_OK;
+	}
+
+	case ATT:
+	    name = getName(a, pos);
+	    if ((e = stat(name, st)) == SIM_OK)
+		out.addDWord(epocAttr(baseName(name), st));
+	    return e;
+
+	case SET_MODIFIED: {
+	    if (len < 8)
+		return SIM_ARGUMENT;
+	    PsiTime t(a.getDWord(4), a.getDWord(0));
+	    pos = 8;
+	    return setMtime(getName(a, pos), t.getTime());
+	}
+
+	case MODIFIED:
+	    if ((e = stat(getName(a, pos), st)) == SIM_OK) {
+		PsiTime t(st.st_mtime);
+		out.addDWord(t.getPsiTimeLo());
+		out.addDWord(t.getPsiTimeHi());
+	    }
+	    return e;
+
+	case PATH_TEST:
+	    return stat(getName(a, pos), st);
+    }
+    return SIM_NOT_SUPPORTED;
+}
+
+// rfsv16
+
+enum {
+    FOPEN = 0,
+    FCLOSE = 2,
+    FREAD = 4,
+    FDIRREAD = 6,
+    FDEVICEREAD = 8,
+    FWRITE = 10,
+    FSEEK = 12,
+    FFLUSH = 14,
+    FSETEOF = 16,
+    FRENAME = 18,
+    FDELETE = 20,
+    FINFO = 22,
+    SFSTAT = 24,
+    PARSE = 26,
+    MKDIR = 28,
+    OPENUNIQUE = 30,
+    STATUSDEVICE = 32,
+    SFDATE = 40
+};
+
+enum {
+    P_FCREATE = 0x0001,
+    P_FREPLACE = 0x0002,
+    P_FAPPEND = 0x0003,
+    P_FUNIQUE = 0x0004,
+    P_FDIR = 0x0030,
+    P_FDEVICE = 0x0050,
+    P_FUPDATE = 0x0100,
+    P_FAWRITE = 0x0001,
+    P_FAHIDDEN = 0x0002,
+    P_FADIR = 0x0010,
+    P_FAMOD = 0x0020,
+    P_FAREAD = 0x0100,
+    P_FASTREAM = 0x0400
+};
+
+/**
+ * Maximum amount of data in an rfsv16 reply, see lib/rfsv16.cc
+ */
+#define RFSV16_MAXDATALEN 852
+
+static u_int16_t
+siboAttr(const string &name, const struct stat &st)
+{
+    u_int16_t attr = P_FAREAD;
+
+    attr |= S_ISDIR(st.st_mode) ? P_FADIR : (P_FAMOD | P_FASTREAM);
+    if (st.st_mode & S_IWUSR)
+	attr |= P_FAWRITE;
+    if (name[0] == '.')
+	attr |= P_FAHIDDEN;
+    return attr;
+}
+
+int rfsv16Server::
+errorCode(simErr e)
+{
+    static const int codes[] = {
+	rfsv::E_PSI_GEN_NONE,
+	rfsv::E_PSI_FILE_NXIST,
+	rfsv::E_PSI_FILE_DIR,
+	rfsv::E_PSI_FILE_EXIST,
+	rfsv::E_PSI_FILE_ACCESS,
+	rfsv::E_PSI_GEN_INUSE,
+	rfsv::E_PSI_FILE_HANDLE,
+	rfsv::E_PSI_FILE_EOF,
+	rfsv::E_PSI_FILE_FULL,
+	rfsv::E_PSI_FILE_NAME,
+	rfsv::E_PSI_FILE_NOTREADY,
+	rfsv::E_PSI_GEN_NSUP,
+	rfsv::E_PSI_GEN_ARG,
+	rfsv::E_PSI_GEN_FAIL
+    };
+    return codes[e];
+}
+
+void rfsv16Server::
+request(bufferStore &req, bufferStore &reply)
+{
+    bufferStore out;
+
+    if (req.getLen() < 4)
+	return;
+    int cmd = req.getWord(0);
+    req.discardFirstBytes(4);
+    // Strings are zero terminated, make sure the last one is.
+    req.addByte(0);
+    simErr e = dispatch(cmd, req, out);
+    if (e != SIM_OK)
+	out.init();
+    reply.addWord(0x2a);
+    reply.addWord(out.getLen() + 2);
+    reply.addWord(errorCode(e) & 0xffff);
+    reply.addBuff(out);
+}
+
+void rfsv16Server::
+addInfo(bufferStore &out, const struct stat &st)
+{
+    PsiTime t(st.st_mtime);
+
+    out.addWord(2);
+    out.addWord(siboAttr("", st));
+    out.addDWord(S_ISDIR(st.st_mode) ? 0 : st.st_size);
+    out.addDWord(t.getSiboTime());
+    out.addDWord(0);
+}
+
+rfsvServer::simErr rfsv16Server::
+dispatch(int cmd, bufferStore &a, bufferStore &out)
+{
+    // One byte more than sent, see request()
+    long len = a.getLen() - 1;
+    u_int32_t h;
+    u_int32_t n;
+    struct stat st;
+    simErr e;
+    string name;
+
+    switch (cmd) {
+	case FOPEN: {
+	    if (len < 3)
+		return SIM_ARGUMENT;
+	    int mode = a.getWord(0);
+	    name = a.getString(2);
+	    if ((mode & 0xf0) == P_FDIR)
+		e = openDir(name, true, h);
+	    else if ((mode & 0xf0) == P_FDEVICE)
+		e = openDrives(h);
+	    else if ((mode & 0x0f) == P_FUNIQUE)
+		e = makeTemp(name, h);
+	    else {
+		int flags = (mode & P_FUPDATE) ? O_RDWR : O_RDONLY;
+		switch (mode & 0x0f) {
+		    case P_FCREATE:
+			flags = O_RDWR | O_CREAT | O_EXCL;
+			break;
+		    case P_FREPLACE:
+			flags = O_RDWR | O_CREAT | O_TRUNC;
+			break;
+		    case P_FAPPEND:
+			flags = O_RDWR | O_CREAT | O_APPEND;
+			break;
+		}
+		e = openFile(name, flags, h);
+	    }
+	    if (e == SIM_OK)
+		out.addWord(h);
+	    return e;
+	}
+
+	case OPENUNIQUE:
+	    if ((e = makeTemp(name, h)) == SIM_OK) {
+		out.addWord(h);
+		out.addStringT(name.c_str());
+	    }
+	    return e;
+
+	case FCLOSE:
+	case FFLUSH:
+	    if (len < 2)
+		return SIM_ARGUMENT;
+	    if (cmd == FFLUSH)
+		return getHandle(a.getWord(0)) ? SIM_OK : SIM_BAD_HANDLE;
+	    return closeHandle(a.getWord(0));
+
+	case FREAD:
+	    if (len < 4)
+		return SIM_ARGUMENT;
+	    n = a.getWord(2);
+	    if (n > RFSV16_MAXDATALEN)
+		n = RFSV16_MAXDATALEN;
+	    if ((e = read(a.getWord(0), n, out)) != SIM_OK)
+		return e;
+	    return out.empty() ? SIM_EOF : SIM_OK;
+
+	case FWRITE:
+	    if (len < 2)
+		return SIM_ARGUMENT;
+	    return write(a.getWord(0), (const unsigned char *)a.getString(2),
+			 len - 2);
+
+	case FDIRREAD: {
+	    if (len < 2)
+		return SIM_ARGUMENT;
+	    simHandle *sh = getHandle(a.getWord(0));
+	    if (!sh || sh->dir.empty())
+		return SIM_BAD_HANDLE;
+	    bufferStore b;
+	    while (sh->next < sh->entries.size()) {
+		if (b.getLen() + 17 + sh->entries[sh->next].size() >
+		    RFSV16_MAXDATALEN - 2)
+		    break;
+		if (nextEntry(*sh, name, st) == SIM_OK) {
+		    PsiTime t(st.st_mtime);
+		    b.addWord(2);
+		    b.addWord(siboAttr(name, st));
+		    b.addDWord(S_ISDIR(st.st_mode) ? 0 : st.st_size);
+		    b.addDWord(t.getSiboTime());
+		    b.addDWord(0);
+		    b.addStringT(name.c_str());
+		}
+	    }
+	    if (b.empty())
+		return SIM_EOF;
+	    out.addWord(b.getLen());
+	    out.addBuff(b);
+	    return SIM_OK;
+	}
+
+	case FDEVICEREAD: {
+	    if (len < 2)
+		return SIM_ARGUMENT;
+	    simHandle *sh = getHandle(a.getWord(0));
+	    if (!sh || !sh->dir.empty() || (sh->fd != -1))
+		return SIM_BAD_HANDLE;
+	    if ((e = nextEntry(*sh, name, st)) != SIM_OK)
+		return e;
+	    out.addWord(2);
+	    while (out.getLen() < 64)
+		out.addByte(0);
+	    out.addByte(name[0]);
+	    out.addStringT(":");
+	    return SIM_OK;
+	}
+
+	case FSEEK:
+	    if (len < 8)
+		return SIM_ARGUMENT;
+	    e = seek(a.getWord(0), (int32_t)a.getDWord(2), a.getWord(6), n);
+	    if (e == SIM_OK)
+		out.addDWord(n);
+	    return e;
+
+	case FSETEOF:
+	    if (len < 6)
+		return SIM_ARGUMENT;
+	    return setSize(a.getWord(0), a.getDWord(2));
+
+	case FRENAME:
+	    name = a.getString(0);
+	    if ((long)name.size() + 1 >= len)
+		return SIM_ARGUMENT;
+	    return rename(name, a.getString(name.size() + 1), false);
+
+	case FDELETE:
+	    name = a.getString(0);
+	    if ((e = stat(name, st)) != SIM_OK)
+		return e;
+	    return S_ISDIR(st.st_mode) ? rmdir(name) : remove(name);
+
+	case FINFO:
+	    if ((e = stat(a.getString(0), st)) == SIM_OK)
+		addInfo(out, st);
+	    return e;
+
+	case SFSTAT:
+	    if (len < 4)
+		return SIM_ARGUMENT;
+	    name = a.getString(4);
+	    if ((e = stat(name, st)) != SIM_OK)
+		return e;
+	    // The write bit is inverted here, see rfsv16::fsetattr()
+	    if (a.getWord(2) & P_FAWRITE)
+		return setReadOnly(name, a.getWord(0) & P_FAWRITE);
+	    return SIM_OK;
+
+	case PARSE: {
+	    // Only used to find the default drive.
+	    char drive = 0;
+	    for (int i = 25; i >= 0; i--)
+		if (!roots[i].empty() && (!drive || (i == 'C' - 'A')))
+		    drive = 'A' + i;
+	    if (!drive)
+		return SIM_NOT_READY;
+	    for (int i = 0; i < 6; i++)
+		out.addByte(0);
+	    out.addString("LOC::");
+	    out.addByte(drive);
+	    out.addStringT(":\\");
+	    return SIM_OK;
+	}
+
+	case MKDIR:
+	    return mkdir(a.getString(0), false);
+
+	case STATUSDEVICE: {
+	    u_int64_t size, free;
+	    name = a.getString(0);
+	    if ((e = driveSpace(name[0], size, free)) != SIM_OK)
+		return e;
+	    out.addWord(2);
+	    out.addWord(0x2000 | 4);	// internal RAM
+	    out.addWord(0);
+	    out.addDWord((size > 0xffffffffULL) ? 0xffffffff : size);
+	    out.addDWord((free > 0xffffffffULL) ? 0xffffffff : free);
+	    out.addStringT(volumeName(toupper(name[0])).c_str());
+	    return SIM_OK;
+	}
+
+	case SFDATE: {
+	    if (len < 4)
+		return SIM_ARGUMENT;
+	    PsiTime t;
+	    t.setSiboTime(a.getDWord(0));
+	    return setMtime(a.getString(4), t.getTime());
+	}
+    }
+    return SIM_NOT_SUPPORTED;
+}
+
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * End:
+ */
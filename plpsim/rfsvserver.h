@@ -0,0 +1,171 @@
+/*-*-c++-*-
+ * $Id$
+ *
+ * This file is part of plptools.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+#ifndef _SIM_RFSVSERVER_H_
+#define _SIM_RFSVSERVER_H_
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <bufferstore.h>
+#include <plp_inttypes.h>
+
+/**
+ * The SYS$RFSV server of the simulated Psion. The drives of the
+ * Psion are directories on the host. Each NCP channel, which connects
+ * to SYS$RFSV, gets its own server with its own set of handles.
+ * The protocol specific subclasses are created by @ref create .
+ */
+class rfsvServer {
+public:
+    /**
+     * Creates a server for the given protocol variant.
+     *
+     * @param epoc true for the EPOC (rfsv32), false for the
+     *  SIBO (rfsv16) protocol.
+     * @param roots The host directories of the drives A: to Z:.
+     */
+    static rfsvServer *create(bool epoc, const std::string *roots);
+
+    virtual ~rfsvServer();
+
+    /**
+     * Processes a request and builds the reply.
+     *
+     * @param req The complete request message.
+     * @param reply The reply message. Left empty, if there
+     *  is nothing to reply.
+     */
+    virtual void request(bufferStore &req, bufferStore &reply) = 0;
+
+protected:
+    /**
+     * Protocol independent results, which the subclasses
+     * translate to their error codes.
+     */
+    enum simErr {
+	SIM_OK,
+	SIM_NOT_FOUND,
+	SIM_PATH_NOT_FOUND,
+	SIM_EXISTS,
+	SIM_ACCESS,
+	SIM_IN_USE,
+	SIM_BAD_HANDLE,
+	SIM_EOF,
+	SIM_FULL,
+	SIM_BAD_NAME,
+	SIM_NOT_READY,
+	SIM_NOT_SUPPORTED,
+	SIM_ARGUMENT,
+	SIM_GENERAL
+    };
+
+    /**
+     * An open file, directory listing or drive listing.
+     */
+    struct simHandle {
+	int fd;
+	std::string dir;
+	std::vector<std::string> entries;
+	size_t next;
+    };
+
+    rfsvServer(const std::string *roots);
+
+    simErr hostPath(const std::string &name, std::string &path);
+    static simErr fromErrno(int e);
+
+    u_int32_t addHandle(const simHandle &h);
+    simHandle *getHandle(u_int32_t h);
+    simErr closeHandle(u_int32_t h);
+
+    simErr openFile(const std::string &name, int flags, u_int32_t &h);
+    simErr openDir(const std::string &name, bool dirs, u_int32_t &h);
+    simErr openDrives(u_int32_t &h);
+    simErr nextEntry(simHandle &h, std::string &name, struct stat &st);
+    simErr makeTemp(std::string &name, u_int32_t &h);
+    simErr read(u_int32_t h, u_int32_t len, bufferStore &data);
+    simErr write(u_int32_t h, const unsigned char *data, long len);
+    simErr seek(u_int32_t h, int32_t pos, int mode, u_int32_t &res);
+    simErr setSize(u_int32_t h, u_int32_t size);
+    simErr copy(u_int32_t to, u_int32_t from, u_int32_t len, u_int32_t &done);
+    simErr stat(const std::string &name, struct stat &st);
+    simErr remove(const std::string &name);
+    simErr rename(const std::string &from, const std::string &to, bool replace);
+    simErr mkdir(const std::string &name, bool parents);
+    simErr rmdir(const std::string &name);
+    simErr setReadOnly(const std::string &name, bool ronly);
+    simErr setMtime(const std::string &name, time_t t);
+    simErr driveSpace(char drive, u_int64_t &size, u_int64_t &free);
+
+    std::string volumeName(char drive);
+    static std::string baseName(const std::string &name);
+
+    const std::string *roots;
+
+private:
+    std::map<u_int32_t, simHandle> handles;
+    u_int32_t nextHandle;
+};
+
+/**
+ * rfsv32 protocol of EPOC machines.
+ */
+class rfsv32Server : public rfsvServer {
+public:
+    rfsv32Server(const std::string *roots) : rfsvServer(roots) { }
+    void request(bufferStore &req, bufferStore &reply);
+
+private:
+    simErr dispatch(int cmd, bufferStore &a, bufferStore &out);
+    std::string getName(bufferStore &a, long &pos);
+    void addEntry(bufferStore &out, const std::string &name, const struct stat &st);
+    int32_t errorCode(simErr e);
+};
+
+/**
+ * rfsv16 protocol of SIBO machines.
+ */
+class rfsv16Server : public rfsvServer {
+public:
+    rfsv16Server(const std::string *roots) : rfsvServer(roots) { }
+    void request(bufferStore &req, bufferStore &reply);
+
+private:
+    simErr dispatch(int cmd, bufferStore &a, bufferStore &out);
+    void addInfo(bufferStore &out, const struct stat &st);
+    int errorCode(simErr e);
+};
+
+#endif
+
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * End:
+ */
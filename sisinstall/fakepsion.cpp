@@ -41,6 +41,12 @@ FakePsion::dir(const char* dir, PlpDir& files)
 	return rfsv::E_PSI_GEN_NONE;
 }
 
+Enum<rfsv::errs>
+FakePsion::dir(const char*, dirCallback_t, void*)
+{
+	return rfsv::E_PSI_GEN_NONE;
+}
+
 bool
 FakePsion::dirExists(const char* name)
 {
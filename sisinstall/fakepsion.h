@@ -24,6 +24,9 @@ public:
 
 	virtual Enum<rfsv::errs> dir(const char* dir, PlpDir& files);
 
+	virtual Enum<rfsv::errs> dir(const char* dir, dirCallback_t func,
+								 void* ptr);
+
 	virtual bool dirExists(const char* name);
 
 	virtual void disconnect();
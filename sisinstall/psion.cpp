@@ -99,6 +99,12 @@ Psion::dir(const char* dir, PlpDir& files)
 	return m_rfsv->dir(dir, files);
 }
 
+Enum<rfsv::errs>
+Psion::dir(const char* dir, dirCallback_t func, void* ptr)
+{
+	return m_rfsv->dir(dir, func, ptr);
+}
+
 bool
 Psion::dirExists(const char* name)
 {
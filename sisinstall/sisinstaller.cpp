@@ -241,26 +241,28 @@ SISInstaller::installFile(SISFileRecord* fileRecord)
 SisRC
 SISInstaller::loadInstalled()
 {
-        PlpDir files;
         Enum<rfsv::errs> res;
 
-        if ((res = m_psion->dir(SYSTEMINSTALL, files)) != rfsv::E_PSI_GEN_NONE)
+        if ((res = m_psion->dir(SYSTEMINSTALL, loadInstalledEntry, this)) != rfsv::E_PSI_GEN_NONE)
                 {
                 return SIS_FAILED;
                 }
-        else
-                {
-                while (!files.empty())
-                        {
-                        PlpDirent file = files[0];
-                        if (logLevel >= 1)
-                                fprintf(stderr, "Loading sis file `%s'\n", file.getName());
-                        char sisname[256];
-                        sprintf(sisname, "%s%s", SYSTEMINSTALL, file.getName());
-                        loadPsionSis(sisname);
-                        files.pop_front();
-                        }
-                }
+        return SIS_OK;
+}
+
+/**
+ * Called for every file in the install directory, while it is being read.
+ */
+int
+SISInstaller::loadInstalledEntry(void* ptr, PlpDirent& file)
+{
+        SISInstaller* installer = (SISInstaller*)ptr;
+        if (logLevel >= 1)
+                fprintf(stderr, "Loading sis file `%s'\n", file.getName());
+        char sisname[256];
+        sprintf(sisname, "%s%s", SYSTEMINSTALL, file.getName());
+        installer->loadPsionSis(sisname);
+        return 1;
 }
 
 void
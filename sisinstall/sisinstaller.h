@@ -6,6 +6,7 @@
 #include <sys/types.h>
 
 class Psion;
+class PlpDirent;
 class SISFile;
 class SISFileLink;
 class SISFileRecord;
@@ -86,6 +87,8 @@ private:
 
 	SisRC loadInstalled();
 
+	static int loadInstalledEntry(void* ptr, PlpDirent& file);
+
 	void loadPsionSis(const char* name);
 
 	void removeFile(SISFileRecord* fileRecord);